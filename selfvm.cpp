@@ -0,0 +1,4153 @@
+// VM engines and the libselfvm API
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <fstream>
+#include <array>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <math.h>
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#if defined(__x86_64__) && defined(__linux__)
+#define VM_JIT 1
+#include <sys/mman.h>
+#endif
+#if defined(__GNUC__)
+#define VM_LOCKSTEP 1 // vector extensions
+#if defined(__x86_64__)
+#define VM_LOCKSTEP_X86 1
+#include <immintrin.h>
+#endif
+#endif
+#if defined(__unix__)
+#define VM_PROCESS_ID 1
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#define VM_PIN_THREADS 1
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "vm.h"
+#include "vm-asm.h"
+#include "vm-bytecode.h"
+#include "vm-machine.h"
+#include "vm-sampler.h"
+#include "vm-perf.h"
+#include "selfvm.h"
+#if VM_EMBED_EXECUTE_PROGRAM
+#include "execute_program_unit.h"
+#endif
+
+/*
+* Reference engine
+*
+* Runs execute() instantiated for an ExecPolicy chosen at load time from
+* command line options and what analyzeProgram() can prove about the
+* program: addressing checks are dropped for programs with only direct,
+* in-bounds operands and valid jump targets inside the program which
+* never store into it, dbg output is compiled out of programs without
+* dbg/dbgext. Cycles are always counted, they're part of the result, unless
+* the options drop them; options can also drop checks for programs
+* verified offline. On guarded memory the remaining data bounds checks are
+* replaced by faults on the guard region.
+*/
+
+struct ProgramTraits
+{
+    bool static_addr; // no indirect access, operands in bounds, jumps to program instructions
+    bool has_dbg;     // dbg or dbgext
+};
+
+void analyzeProgram(ProgramTraits& traits, const Machine& m, const std::vector<Op>& ops)
+{
+    const auto count = static_cast<int64_t>(ops.size());
+    const int64_t code_start = m.data_offset - count * InstSize;
+    auto isDataAddr = [&m](int32_t arg) {
+        return static_cast<uint32_t>(arg + m.data_offset) < static_cast<uint32_t>(m.mem_size);
+    };
+    auto isCodeAddr = [&m, code_start](int32_t arg) {
+        const int64_t addr = static_cast<int64_t>(arg) + m.data_offset;
+        return addr >= code_start && addr < m.data_offset;
+    };
+    // target instruction index of a relative jump from instruction k, -1 if invalid
+    auto getTarget = [count](int64_t k, int32_t rel) -> int64_t {
+        if ((rel % InstSize) != 0)
+            return -1;
+        const int64_t target = k - rel / InstSize;
+        return target >= 0 && target < count ? target : -1;
+    };
+
+    traits.static_addr = count > 0;
+    traits.has_dbg = false;
+    for(int64_t k = 0; k < count; ++k) {
+        const Op& op = ops[static_cast<size_t>(k)];
+        switch(op.code) {
+        case OpCode::Nop:
+        case OpCode::Hlt:
+            break;
+        case OpCode::Dbgext:
+            traits.has_dbg = true;
+            break;
+        case OpCode::Dbg:
+            traits.has_dbg = true;
+            traits.static_addr &= isDataAddr(op.arg1);
+            break;
+        case OpCode::Jr:
+        case OpCode::Jnz:
+        case OpCode::Jz:
+        case OpCode::Jg:
+        case OpCode::Jge:
+        case OpCode::Jl:
+        case OpCode::Jle:
+        {
+            const int64_t target = getTarget(k, op.arg1);
+            if (op.code != OpCode::Jr)
+                traits.static_addr &= isDataAddr(op.arg2);
+            traits.static_addr &= target >= 0;
+            break;
+        }
+        case OpCode::Ja:
+        case OpCode::Ld:
+        case OpCode::St:
+        case OpCode::Stv:
+            traits.static_addr = false;
+            break;
+        case OpCode::Lia:
+        case OpCode::Movv:
+        case OpCode::Addv:
+        case OpCode::Subv:
+        case OpCode::Mulv:
+        case OpCode::Divv:
+            traits.static_addr &= isDataAddr(op.arg1) && !isCodeAddr(op.arg1);
+            break;
+        case OpCode::Mov:
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+            traits.static_addr &= isDataAddr(op.arg1) && !isCodeAddr(op.arg1) && isDataAddr(op.arg2);
+            break;
+        default:
+            traits.static_addr = false;
+            break;
+        }
+    }
+    // falling off the end runs whatever is below the program
+    if (count > 0) {
+        const OpCode last = ops.back().code;
+        traits.static_addr &= last == OpCode::Hlt || last == OpCode::Jr;
+    }
+}
+
+// runs budget cycles, or to the end when cycles aren't counted
+template<typename Policy>
+Result runReference(Machine& m, int64_t budget)
+{
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    auto run = [&m, stop_cycles]() {
+        Result res;
+        do {
+            res = execute<Policy>(m);
+        } while(res == Result::Continue && (!Policy::counted_cycles || m.cycles < stop_cycles));
+        return res;
+    };
+#if VM_GUARDED_MEMORY
+    if (Policy::guarded_data)
+        return runGuarded(m.mem, Result::InvalidDataAddr, run);
+#endif
+    return run();
+}
+
+typedef Result (*ReferenceRun)(Machine& m, int64_t budget);
+
+// picks the instantiation of runReference() for runtime flags, one at a time
+template<bool... Flags>
+struct ReferenceSelect
+{
+    template<typename... Rest>
+    static ReferenceRun get(bool flag, Rest... rest)
+    {
+        return flag ? ReferenceSelect<Flags..., true>::get(rest...) : ReferenceSelect<Flags..., false>::get(rest...);
+    }
+
+    static ReferenceRun get()
+    {
+        return &runReference<ExecPolicy<Flags...>>;
+    }
+};
+
+ReferenceRun selectReference(const ProgramTraits& traits, const PolicyOptions& options, const Machine& m,
+    bool& checked_addr, bool& counted_cycles, bool& dbg, bool& guarded_data)
+{
+    dbg = traits.has_dbg && !options.no_dbg;
+    checked_addr = !options.unchecked && !traits.static_addr;
+    counted_cycles = !options.uncounted;
+    guarded_data = checked_addr && m.mem.backend == MemoryBackend::Guarded;
+    return ReferenceSelect<>::get(checked_addr, counted_cycles, dbg, options.trace, guarded_data, options.profile);
+}
+
+/*
+* Threaded engine
+*
+* Same semantics as calling execute() in a loop, but machine state is kept
+* in locals and every handler dispatches the next instruction by itself
+* (computed goto when compiler supports it, plain switch otherwise).
+* Returns on halt, fault, cycle limit, or with Result::Continue after
+* budget instructions were executed.
+*/
+
+#if defined(__GNUC__)
+#define VM_THREADED_DISPATCH 1
+#endif
+
+// keeps gcc from merging the replicated dispatch tails back into one jump
+#if defined(__GNUC__) && !defined(__clang__)
+#define VM_DISPATCH_FUNC __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define VM_DISPATCH_FUNC
+#endif
+
+VM_DISPATCH_FUNC Result run(Machine& m, int64_t budget)
+{
+    int32_t* const mem = m.mem.data();
+    const uint32_t data_offset = static_cast<uint32_t>(m.data_offset);
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const int64_t max_cycles = m.max_cycles;
+    int64_t cycles = m.cycles;
+    // single compare after every instruction covers both cycle limit and budget
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    int32_t inst_addr = m.inst_addr - InstSize;
+    int32_t next_addr;
+    Result res;
+
+    #define GetAddr(ret, arg) \
+        const uint32_t ret = static_cast<uint32_t>(arg) + data_offset; \
+        if (ret >= mem_size) \
+            goto fault_data;
+    #define DoJump(base_addr, rel_addr) { \
+        if ((rel_addr % InstSize) != 0) \
+            goto fault_jump; \
+        const int64_t inst_addr2 = static_cast<int64_t>(base_addr) + rel_addr; \
+        if (inst_addr2 < 0 || inst_addr2 >= mem_size) \
+            goto fault_jump; \
+        next_addr = static_cast<int32_t>(inst_addr2); \
+    }
+    #define Arg1 mem[static_cast<uint32_t>(inst_addr + 1)]
+    #define Arg2 mem[static_cast<uint32_t>(inst_addr)]
+
+#ifdef VM_THREADED_DISPATCH
+    static const void* const dispatch_table[] = {
+        &&op_Nop, &&op_Hlt, &&op_Jr, &&op_Ja,
+        &&op_Jnz, &&op_Jz, &&op_Jg, &&op_Jge, &&op_Jl, &&op_Jle,
+        &&op_Lia, &&op_Ld, &&op_St, &&op_Stv,
+        &&op_Mov, &&op_Add, &&op_Sub, &&op_Mul, &&op_Div,
+        &&op_Movv, &&op_Addv, &&op_Subv, &&op_Mulv, &&op_Divv,
+        &&op_Dbg, &&op_Dbgext
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+        static_cast<size_t>(OpCode::Dbgext) + 1, "dispatch table out of sync with OpCode");
+    #define Case(name) op_##name:
+    #define Dispatch { \
+        if (static_cast<uint32_t>(inst_addr) > mem_size - InstSize) \
+            goto fault_inst; \
+        const uint32_t opcode = static_cast<uint32_t>(mem[static_cast<uint32_t>(inst_addr + 2)]); \
+        if (opcode > static_cast<uint32_t>(OpCode::Dbgext)) \
+            goto fault_opcode; \
+        goto *dispatch_table[opcode]; \
+    }
+#else
+    #define Case(name) case OpCode::name:
+    #define Dispatch goto dispatch;
+#endif
+    #define Next(addr) { \
+        if (++cycles >= stop_cycles) { \
+            next_addr = addr; \
+            goto stop; \
+        } \
+        inst_addr = addr; \
+        Dispatch \
+    }
+    #define NextInst Next(inst_addr - InstSize)
+    #define NextJump Next(next_addr)
+
+#ifdef VM_THREADED_DISPATCH
+    Dispatch
+#else
+dispatch:
+    if (static_cast<uint32_t>(inst_addr) > mem_size - InstSize)
+        goto fault_inst;
+    switch(static_cast<OpCode>(mem[static_cast<uint32_t>(inst_addr + 2)])) {
+#endif
+    Case(Nop)
+        NextInst
+    Case(Hlt)
+        res = Result::Halt;
+        goto fault;
+    Case(Ja)
+    {
+        GetAddr(addr1, Arg1)
+        const int32_t rel_addr = static_cast<int32_t>(static_cast<uint32_t>(mem[addr1]) + 1);
+        DoJump(static_cast<int32_t>(data_offset) - InstSize, rel_addr)
+        NextJump
+    }
+    Case(Jr)
+    {
+        const int32_t rel_addr = Arg1;
+        DoJump(inst_addr, rel_addr)
+        NextJump
+    }
+    #define CondJump(name, cond) \
+    Case(name) \
+    { \
+        GetAddr(addr2, Arg2) \
+        if (mem[addr2] cond 0) { \
+            const int32_t rel_addr = Arg1; \
+            DoJump(inst_addr, rel_addr) \
+            NextJump \
+        } \
+        NextInst \
+    }
+    CondJump(Jnz, !=)
+    CondJump(Jz, ==)
+    CondJump(Jg, >)
+    CondJump(Jge, >=)
+    CondJump(Jl, <)
+    CondJump(Jle, <=)
+    #undef CondJump
+    Case(Lia)
+    {
+        GetAddr(addr1, Arg1)
+        const uint32_t abs_addr = static_cast<uint32_t>(inst_addr) + InstSize - 1 + static_cast<uint32_t>(Arg2);
+        mem[addr1] = static_cast<int32_t>(abs_addr - data_offset);
+        NextInst
+    }
+    Case(Ld)
+    {
+        GetAddr(addr1, Arg1)
+        GetAddr(paddr2, Arg2)
+        GetAddr(addr2, mem[paddr2])
+        mem[addr1] = mem[addr2];
+        NextInst
+    }
+    Case(St)
+    {
+        GetAddr(paddr1, Arg1)
+        GetAddr(addr1, mem[paddr1])
+        GetAddr(addr2, Arg2)
+        mem[addr1] = mem[addr2];
+        NextInst
+    }
+    Case(Stv)
+    {
+        GetAddr(paddr1, Arg1)
+        GetAddr(addr1, mem[paddr1])
+        mem[addr1] = Arg2;
+        NextInst
+    }
+    #define BinaryOp(name, expr) \
+    Case(name) \
+    { \
+        GetAddr(addr1, Arg1) \
+        GetAddr(addr2, Arg2) \
+        const uint32_t a = static_cast<uint32_t>(mem[addr1]); \
+        const uint32_t b = static_cast<uint32_t>(mem[addr2]); \
+        mem[addr1] = static_cast<int32_t>(expr); \
+        NextInst \
+    }
+    #define BinaryOpValue(name, expr) \
+    Case(name) \
+    { \
+        GetAddr(addr1, Arg1) \
+        const uint32_t a = static_cast<uint32_t>(mem[addr1]); \
+        const uint32_t b = static_cast<uint32_t>(Arg2); \
+        mem[addr1] = static_cast<int32_t>(expr); \
+        NextInst \
+    }
+    Case(Mov)
+    {
+        GetAddr(addr1, Arg1)
+        GetAddr(addr2, Arg2)
+        mem[addr1] = mem[addr2];
+        NextInst
+    }
+    BinaryOp(Add, a + b)
+    BinaryOp(Sub, a - b)
+    BinaryOp(Mul, a * b)
+    Case(Div)
+    {
+        GetAddr(addr1, Arg1)
+        GetAddr(addr2, Arg2)
+        const int32_t d = mem[addr2];
+        if (!d)
+            goto fault_divzero;
+        mem[addr1] /= d;
+        NextInst
+    }
+    Case(Movv)
+    {
+        GetAddr(addr1, Arg1)
+        mem[addr1] = Arg2;
+        NextInst
+    }
+    BinaryOpValue(Addv, a + b)
+    BinaryOpValue(Subv, a - b)
+    BinaryOpValue(Mulv, a * b)
+    Case(Divv)
+    {
+        GetAddr(addr1, Arg1)
+        const int32_t d = Arg2;
+        if (!d)
+            goto fault_divzero;
+        mem[addr1] /= d;
+        NextInst
+    }
+    #undef BinaryOpValue
+    #undef BinaryOp
+    Case(Dbg)
+    {
+        const int32_t arg1 = Arg1;
+        GetAddr(addr1, arg1)
+        m.output->dbg(static_cast<int32_t>(addr1), arg1, mem[addr1]);
+        NextInst
+    }
+    Case(Dbgext)
+    {
+        writeDbgext(m, cycles);
+        NextInst
+    }
+#ifndef VM_THREADED_DISPATCH
+    default:
+        goto fault_opcode;
+    }
+#endif
+
+fault_inst:
+    res = Result::InvalidInstAddr;
+    goto fault;
+fault_opcode:
+    res = Result::InvalidOpCode;
+    goto fault;
+fault_data:
+    res = Result::InvalidDataAddr;
+    goto fault;
+fault_jump:
+    res = Result::InvalidJumpAddr;
+    goto fault;
+fault_divzero:
+    res = Result::DivByZero;
+fault:
+    // halt and faults leave inst_addr at the failing instruction
+    m.inst_addr = inst_addr;
+    m.cycles = cycles;
+    return res;
+stop:
+    m.inst_addr = next_addr + InstSize;
+    m.cycles = cycles;
+    return cycles >= max_cycles ? Result::InfiniteLoop : Result::Continue;
+
+    #undef NextJump
+    #undef NextInst
+    #undef Next
+    #undef Dispatch
+    #undef Case
+    #undef Arg2
+    #undef Arg1
+    #undef DoJump
+    #undef GetAddr
+}
+
+/*
+* Decoded engine
+*
+* Instructions are decoded on first execution into DecodedCode, one slot per
+* possible instruction position: handler id, operands resolved to absolute
+* memory offsets (or immediate values) and jump targets resolved to slots.
+* Operands that can be validated statically are validated at decode time,
+* so handlers only check what depends on memory contents.
+*
+* Machine memory stays the source of truth: stores check a per-page flag
+* and reset the slot they hit to undecoded, so self-modifying code is
+* re-decoded before it runs again. Memory modified by anything else than
+* runDecoded() requires resetDecodedCode().
+*
+* Superinstructions: a slot can be decoded to a fused handler which runs
+* it together with the following one or two instructions in one dispatch.
+* Fused handlers only replace the handler of the first slot, operands are
+* read from the slots of every instruction as usual. Which of the fused
+* handlers are used is chosen from an opcode pair/triple profile, see
+* selectFusions().
+*/
+
+// superinstruction catalog, sequences common in vm-gen generated code
+#define VM_FUSED_PAIRS(X) \
+    X(Subv, Jg) \
+    X(Mov, Subv) \
+    X(Subv, Ld) \
+    X(Ld, Subv) \
+    X(Mov, Sub) \
+    X(Sub, Jl) \
+    X(Sub, Jge) \
+    X(Add, Mov) \
+    X(Ld, Mov) \
+    X(Mov, Jl) \
+    X(Jl, Subv) \
+    X(Jge, Ld) \
+    X(Sub, St) \
+    X(St, Jr) \
+    X(Mov, Add)
+#define VM_FUSED_TRIPLES(X) \
+    X(Mov, Subv, Jg) \
+    X(Subv, Ld, Subv) \
+    X(Ld, Subv, Ld) \
+    X(Mov, Sub, Jl) \
+    X(Sub, Jge, Ld) \
+    X(Sub, Jl, Sub) \
+    X(Add, Mov, Sub) \
+    X(Mov, Jl, Subv) \
+    X(Subv, Jg, Add) \
+    X(Sub, St, Jr)
+
+enum class DecodedOp : uint8_t
+{
+    Undecoded = 0,
+    Nop,
+    Hlt,
+    Jr,
+    Ja,
+    Jnz,
+    Jz,
+    Jg,
+    Jge,
+    Jl,
+    Jle,
+    Lia,
+    Ld,
+    St,
+    Stv,
+    Mov,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Movv,
+    Addv,
+    Subv,
+    Mulv,
+    Divv,
+    Dbg,
+    Dbgext,
+    FaultInst,
+    FaultOpCode,
+    FaultData,
+    FaultJump,
+    FaultDivZero,
+    #define FusedPairId(a, b) a##_##b,
+    #define FusedTripleId(a, b, c) a##_##b##_##c,
+    VM_FUSED_PAIRS(FusedPairId)
+    VM_FUSED_TRIPLES(FusedTripleId)
+    #undef FusedTripleId
+    #undef FusedPairId
+    Count
+};
+
+constexpr uint32_t FirstFusedOp = static_cast<uint32_t>(DecodedOp::FaultDivZero) + 1;
+constexpr uint32_t FusedOpCount = static_cast<uint32_t>(DecodedOp::Count) - FirstFusedOp;
+
+struct FusedOpDef
+{
+    DecodedOp id;
+    const char* name;
+    uint32_t length;
+    OpCode ops[3];
+};
+
+const static FusedOpDef fused_op_def[] = {
+    #define FusedPairDef(a, b) { DecodedOp::a##_##b, #a "+" #b, 2, { OpCode::a, OpCode::b, OpCode::Nop } },
+    #define FusedTripleDef(a, b, c) { DecodedOp::a##_##b##_##c, #a "+" #b "+" #c, 3, { OpCode::a, OpCode::b, OpCode::c } },
+    VM_FUSED_PAIRS(FusedPairDef)
+    VM_FUSED_TRIPLES(FusedTripleDef)
+    #undef FusedTripleDef
+    #undef FusedPairDef
+};
+static_assert(sizeof(fused_op_def) / sizeof(fused_op_def[0]) == FusedOpCount, "fused_op_def out of sync");
+
+constexpr uint32_t CodePageShift = 6; // 64 words per write tracking page
+
+struct DecodedCode
+{
+    int32_t data_offset; // machine layout the slots were built for
+    int32_t mem_size;
+    int32_t slot_base; // inst_addr of slot 0 (always invalid, a sentinel)
+    uint32_t page_bias; // aligns pages to data_offset, so code and data don't share one
+    // struct of arrays, one entry per slot:
+    //   op = handler
+    //   arg1 = resolved arg1 address, or target slot of a relative jump (-1 if invalid)
+    //   arg2 = resolved arg2 address or immediate value
+    std::vector<DecodedOp> op;
+    std::vector<int32_t> arg1;
+    std::vector<int32_t> arg2;
+    std::vector<uint8_t> code_pages; // set for memory pages with decoded slots
+    // profile count of every fused handler, 0 = not used
+    std::array<uint64_t, FusedOpCount> fusion_weight{};
+    // if set, runDecoded() appends slots invalidated by stores
+    std::vector<uint32_t>* invalidation_log = nullptr;
+};
+
+void resetDecodedCode(DecodedCode& code, const Machine& m)
+{
+    code.data_offset = m.data_offset;
+    code.mem_size = m.mem_size;
+    code.slot_base = m.data_offset % InstSize - InstSize;
+    // slot of the last possible jump target, plus two slots invalidation may touch above it
+    const size_t slot_count = static_cast<size_t>((m.mem_size - code.slot_base) / InstSize + 3);
+    code.op.assign(slot_count, DecodedOp::Undecoded);
+    code.arg1.assign(slot_count, 0);
+    code.arg2.assign(slot_count, 0);
+    code.page_bias = static_cast<uint32_t>(-m.data_offset) & ((1u << CodePageShift) - 1);
+    code.code_pages.assign((static_cast<size_t>(m.mem_size + code.page_bias) >> CodePageShift) + 1, 0);
+}
+
+inline uint32_t getCodePage(const DecodedCode& code, uint32_t addr)
+{
+    return (addr + code.page_bias) >> CodePageShift;
+}
+
+// slot of the instruction at inst_addr, or of the instruction containing word addr
+inline uint32_t getSlot(const DecodedCode& code, uint32_t addr)
+{
+    return (addr - static_cast<uint32_t>(code.slot_base)) / InstSize;
+}
+
+// same as a store in runDecoded() does, for memory written by other means
+void invalidateDecodedCode(DecodedCode& code, uint32_t addr)
+{
+    if (!code.code_pages[getCodePage(code, addr)])
+        return;
+    const uint32_t slot = getSlot(code, addr);
+    code.op[slot] = DecodedOp::Undecoded;
+    code.op[slot + 1] = DecodedOp::Undecoded;
+    code.op[slot + 2] = DecodedOp::Undecoded;
+}
+
+void decodeSlot(DecodedCode& code, const Machine& m, uint32_t slot);
+
+// replaces handler of a decoded slot with the heaviest enabled superinstruction starting there
+void fuseSlot(DecodedCode& code, const Machine& m, uint32_t slot)
+{
+    DecodedOp seq[3] = { code.op[slot], DecodedOp::Undecoded, DecodedOp::Undecoded };
+    if (seq[0] >= DecodedOp::FaultInst || std::all_of(code.fusion_weight.begin(),
+        code.fusion_weight.end(), [](uint64_t w) { return w == 0; }))
+        return;
+    for(uint32_t i = 1; i < 3 && slot >= i; ++i) {
+        if (code.op[slot - i] == DecodedOp::Undecoded)
+            decodeSlot(code, m, slot - i);
+        seq[i] = code.op[slot - i];
+        if (static_cast<uint32_t>(seq[i]) >= FirstFusedOp) // already fused, take its first op
+            seq[i] = static_cast<DecodedOp>(static_cast<uint32_t>(fused_op_def[
+                static_cast<uint32_t>(seq[i]) - FirstFusedOp].ops[0]) + 1);
+    }
+    uint64_t best_weight = 0;
+    for(uint32_t i = 0; i < FusedOpCount; ++i) {
+        const auto& d = fused_op_def[i];
+        if (code.fusion_weight[i] <= best_weight)
+            continue;
+        uint32_t k = 0;
+        while(k < d.length && seq[k] == static_cast<DecodedOp>(static_cast<uint32_t>(d.ops[k]) + 1))
+            ++k;
+        if (k == d.length) {
+            best_weight = code.fusion_weight[i];
+            code.op[slot] = d.id;
+        }
+    }
+}
+
+void decodeSlot(DecodedCode& code, const Machine& m, uint32_t slot)
+{
+    const uint32_t data_offset = static_cast<uint32_t>(m.data_offset);
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const int32_t inst_addr = code.slot_base + static_cast<int32_t>(slot) * InstSize;
+    DecodedOp& op = code.op[slot];
+    int32_t& arg1 = code.arg1[slot];
+    int32_t& arg2 = code.arg2[slot];
+    if (inst_addr < 0 || inst_addr > m.mem_size - InstSize) {
+        op = DecodedOp::FaultInst;
+        return;
+    }
+    code.code_pages[getCodePage(code, static_cast<uint32_t>(inst_addr))] = 1;
+    code.code_pages[getCodePage(code, static_cast<uint32_t>(inst_addr + 2))] = 1;
+
+    const int32_t raw_opcode = m.mem[static_cast<uint32_t>(inst_addr + 2)];
+    const int32_t raw_arg1 = m.mem[static_cast<uint32_t>(inst_addr + 1)];
+    const int32_t raw_arg2 = m.mem[static_cast<uint32_t>(inst_addr)];
+    if (static_cast<uint32_t>(raw_opcode) >= OpCodeCount) {
+        op = DecodedOp::FaultOpCode;
+        return;
+    }
+    const OpCode opcode = static_cast<OpCode>(raw_opcode);
+    // handlers share numbering with opcodes, shifted by the undecoded marker
+    op = static_cast<DecodedOp>(raw_opcode + 1);
+
+    auto getAddr = [&](int32_t arg, int32_t& ret) {
+        const uint32_t addr = static_cast<uint32_t>(arg) + data_offset;
+        ret = static_cast<int32_t>(addr);
+        return addr < mem_size;
+    };
+    auto getTarget = [&](int32_t rel_addr) {
+        if ((rel_addr % InstSize) != 0)
+            return -1;
+        const int64_t inst_addr2 = static_cast<int64_t>(inst_addr) + rel_addr;
+        if (inst_addr2 < 0 || inst_addr2 >= mem_size)
+            return -1;
+        return static_cast<int32_t>(getSlot(code, static_cast<uint32_t>(inst_addr2)));
+    };
+
+    switch(opcode) {
+    case OpCode::Nop:
+    case OpCode::Hlt:
+    case OpCode::Dbgext:
+        break;
+    case OpCode::Jr:
+        arg1 = getTarget(raw_arg1);
+        if (arg1 < 0)
+            op = DecodedOp::FaultJump;
+        break;
+    case OpCode::Ja:
+        if (!getAddr(raw_arg1, arg1))
+            op = DecodedOp::FaultData;
+        break;
+    case OpCode::Jnz:
+    case OpCode::Jz:
+    case OpCode::Jg:
+    case OpCode::Jge:
+    case OpCode::Jl:
+    case OpCode::Jle:
+        if (!getAddr(raw_arg2, arg2))
+            op = DecodedOp::FaultData;
+        arg1 = getTarget(raw_arg1);
+        break;
+    case OpCode::Lia:
+        if (!getAddr(raw_arg1, arg1))
+            op = DecodedOp::FaultData;
+        arg2 = static_cast<int32_t>(static_cast<uint32_t>(inst_addr) + InstSize - 1 +
+            static_cast<uint32_t>(raw_arg2) - data_offset);
+        break;
+    case OpCode::Ld:
+    case OpCode::St:
+    case OpCode::Mov:
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+        if (!getAddr(raw_arg1, arg1) || !getAddr(raw_arg2, arg2))
+            op = DecodedOp::FaultData;
+        break;
+    case OpCode::Stv:
+    case OpCode::Movv:
+    case OpCode::Addv:
+    case OpCode::Subv:
+    case OpCode::Mulv:
+        if (!getAddr(raw_arg1, arg1))
+            op = DecodedOp::FaultData;
+        arg2 = raw_arg2;
+        break;
+    case OpCode::Divv:
+        if (!getAddr(raw_arg1, arg1))
+            op = DecodedOp::FaultData;
+        else if (!raw_arg2)
+            op = DecodedOp::FaultDivZero;
+        arg2 = raw_arg2;
+        break;
+    case OpCode::Dbg:
+        if (!getAddr(raw_arg1, arg1))
+            op = DecodedOp::FaultData;
+        arg2 = raw_arg1; // printed as is
+        break;
+    }
+}
+
+/*
+* Opcode pair and triple frequencies of executed instructions,
+* collected by profileFusions() and used by selectFusions().
+*/
+struct FusionProfile
+{
+    uint64_t total;
+    std::vector<uint64_t> pairs; // [a * OpCodeCount + b]
+    std::vector<uint64_t> triples; // [(a * OpCodeCount + b) * OpCodeCount + c]
+};
+
+void resetFusionProfile(FusionProfile& profile)
+{
+    profile.total = 0;
+    profile.pairs.assign(OpCodeCount * OpCodeCount, 0);
+    profile.triples.assign(OpCodeCount * OpCodeCount * OpCodeCount, 0);
+}
+
+// runs up to budget instructions with execute() while recording opcode sequences;
+// a taken jump breaks the sequence, since fused instructions never span one
+Result profileFusions(FusionProfile& profile, Machine& m, int32_t budget)
+{
+    uint32_t prev1 = OpCodeCount, prev2 = OpCodeCount;
+    Result res = Result::Continue;
+    for(int32_t i = 0; i < budget && res == Result::Continue; ++i) {
+        const int32_t inst_addr = m.inst_addr - InstSize;
+        uint32_t opcode = OpCodeCount;
+        if (inst_addr >= 0 && inst_addr <= m.mem_size - InstSize)
+            opcode = static_cast<uint32_t>(m.mem[static_cast<uint32_t>(inst_addr + 2)]);
+        res = execute(m);
+        if (opcode >= OpCodeCount)
+            continue;
+        ++profile.total;
+        if (prev1 < OpCodeCount) {
+            profile.pairs[prev1 * OpCodeCount + opcode] += 1;
+            if (prev2 < OpCodeCount)
+                profile.triples[(prev2 * OpCodeCount + prev1) * OpCodeCount + opcode] += 1;
+        }
+        const bool fallthrough = (m.inst_addr == inst_addr);
+        prev2 = fallthrough ? prev1 : OpCodeCount;
+        prev1 = fallthrough ? opcode : OpCodeCount;
+    }
+    return res;
+}
+
+// enables superinstructions which cover at least min_share of profiled instructions,
+// weighting each one by the number of dispatches it would save
+void selectFusions(DecodedCode& code, const FusionProfile& profile, double min_share)
+{
+    for(uint32_t i = 0; i < FusedOpCount; ++i) {
+        const auto& d = fused_op_def[i];
+        const uint32_t a = static_cast<uint32_t>(d.ops[0]);
+        const uint32_t b = static_cast<uint32_t>(d.ops[1]);
+        const uint32_t c = static_cast<uint32_t>(d.ops[2]);
+        const uint64_t count = (d.length == 2) ? profile.pairs[a * OpCodeCount + b] :
+            profile.triples[(a * OpCodeCount + b) * OpCodeCount + c];
+        const bool enabled = count > 0 && count >= min_share * static_cast<double>(profile.total);
+        code.fusion_weight[i] = enabled ? count * (d.length - 1) : 0;
+    }
+    std::fill(code.op.begin(), code.op.end(), DecodedOp::Undecoded);
+}
+
+void dumpFusions(const DecodedCode& code, const FusionProfile& profile, std::ostream& os)
+{
+    os << "superinstructions (profiled " << profile.total << " instructions):" << std::endl;
+    for(uint32_t i = 0; i < FusedOpCount; ++i) {
+        if (code.fusion_weight[i])
+            os << "  " << fused_op_def[i].name << " saves " << code.fusion_weight[i] << std::endl;
+    }
+}
+
+VM_DISPATCH_FUNC Result runDecoded(Machine& m, DecodedCode& code, int64_t budget)
+{
+    const int32_t start_addr = m.inst_addr - InstSize;
+    if (code.data_offset != m.data_offset || code.mem_size != m.mem_size)
+        resetDecodedCode(code, m);
+    if (start_addr < 0 || start_addr > m.mem_size - InstSize ||
+        (start_addr - code.slot_base) % InstSize != 0)
+        return run(m, budget); // not a slot, let threaded engine report it
+
+    int32_t* const mem = m.mem.data();
+    const uint32_t data_offset = static_cast<uint32_t>(m.data_offset);
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const int32_t slot_base = code.slot_base;
+    DecodedOp* const ops = code.op.data();
+    const int32_t* const args1 = code.arg1.data();
+    const int32_t* const args2 = code.arg2.data();
+    const uint8_t* const code_pages = code.code_pages.data();
+    const uint32_t page_bias = code.page_bias;
+    const int64_t max_cycles = m.max_cycles;
+    int64_t cycles = m.cycles;
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    uint32_t slot = getSlot(code, static_cast<uint32_t>(start_addr));
+    uint32_t next_slot;
+    Result res;
+
+    // a store also resets up to two slots above the hit one, which may be
+    // superinstructions covering it
+    #define Store(addr, value) { \
+        const uint32_t store_addr = addr; \
+        mem[store_addr] = value; \
+        if (code_pages[(store_addr + page_bias) >> CodePageShift]) { \
+            const uint32_t store_slot = (store_addr - static_cast<uint32_t>(slot_base)) / InstSize; \
+            ops[store_slot] = DecodedOp::Undecoded; \
+            ops[store_slot + 1] = DecodedOp::Undecoded; \
+            ops[store_slot + 2] = DecodedOp::Undecoded; \
+            if (code.invalidation_log) \
+                code.invalidation_log->push_back(store_slot); \
+        } \
+    }
+    #define GetAddr(ret, arg, s) \
+        const uint32_t ret = static_cast<uint32_t>(arg) + data_offset; \
+        if (ret >= mem_size) \
+            Fault(s, fault_data)
+    #define Fault(s, label) { \
+        slot = s; \
+        goto label; \
+    }
+
+#ifdef VM_THREADED_DISPATCH
+    static const void* const dispatch_table[] = {
+        &&op_Undecoded,
+        &&op_Nop, &&op_Hlt, &&op_Jr, &&op_Ja,
+        &&op_Jnz, &&op_Jz, &&op_Jg, &&op_Jge, &&op_Jl, &&op_Jle,
+        &&op_Lia, &&op_Ld, &&op_St, &&op_Stv,
+        &&op_Mov, &&op_Add, &&op_Sub, &&op_Mul, &&op_Div,
+        &&op_Movv, &&op_Addv, &&op_Subv, &&op_Mulv, &&op_Divv,
+        &&op_Dbg, &&op_Dbgext,
+        &&op_FaultInst, &&op_FaultOpCode, &&op_FaultData, &&op_FaultJump, &&op_FaultDivZero,
+        #define FusedPairLabel(a, b) &&op_##a##_##b,
+        #define FusedTripleLabel(a, b, c) &&op_##a##_##b##_##c,
+        VM_FUSED_PAIRS(FusedPairLabel)
+        VM_FUSED_TRIPLES(FusedTripleLabel)
+        #undef FusedTripleLabel
+        #undef FusedPairLabel
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+        static_cast<size_t>(DecodedOp::Count), "dispatch table out of sync with DecodedOp");
+    #define Case(name) op_##name:
+    #define Dispatch goto *dispatch_table[static_cast<uint32_t>(ops[slot])];
+#else
+    #define Case(name) case DecodedOp::name:
+    #define Dispatch goto dispatch;
+#endif
+    #define Next(next) { \
+        next_slot = next; \
+        if (++cycles >= stop_cycles) \
+            goto stop; \
+        slot = next_slot; \
+        Dispatch \
+    }
+
+    /*
+    * Exec_<op>(s) runs instruction in slot s. It either falls through,
+    * continues at a jump target with Next(), or faults.
+    */
+    #define Exec_Nop(s)
+    #define Exec_Ja(s) { \
+        const int32_t rel_addr = static_cast<int32_t>(static_cast<uint32_t>(mem[args1[s]]) + 1); \
+        if ((rel_addr % InstSize) != 0) \
+            Fault(s, fault_jump) \
+        const int64_t inst_addr2 = static_cast<int64_t>(data_offset) - InstSize + rel_addr; \
+        if (inst_addr2 < 0 || inst_addr2 >= mem_size) \
+            Fault(s, fault_jump) \
+        Next(getSlot(code, static_cast<uint32_t>(inst_addr2))) \
+    }
+    #define Exec_Jr(s) Next(static_cast<uint32_t>(args1[s]))
+    #define CondJump(s, cond) { \
+        if (mem[args2[s]] cond 0) { \
+            const int32_t target = args1[s]; \
+            if (target < 0) \
+                Fault(s, fault_jump) \
+            Next(static_cast<uint32_t>(target)) \
+        } \
+    }
+    #define Exec_Jnz(s) CondJump(s, !=)
+    #define Exec_Jz(s) CondJump(s, ==)
+    #define Exec_Jg(s) CondJump(s, >)
+    #define Exec_Jge(s) CondJump(s, >=)
+    #define Exec_Jl(s) CondJump(s, <)
+    #define Exec_Jle(s) CondJump(s, <=)
+    #define Exec_Lia(s) Store(args1[s], args2[s])
+    #define Exec_Ld(s) { \
+        GetAddr(addr2, mem[args2[s]], s) \
+        Store(args1[s], mem[addr2]) \
+    }
+    #define Exec_St(s) { \
+        GetAddr(addr1, mem[args1[s]], s) \
+        Store(addr1, mem[args2[s]]) \
+    }
+    #define Exec_Stv(s) { \
+        GetAddr(addr1, mem[args1[s]], s) \
+        Store(addr1, args2[s]) \
+    }
+    #define Exec_Mov(s) Store(args1[s], mem[args2[s]])
+    #define BinaryOp(s, value, expr) { \
+        const uint32_t addr1 = args1[s]; \
+        const uint32_t a = static_cast<uint32_t>(mem[addr1]); \
+        const uint32_t b = static_cast<uint32_t>(value); \
+        Store(addr1, static_cast<int32_t>(expr)) \
+    }
+    #define Exec_Add(s) BinaryOp(s, mem[args2[s]], a + b)
+    #define Exec_Sub(s) BinaryOp(s, mem[args2[s]], a - b)
+    #define Exec_Mul(s) BinaryOp(s, mem[args2[s]], a * b)
+    #define Exec_Div(s) { \
+        const uint32_t addr1 = args1[s]; \
+        const int32_t d = mem[args2[s]]; \
+        if (!d) \
+            Fault(s, fault_divzero) \
+        Store(addr1, mem[addr1] / d) \
+    }
+    #define Exec_Movv(s) Store(args1[s], args2[s])
+    #define Exec_Addv(s) BinaryOp(s, args2[s], a + b)
+    #define Exec_Subv(s) BinaryOp(s, args2[s], a - b)
+    #define Exec_Mulv(s) BinaryOp(s, args2[s], a * b)
+    #define Exec_Divv(s) { \
+        const uint32_t addr1 = args1[s]; \
+        Store(addr1, mem[addr1] / args2[s]) \
+    }
+    #define Exec_Dbg(s) \
+        m.output->dbg(args1[s], args2[s], mem[args1[s]]);
+    #define Exec_Dbgext(s) \
+        writeDbgext(m, cycles);
+    #define Single(name) \
+    Case(name) \
+        Exec_##name(slot) \
+        Next(slot - 1)
+
+    // between instructions of a superinstruction: count the cycle, and leave
+    // to regular dispatch if a store has just invalidated the superinstruction
+    #define FusedStep(s, id) { \
+        if (++cycles >= stop_cycles) { \
+            next_slot = s - 1; \
+            goto stop; \
+        } \
+        if (ops[slot] != DecodedOp::id) { \
+            slot = s - 1; \
+            Dispatch \
+        } \
+    }
+    #define FusedPair(a, b) \
+    Case(a##_##b) \
+        Exec_##a(slot) \
+        FusedStep(slot, a##_##b) \
+        Exec_##b(slot - 1) \
+        Next(slot - 2)
+    #define FusedTriple(a, b, c) \
+    Case(a##_##b##_##c) \
+        Exec_##a(slot) \
+        FusedStep(slot, a##_##b##_##c) \
+        Exec_##b(slot - 1) \
+        FusedStep(slot - 1, a##_##b##_##c) \
+        Exec_##c(slot - 2) \
+        Next(slot - 3)
+
+#ifdef VM_THREADED_DISPATCH
+    Dispatch
+#else
+dispatch:
+    switch(ops[slot]) {
+#endif
+    Case(Undecoded)
+        decodeSlot(code, m, slot);
+        fuseSlot(code, m, slot);
+        Dispatch
+    Case(Hlt)
+        res = Result::Halt;
+        goto fault;
+    Case(Ja)
+        Exec_Ja(slot)
+    Case(Jr)
+        Exec_Jr(slot)
+    Single(Nop)
+    Single(Jnz)
+    Single(Jz)
+    Single(Jg)
+    Single(Jge)
+    Single(Jl)
+    Single(Jle)
+    Single(Lia)
+    Single(Ld)
+    Single(St)
+    Single(Stv)
+    Single(Mov)
+    Single(Add)
+    Single(Sub)
+    Single(Mul)
+    Single(Div)
+    Single(Movv)
+    Single(Addv)
+    Single(Subv)
+    Single(Mulv)
+    Single(Divv)
+    Single(Dbg)
+    Single(Dbgext)
+    VM_FUSED_PAIRS(FusedPair)
+    VM_FUSED_TRIPLES(FusedTriple)
+    Case(FaultInst)
+        res = Result::InvalidInstAddr;
+        goto fault;
+    Case(FaultOpCode)
+        res = Result::InvalidOpCode;
+        goto fault;
+    Case(FaultData)
+        goto fault_data;
+    Case(FaultJump)
+        goto fault_jump;
+    Case(FaultDivZero)
+        goto fault_divzero;
+#ifndef VM_THREADED_DISPATCH
+    default:
+        assert(false);
+    }
+#endif
+
+fault_data:
+    res = Result::InvalidDataAddr;
+    goto fault;
+fault_jump:
+    res = Result::InvalidJumpAddr;
+    goto fault;
+fault_divzero:
+    res = Result::DivByZero;
+fault:
+    m.inst_addr = slot_base + static_cast<int32_t>(slot) * InstSize;
+    m.cycles = cycles;
+    return res;
+stop:
+    m.inst_addr = slot_base + static_cast<int32_t>(next_slot + 1) * InstSize;
+    m.cycles = cycles;
+    return cycles >= max_cycles ? Result::InfiniteLoop : Result::Continue;
+
+    #undef FusedTriple
+    #undef FusedPair
+    #undef FusedStep
+    #undef Single
+    #undef Exec_Dbgext
+    #undef Exec_Dbg
+    #undef Exec_Divv
+    #undef Exec_Mulv
+    #undef Exec_Subv
+    #undef Exec_Addv
+    #undef Exec_Movv
+    #undef Exec_Div
+    #undef Exec_Mul
+    #undef Exec_Sub
+    #undef Exec_Add
+    #undef BinaryOp
+    #undef Exec_Mov
+    #undef Exec_Stv
+    #undef Exec_St
+    #undef Exec_Ld
+    #undef Exec_Lia
+    #undef Exec_Jle
+    #undef Exec_Jl
+    #undef Exec_Jge
+    #undef Exec_Jg
+    #undef Exec_Jz
+    #undef Exec_Jnz
+    #undef CondJump
+    #undef Exec_Jr
+    #undef Exec_Ja
+    #undef Exec_Nop
+    #undef Next
+    #undef Dispatch
+    #undef Case
+    #undef Fault
+    #undef GetAddr
+    #undef Store
+}
+
+/*
+* x86-64 JIT engine (Linux only)
+*
+* Basic blocks starting at hot slots are translated to native code in an
+* mmap'd executable arena: straight runs of nop/lia/ld/st/stv/mov/add/sub/
+* mul/div(v) ending with a jump or hlt. Everything else (dbg, dbgext, faults
+* known at decode time) ends a block and is left to runDecoded(), which
+* also runs cold code. Translation reads operands from DecodedCode.
+*
+* Native code register use:
+*   rbx = machine memory
+*   r12 = JitContext
+*   r13 = instructions left before the cycle limit or budget stop
+*   r14 = DecodedCode::code_pages
+*   r15 = JitCode::entry table
+*
+* Block prologue takes its instruction count from r13 and leaves to the
+* interpreter when there's not enough left, so a block either runs whole
+* or stops exactly where execute() would. Faults give back the count of
+* instructions which did not complete. Relative jumps chain directly to
+* translated target blocks, ja looks up the entry table.
+*
+* A store checks the code page flag of its address and if set leaves
+* to the host, which invalidates decoded slots and translated blocks
+* covering the address. Jumps chained into an invalidated block are
+* patched back to their exit stubs, and the jumps it chained are dropped
+* from the lists of their targets. A block start invalidated
+* JitMaxInvalidations times isn't translated again, self-modifying code
+* there stays with the decoded engine.
+*
+* The arena is never writable and executable at once: it's made writable
+* to translate and patch, and executable again before native code runs.
+*
+* Elsewhere, or when the arena can't be mapped, runJit() just runs
+* the decoded engine.
+*/
+
+enum class JitExit : uint32_t
+{
+    Continue = 0, // continue at exit_slot
+    Interpret, // not enough cycles left for the block at exit_slot
+    Halt,
+    FaultData,
+    FaultJump,
+    FaultDivZero,
+    CodeWrite // continue at exit_slot after store_addr was written
+};
+
+struct JitContext
+{
+    int32_t* mem;
+    int64_t left;
+    const uint8_t* code_pages;
+    uint8_t* const* entries;
+    uint32_t exit_slot;
+    uint32_t store_addr;
+};
+
+constexpr uint8_t JitContextLeft = 8;
+constexpr uint8_t JitContextExitSlot = 32;
+constexpr uint8_t JitContextStoreAddr = 36;
+
+struct JitPatch
+{
+    uint8_t* rel32; // jump operand
+    uint8_t* stub; // original target, the exit stub
+};
+
+struct CodeBlock
+{
+    uint32_t slot;
+    uint32_t length;
+};
+
+struct JitCode
+{
+    DecodedCode decoded;
+    std::vector<uint32_t> invalidated; // DecodedCode::invalidation_log
+    uint8_t* arena = nullptr;
+    size_t arena_size = 0;
+    size_t arena_used = 0;
+    size_t arena_start = 0; // after the trampoline
+    uint8_t* exit_code = nullptr; // common exit in the trampoline
+    std::vector<uint8_t*> entry; // native entry per slot
+    std::vector<uint32_t> heat; // executions of not translated block starts
+    std::vector<uint8_t> covered; // number of blocks covering each slot
+    std::vector<CodeBlock> blocks;
+    std::unordered_map<uint32_t, std::vector<JitPatch>> incoming; // chained jumps by target slot
+    // chained jumps of every block, target slot and jump operand
+    std::unordered_map<uint32_t, std::vector<std::pair<uint32_t, uint8_t*>>> outgoing;
+    std::vector<uint8_t> invalidations; // blocks dropped per block start slot
+    bool arena_writable = false;
+    uint32_t threshold = 16;
+    // stats
+    uint64_t translated = 0;
+    uint64_t invalidated_blocks = 0;
+    uint64_t flushes = 0;
+
+    JitCode() = default;
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    ~JitCode()
+    {
+#ifdef VM_JIT
+        if (arena)
+            munmap(arena, arena_size);
+#endif
+    }
+};
+
+constexpr uint32_t JitMaxBlockLength = 64;
+constexpr size_t JitMaxBlockBytes = JitMaxBlockLength * 160 + 64;
+constexpr size_t JitArenaSize = 16 << 20;
+constexpr uint32_t JitNotTranslatable = UINT32_MAX;
+constexpr uint8_t JitMaxInvalidations = 8;
+
+struct JitEmitter
+{
+    uint8_t* p;
+
+    void byte(uint8_t b) { *p++ = b; }
+    void bytes(std::initializer_list<uint8_t> bs) { for(auto b : bs) *p++ = b; }
+    void imm32(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+    // ModRM for [rbx + addr*4], addr is a word index
+    void mem(uint8_t reg, uint32_t addr) { byte(static_cast<uint8_t>(0x80 | (reg << 3) | 3)); imm32(addr * 4); }
+    uint8_t* jcc(uint8_t cc) { bytes({0x0F, static_cast<uint8_t>(0x80 | cc)}); imm32(0); return p - 4; }
+    uint8_t* jmp() { byte(0xE9); imm32(0); return p - 4; }
+    static void bind(uint8_t* rel32, const uint8_t* target)
+    {
+        const int32_t rel = static_cast<int32_t>(target - (rel32 + 4));
+        memcpy(rel32, &rel, 4);
+    }
+};
+
+// x86 condition codes
+constexpr uint8_t CondE = 0x4, CondNE = 0x5, CondAE = 0x3, CondS = 0x8,
+    CondL = 0xC, CondGE = 0xD, CondLE = 0xE, CondG = 0xF;
+
+void flushJitCode(JitCode& jit)
+{
+    for(const auto& b : jit.blocks) {
+        jit.entry[b.slot] = nullptr;
+        for(uint32_t i = 0; i < b.length; ++i)
+            jit.covered[b.slot - i] = 0;
+    }
+    jit.blocks.clear();
+    jit.incoming.clear();
+    jit.outgoing.clear();
+    jit.arena_used = jit.arena_start;
+    ++jit.flushes;
+}
+
+// makes the arena writable (to translate or patch code) or executable,
+// false if it can't be changed
+bool protectJitArena(JitCode& jit, bool writable)
+{
+#ifdef VM_JIT
+    if (jit.arena_writable != writable) {
+        if (mprotect(jit.arena, jit.arena_size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+            return false;
+        jit.arena_writable = writable;
+    }
+    return true;
+#else
+    static_cast<void>(jit);
+    return writable;
+#endif
+}
+
+void resetJitCode(JitCode& jit, const Machine& m)
+{
+    resetDecodedCode(jit.decoded, m);
+    jit.invalidated.clear();
+    jit.decoded.invalidation_log = &jit.invalidated;
+    const size_t slot_count = jit.decoded.op.size();
+    jit.entry.assign(slot_count, nullptr);
+    jit.heat.assign(slot_count, 0);
+    jit.covered.assign(slot_count, 0);
+    jit.invalidations.assign(slot_count, 0);
+    jit.blocks.clear();
+    jit.incoming.clear();
+    jit.outgoing.clear();
+#ifdef VM_JIT
+    // word addresses are encoded as 32-bit displacements
+    if (m.mem_size > (INT32_MAX >> 2)) {
+        if (jit.arena)
+            munmap(jit.arena, jit.arena_size);
+        jit.arena = nullptr;
+        return;
+    }
+    if (!jit.arena) {
+        // no executable memory, runJit() falls back to runDecoded()
+        void* p = mmap(nullptr, JitArenaSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return;
+        if (mprotect(p, JitArenaSize, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, JitArenaSize);
+            return;
+        }
+        jit.arena = static_cast<uint8_t*>(p);
+        jit.arena_size = JitArenaSize;
+        jit.arena_writable = false;
+    }
+    if (!protectJitArena(jit, true)) {
+        munmap(jit.arena, jit.arena_size);
+        jit.arena = nullptr;
+        return;
+    }
+#else
+    return;
+#endif
+
+    // trampoline: uint32_t enter(JitContext* ctx, const uint8_t* entry)
+    JitEmitter e = {jit.arena};
+    e.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, r12..r15
+    e.bytes({0x49, 0x89, 0xFC}); // mov r12, rdi
+    e.bytes({0x49, 0x8B, 0x5C, 0x24, 0}); // mov rbx, [r12 + mem]
+    e.bytes({0x4D, 0x8B, 0x6C, 0x24, JitContextLeft}); // mov r13, [r12 + left]
+    e.bytes({0x4D, 0x8B, 0x74, 0x24, 16}); // mov r14, [r12 + code_pages]
+    e.bytes({0x4D, 0x8B, 0x7C, 0x24, 24}); // mov r15, [r12 + entries]
+    e.bytes({0xFF, 0xE6}); // jmp rsi
+    jit.exit_code = e.p;
+    e.bytes({0x4D, 0x89, 0x6C, 0x24, JitContextLeft}); // mov [r12 + left], r13
+    e.bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B}); // pop r15..r12, rbx
+    e.byte(0xC3); // ret
+    jit.arena_start = jit.arena_used = static_cast<size_t>(e.p - jit.arena);
+}
+
+static_assert(offsetof(JitContext, left) == JitContextLeft, "JitContext layout");
+static_assert(offsetof(JitContext, code_pages) == 16, "JitContext layout");
+static_assert(offsetof(JitContext, entries) == 24, "JitContext layout");
+static_assert(offsetof(JitContext, exit_slot) == JitContextExitSlot, "JitContext layout");
+static_assert(offsetof(JitContext, store_addr) == JitContextStoreAddr, "JitContext layout");
+
+bool isJitBodyOp(DecodedOp op)
+{
+    switch(op) {
+    case DecodedOp::Nop:
+    case DecodedOp::Lia:
+    case DecodedOp::Ld:
+    case DecodedOp::St:
+    case DecodedOp::Stv:
+    case DecodedOp::Mov:
+    case DecodedOp::Add:
+    case DecodedOp::Sub:
+    case DecodedOp::Mul:
+    case DecodedOp::Div:
+    case DecodedOp::Movv:
+    case DecodedOp::Addv:
+    case DecodedOp::Subv:
+    case DecodedOp::Mulv:
+    case DecodedOp::Divv:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isJitEndOp(DecodedOp op)
+{
+    switch(op) {
+    case DecodedOp::Hlt:
+    case DecodedOp::Jr:
+    case DecodedOp::Ja:
+    case DecodedOp::Jnz:
+    case DecodedOp::Jz:
+    case DecodedOp::Jg:
+    case DecodedOp::Jge:
+    case DecodedOp::Jl:
+    case DecodedOp::Jle:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// decoded length of the basic block at slot, including its jump
+uint32_t getBlockLength(DecodedCode& code, const Machine& m, uint32_t slot)
+{
+    uint32_t length = 0;
+    while(length < JitMaxBlockLength && slot > length) {
+        const uint32_t s = slot - length;
+        if (code.op[s] == DecodedOp::Undecoded)
+            decodeSlot(code, m, s);
+        ++length;
+        if (!isJitBodyOp(code.op[s]))
+            break;
+    }
+    return std::max(length, 1u);
+}
+
+bool translateBlock(JitCode& jit, const Machine& m, uint32_t slot)
+{
+    DecodedCode& code = jit.decoded;
+    if (jit.invalidations[slot] >= JitMaxInvalidations || !protectJitArena(jit, true))
+        return false;
+    if (jit.arena_size - jit.arena_used < JitMaxBlockBytes)
+        flushJitCode(jit);
+
+    uint32_t length = 0;
+    bool has_end = false;
+    while(length < JitMaxBlockLength && slot > length) {
+        const uint32_t s = slot - length;
+        if (code.op[s] == DecodedOp::Undecoded)
+            decodeSlot(code, m, s);
+        if (isJitEndOp(code.op[s])) {
+            ++length;
+            has_end = true;
+            break;
+        }
+        if (!isJitBodyOp(code.op[s]))
+            break;
+        ++length;
+    }
+    if (!length)
+        return false;
+
+    const uint32_t data_offset = static_cast<uint32_t>(m.data_offset);
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const uint32_t page_bias = code.page_bias;
+
+    struct Stub
+    {
+        uint8_t* rel32;
+        JitExit exit;
+        uint32_t refund; // instructions not executed
+        uint32_t exit_slot;
+        bool store_addr_in_eax;
+        uint32_t store_addr; // for static stores
+        uint32_t target; // for chained jumps
+    };
+    Stub stubs[JitMaxBlockLength * 3];
+    uint32_t stub_count = 0;
+    auto addStub = [&](uint8_t* rel32, JitExit exit, uint32_t refund, uint32_t exit_slot) -> Stub& {
+        Stub& st = stubs[stub_count++];
+        st = {rel32, exit, refund, exit_slot, false, 0, 0};
+        return st;
+    };
+
+    uint8_t* const start = jit.arena + jit.arena_used;
+    JitEmitter e = {start};
+    // sub r13, length; jl interpret
+    e.bytes({0x49, 0x81, 0xED}); e.imm32(length);
+    addStub(e.jcc(CondL), JitExit::Interpret, length, slot);
+
+    auto chain = [&](uint32_t target) {
+        Stub& st = addStub(e.jmp(), JitExit::Continue, 0, target);
+        st.target = target;
+    };
+    auto checkStaticStore = [&](uint32_t addr, uint32_t k) {
+        // cmp byte [r14 + page], 0; jne code_write
+        e.bytes({0x41, 0x80, 0xBE}); e.imm32((addr + page_bias) >> CodePageShift); e.byte(0);
+        Stub& st = addStub(e.jcc(CondNE), JitExit::CodeWrite, length - k - 1, slot - k - 1);
+        st.store_addr = addr;
+    };
+    auto checkDynamicStore = [&](uint32_t k) {
+        // address in eax: lea edx, [rax + bias]; shr edx, shift; cmp byte [r14 + rdx], 0; jne code_write
+        e.bytes({0x8D, 0x90}); e.imm32(page_bias);
+        e.bytes({0xC1, 0xEA, static_cast<uint8_t>(CodePageShift)});
+        e.bytes({0x41, 0x80, 0x3C, 0x16, 0x00});
+        Stub& st = addStub(e.jcc(CondNE), JitExit::CodeWrite, length - k - 1, slot - k - 1);
+        st.store_addr_in_eax = true;
+    };
+    auto loadIndirect = [&](uint32_t paddr, uint32_t k) {
+        // eax = [paddr] + data_offset, checked
+        e.bytes({0x8B}); e.mem(0, paddr);
+        e.byte(0x05); e.imm32(data_offset);
+        e.byte(0x3D); e.imm32(mem_size);
+        addStub(e.jcc(CondAE), JitExit::FaultData, length - k, slot - k);
+    };
+
+    for(uint32_t k = 0; k < length; ++k) {
+        const uint32_t s = slot - k;
+        const uint32_t a1 = static_cast<uint32_t>(code.arg1[s]);
+        const uint32_t a2 = static_cast<uint32_t>(code.arg2[s]);
+        switch(code.op[s]) {
+        case DecodedOp::Nop:
+            break;
+        case DecodedOp::Lia:
+        case DecodedOp::Movv:
+            e.byte(0xC7); e.mem(0, a1); e.imm32(a2); // mov dword [a1], imm
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Mov:
+            e.byte(0x8B); e.mem(0, a2); // mov eax, [a2]
+            e.byte(0x89); e.mem(0, a1); // mov [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Add:
+        case DecodedOp::Sub:
+            e.byte(0x8B); e.mem(0, a2); // mov eax, [a2]
+            e.byte(code.op[s] == DecodedOp::Add ? 0x01 : 0x29); e.mem(0, a1); // add/sub [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Mul:
+            e.byte(0x8B); e.mem(0, a1); // mov eax, [a1]
+            e.bytes({0x0F, 0xAF}); e.mem(0, a2); // imul eax, [a2]
+            e.byte(0x89); e.mem(0, a1); // mov [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Div:
+            e.byte(0x8B); e.mem(1, a2); // mov ecx, [a2]
+            e.bytes({0x85, 0xC9}); // test ecx, ecx
+            addStub(e.jcc(CondE), JitExit::FaultDivZero, length - k, s);
+            e.byte(0x8B); e.mem(0, a1); // mov eax, [a1]
+            // INT32_MIN / -1 wraps instead of trapping
+            e.bytes({0x83, 0xF9, 0xFF, 0x75, 0x04}); // cmp ecx, -1; jne div
+            e.bytes({0xF7, 0xD8, 0xEB, 0x03}); // neg eax; jmp store
+            e.bytes({0x99, 0xF7, 0xF9}); // div: cdq; idiv ecx
+            e.byte(0x89); e.mem(0, a1); // store: mov [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Addv:
+            e.byte(0x81); e.mem(0, a1); e.imm32(a2); // add dword [a1], imm
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Subv:
+            e.byte(0x81); e.mem(5, a1); e.imm32(a2); // sub dword [a1], imm
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Mulv:
+            e.byte(0x69); e.mem(0, a1); e.imm32(a2); // imul eax, [a1], imm
+            e.byte(0x89); e.mem(0, a1); // mov [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Divv:
+            if (static_cast<int32_t>(a2) == -1) {
+                e.byte(0xF7); e.mem(3, a1); // neg dword [a1]
+            } else {
+                e.byte(0x8B); e.mem(0, a1); // mov eax, [a1]
+                e.byte(0x99); // cdq
+                e.byte(0xB9); e.imm32(a2); // mov ecx, imm
+                e.bytes({0xF7, 0xF9}); // idiv ecx
+                e.byte(0x89); e.mem(0, a1); // mov [a1], eax
+            }
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::Ld:
+            loadIndirect(a2, k);
+            e.bytes({0x8B, 0x04, 0x83}); // mov eax, [rbx + rax*4]
+            e.byte(0x89); e.mem(0, a1); // mov [a1], eax
+            checkStaticStore(a1, k);
+            break;
+        case DecodedOp::St:
+            loadIndirect(a1, k);
+            e.byte(0x8B); e.mem(1, a2); // mov ecx, [a2]
+            e.bytes({0x89, 0x0C, 0x83}); // mov [rbx + rax*4], ecx
+            checkDynamicStore(k);
+            break;
+        case DecodedOp::Stv:
+            loadIndirect(a1, k);
+            e.bytes({0xC7, 0x04, 0x83}); e.imm32(a2); // mov dword [rbx + rax*4], imm
+            checkDynamicStore(k);
+            break;
+        case DecodedOp::Hlt:
+            e.bytes({0x49, 0x81, 0xC5}); e.imm32(1); // add r13, 1
+            e.bytes({0x41, 0xC7, 0x44, 0x24, JitContextExitSlot}); e.imm32(s);
+            e.byte(0xB8); e.imm32(static_cast<uint32_t>(JitExit::Halt));
+            JitEmitter::bind(e.jmp(), jit.exit_code);
+            break;
+        case DecodedOp::Jr:
+            chain(a1);
+            break;
+        case DecodedOp::Jnz:
+        case DecodedOp::Jz:
+        case DecodedOp::Jg:
+        case DecodedOp::Jge:
+        case DecodedOp::Jl:
+        case DecodedOp::Jle:
+        {
+            static const uint8_t conds[] = { CondNE, CondE, CondG, CondGE, CondL, CondLE };
+            const uint8_t cc = conds[static_cast<uint32_t>(code.op[s]) - static_cast<uint32_t>(DecodedOp::Jnz)];
+            e.byte(0x83); e.mem(7, a2); e.byte(0); // cmp dword [a2], 0
+            uint8_t* taken = e.jcc(cc);
+            chain(s - 1);
+            JitEmitter::bind(taken, e.p);
+            if (static_cast<int32_t>(a1) < 0)
+                addStub(e.jmp(), JitExit::FaultJump, 1, s);
+            else
+                chain(a1);
+            break;
+        }
+        case DecodedOp::Ja:
+        {
+            e.byte(0x8B); e.mem(0, a1); // mov eax, [a1]
+            e.bytes({0x83, 0xC0, 0x01}); // add eax, 1
+            e.bytes({0x48, 0x63, 0xC0}); // movsxd rax, eax
+            e.bytes({0x48, 0x05}); e.imm32(data_offset - InstSize); // add rax, data_offset - 3
+            addStub(e.jcc(CondS), JitExit::FaultJump, 1, s);
+            e.bytes({0x48, 0x3D}); e.imm32(mem_size); // cmp rax, mem_size
+            addStub(e.jcc(CondGE), JitExit::FaultJump, 1, s);
+            // slot = (target - slot_base) / 3, must be exact
+            e.byte(0x2D); e.imm32(static_cast<uint32_t>(code.slot_base)); // sub eax, slot_base
+            e.bytes({0x89, 0xC1}); // mov ecx, eax
+            e.byte(0xBA); e.imm32(0xAAAAAAABu); // mov edx, 0xAAAAAAAB
+            e.bytes({0x48, 0x0F, 0xAF, 0xD1}); // imul rdx, rcx
+            e.bytes({0x48, 0xC1, 0xEA, 0x21}); // shr rdx, 33
+            e.bytes({0x8D, 0x04, 0x52}); // lea eax, [rdx + rdx*2]
+            e.bytes({0x39, 0xC8}); // cmp eax, ecx
+            addStub(e.jcc(CondNE), JitExit::FaultJump, 1, s);
+            e.bytes({0x49, 0x8B, 0x04, 0xD7}); // mov rax, [r15 + rdx*8]
+            e.bytes({0x48, 0x85, 0xC0}); // test rax, rax
+            uint8_t* not_translated = e.jcc(CondE);
+            e.bytes({0xFF, 0xE0}); // jmp rax
+            JitEmitter::bind(not_translated, e.p);
+            e.bytes({0x41, 0x89, 0x54, 0x24, JitContextExitSlot}); // mov [r12 + exit_slot], edx
+            e.byte(0xB8); e.imm32(static_cast<uint32_t>(JitExit::Continue));
+            JitEmitter::bind(e.jmp(), jit.exit_code);
+            break;
+        }
+        default:
+            assert(false);
+        }
+    }
+    if (!has_end)
+        chain(slot - length);
+
+    // exit stubs
+    for(uint32_t i = 0; i < stub_count; ++i) {
+        Stub& st = stubs[i];
+        uint8_t* const stub = e.p;
+        if (st.refund) {
+            e.bytes({0x49, 0x81, 0xC5}); e.imm32(st.refund); // add r13, refund
+        }
+        if (st.exit == JitExit::CodeWrite) {
+            if (st.store_addr_in_eax) {
+                e.bytes({0x41, 0x89, 0x44, 0x24, JitContextStoreAddr}); // mov [r12 + store_addr], eax
+            } else {
+                e.bytes({0x41, 0xC7, 0x44, 0x24, JitContextStoreAddr}); e.imm32(st.store_addr);
+            }
+        }
+        e.bytes({0x41, 0xC7, 0x44, 0x24, JitContextExitSlot}); e.imm32(st.exit_slot);
+        e.byte(0xB8); e.imm32(static_cast<uint32_t>(st.exit));
+        JitEmitter::bind(e.jmp(), jit.exit_code);
+        if (st.exit == JitExit::Continue) {
+            // chained jump, goes straight to the target block once it's translated
+            const uint8_t* target = jit.entry[st.target];
+            JitEmitter::bind(st.rel32, target ? target : stub);
+            jit.incoming[st.target].push_back({st.rel32, stub});
+            jit.outgoing[slot].emplace_back(st.target, st.rel32);
+        } else {
+            JitEmitter::bind(st.rel32, stub);
+        }
+    }
+    assert(static_cast<size_t>(e.p - start) <= JitMaxBlockBytes);
+    jit.arena_used += static_cast<size_t>(e.p - start);
+
+    jit.entry[slot] = start;
+    jit.blocks.push_back({slot, length});
+    for(uint32_t i = 0; i < length; ++i)
+        ++jit.covered[slot - i];
+    auto it = jit.incoming.find(slot);
+    if (it != jit.incoming.end()) {
+        for(const auto& patch : it->second)
+            JitEmitter::bind(patch.rel32, start);
+    }
+    ++jit.translated;
+    return true;
+}
+
+// drops translated blocks covering the slot
+void invalidateJitSlot(JitCode& jit, uint32_t slot)
+{
+    jit.heat[slot] = 0;
+    if (!jit.covered[slot])
+        return;
+    for(size_t i = jit.blocks.size(); i > 0; --i) {
+        const CodeBlock b = jit.blocks[i - 1];
+        if (slot > b.slot || slot + b.length <= b.slot)
+            continue;
+        jit.entry[b.slot] = nullptr;
+        for(uint32_t k = 0; k < b.length; ++k)
+            --jit.covered[b.slot - k];
+        auto it = jit.incoming.find(b.slot);
+        if (it != jit.incoming.end() && !it->second.empty()) {
+            // native code can't be entered until it's patched, nothing is
+            // reachable after a flush
+            if (!protectJitArena(jit, true)) {
+                flushJitCode(jit);
+                return;
+            }
+            for(const auto& patch : it->second)
+                JitEmitter::bind(patch.rel32, patch.stub);
+        }
+        // its own chained jumps go away with it
+        auto out = jit.outgoing.find(b.slot);
+        if (out != jit.outgoing.end()) {
+            for(const auto& chained : out->second) {
+                auto target = jit.incoming.find(chained.first);
+                if (target == jit.incoming.end())
+                    continue;
+                auto& patches = target->second;
+                patches.erase(std::remove_if(patches.begin(), patches.end(),
+                    [&](const JitPatch& patch) { return patch.rel32 == chained.second; }), patches.end());
+                if (patches.empty())
+                    jit.incoming.erase(target);
+            }
+            jit.outgoing.erase(out);
+        }
+        if (jit.invalidations[b.slot] < JitMaxInvalidations)
+            ++jit.invalidations[b.slot];
+        jit.blocks[i - 1] = jit.blocks.back();
+        jit.blocks.pop_back();
+        ++jit.invalidated_blocks;
+    }
+}
+
+void applyJitInvalidations(JitCode& jit)
+{
+    for(const uint32_t slot : jit.invalidated)
+        invalidateJitSlot(jit, slot);
+    jit.invalidated.clear();
+}
+
+// runs native code of a translated block and the blocks it chains into,
+// until an exit to the host or stop_cycles; slots overwritten are left in
+// the invalidation log
+Result enterJitBlock(Machine& m, JitCode& jit, const uint8_t* entry, int64_t stop_cycles)
+{
+    typedef JitExit (*JitEnter)(JitContext* ctx, const uint8_t* entry);
+    const JitEnter enter = reinterpret_cast<JitEnter>(jit.arena);
+    DecodedCode& code = jit.decoded;
+    if (!protectJitArena(jit, false))
+        return runDecoded(m, code, stop_cycles - m.cycles);
+    const int64_t left = stop_cycles - m.cycles;
+    JitContext ctx;
+    ctx.mem = m.mem.data();
+    ctx.left = left;
+    ctx.code_pages = code.code_pages.data();
+    ctx.entries = jit.entry.data();
+    const JitExit exit = enter(&ctx, entry);
+    m.cycles += left - ctx.left;
+    const int32_t exit_addr = code.slot_base + static_cast<int32_t>(ctx.exit_slot) * InstSize;
+    switch(exit) {
+    case JitExit::CodeWrite:
+        invalidateDecodedCode(code, ctx.store_addr);
+        jit.invalidated.push_back(getSlot(code, ctx.store_addr));
+        // fall through
+    case JitExit::Continue:
+        m.inst_addr = exit_addr + InstSize;
+        return m.cycles >= m.max_cycles ? Result::InfiniteLoop : Result::Continue;
+    case JitExit::Interpret:
+    {
+        // the rest of the budget is shorter than the block
+        m.inst_addr = exit_addr + InstSize;
+        if (m.cycles >= stop_cycles)
+            return m.cycles >= m.max_cycles ? Result::InfiniteLoop : Result::Continue;
+        return runDecoded(m, code, ctx.left);
+    }
+    case JitExit::Halt:
+        m.inst_addr = exit_addr;
+        return Result::Halt;
+    case JitExit::FaultData:
+        m.inst_addr = exit_addr;
+        return Result::InvalidDataAddr;
+    case JitExit::FaultJump:
+        m.inst_addr = exit_addr;
+        return Result::InvalidJumpAddr;
+    case JitExit::FaultDivZero:
+        m.inst_addr = exit_addr;
+        return Result::DivByZero;
+    }
+    return Result::Continue;
+}
+
+// true if inst_addr is a possible slot of the decoded cache
+inline bool isSlotAddr(const DecodedCode& code, int32_t inst_addr, int32_t mem_size)
+{
+    return inst_addr >= 0 && inst_addr <= mem_size - InstSize &&
+        (inst_addr - code.slot_base) % InstSize == 0;
+}
+
+Result runJit(Machine& m, JitCode& jit, int64_t budget)
+{
+    DecodedCode& code = jit.decoded;
+    if (code.data_offset != m.data_offset || code.mem_size != m.mem_size || jit.entry.empty())
+        resetJitCode(jit, m);
+    if (!jit.arena)
+        return runDecoded(m, code, budget);
+
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    Result res = Result::Continue;
+    while(res == Result::Continue && m.cycles < stop_cycles) {
+        const int32_t inst_addr = m.inst_addr - InstSize;
+        if (!isSlotAddr(code, inst_addr, m.mem_size))
+            return runDecoded(m, code, stop_cycles - m.cycles); // reports the fault
+        const uint32_t slot = getSlot(code, static_cast<uint32_t>(inst_addr));
+        const uint8_t* entry = jit.entry[slot];
+        if (!entry && jit.heat[slot] != JitNotTranslatable && ++jit.heat[slot] >= jit.threshold) {
+            if (translateBlock(jit, m, slot))
+                entry = jit.entry[slot];
+            else
+                jit.heat[slot] = JitNotTranslatable;
+        }
+        if (entry) {
+            res = enterJitBlock(m, jit, entry, stop_cycles);
+        } else {
+            const int64_t length = getBlockLength(code, m, slot);
+            res = runDecoded(m, code, std::min(length, stop_cycles - m.cycles));
+        }
+        applyJitInvalidations(jit);
+    }
+    return res;
+}
+
+/*
+* Interpreter tower collapse
+*
+* recursive_interpreter.code runs the vm-gen generated @execute_program on
+* a copy of itself, several levels deep, and every level multiplies the
+* cost of the one below. When the tiered engine reaches @execute_loop of
+* a known execute_program (recognised by a hash of the loop code, which
+* is position independent), collapseTower() takes over: it loads the
+* interpreter registers and executes instructions of the interpreted
+* machine directly on its memory window, with the bounds checks of the
+* interpreter. An interpreted machine reaching its own @execute_loop is
+* collapsed the same way, so nested levels run as fast as the first one.
+*
+* Every instruction is checked before it has any effect. Whatever the
+* collapsed loop doesn't do itself - hlt, dbg, dbgext, all error paths,
+* access outside the windows of outer levels or to registers and code of
+* a collapsed interpreter, stores into host decoded code, running out of
+* rcnt at any level or of host cycles - stops the innermost level on an
+* instruction boundary. Its registers are written back as the interpreted
+* loop would have left them, and the level above runs the interpreter
+* loop for that instruction, which writes ret_val and error codes itself.
+*
+* Host cycles grow by the base cycles the collapsed loops would have
+* taken, so dbgext output and the cycle limit stay the same as without
+* the collapse. Costs of every instruction class come from running the
+* loop once on a small probe machine. With CollapseCycles::Executed one
+* cycle per collapsed instruction is counted instead.
+*/
+
+// @execute_loop of vm-gen generated execute_program: instruction count from
+// the loop head to the final "ja ra" and FNV-1a hash of their words
+// (update both when vm-gen output changes)
+constexpr int32_t ExecuteLoopInstCount = 493;
+constexpr uint64_t ExecuteLoopHash = 0xbbf0f7fa36202202ull;
+constexpr int32_t ExecuteLoopSize = ExecuteLoopInstCount * InstSize;
+
+// execute_program registers, see "def" lines of execute_program.code
+constexpr int32_t ExecRa = 3, ExecRb = 4, ExecRc = 5, ExecRd = 6, ExecRe = 7,
+    ExecRcnt = 8, ExecInstAddr = 9, ExecBaseOffs = 10, ExecDataOffs = 11, ExecMemSize = 12,
+    ExecRegCount = 13;
+
+// instruction classes with their own interpreter path: opcodes and taken conditional jumps
+constexpr uint32_t CollapseClassCount = OpCodeCount + 6;
+constexpr uint32_t MaxCollapseDepth = 8;
+
+inline uint32_t getTakenJumpClass(OpCode opcode)
+{
+    return OpCodeCount + static_cast<uint32_t>(opcode) - static_cast<uint32_t>(OpCode::Jnz);
+}
+
+inline bool isJumpTaken(OpCode opcode, int32_t value)
+{
+    switch(opcode) {
+    case OpCode::Jnz: return value != 0;
+    case OpCode::Jz: return value == 0;
+    case OpCode::Jg: return value > 0;
+    case OpCode::Jge: return value >= 0;
+    case OpCode::Jl: return value < 0;
+    default: return value <= 0;
+    }
+}
+
+inline int32_t wrapAdd(int32_t a, int32_t b)
+{
+    return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+}
+
+inline int32_t wrapSub(int32_t a, int32_t b)
+{
+    return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b));
+}
+
+struct CollapseLevel
+{
+    int64_t offset; // host memory index of address 0 of the interpreter
+    int64_t head; // host memory index of the loop head
+    int64_t window_lo; // host memory indices the interpreted machine may
+    int64_t window_hi; //   access, within windows of all outer levels
+    bool check_protected; // window contains registers or code of a collapsed level
+    bool executed; // registers differ from memory
+    std::array<int32_t, ExecRegCount> reg;
+    int64_t inner_head; // last fingerprinted loop head of the interpreted machine
+    bool inner_head_ok;
+};
+
+struct CollapseRange
+{
+    int64_t lo;
+    int64_t hi;
+};
+
+struct CollapseStats
+{
+    uint64_t entries = 0;
+    std::array<uint64_t, MaxCollapseDepth> instructions{}; // by interpreted level
+};
+
+struct TowerCollapse
+{
+    bool enabled = false;
+    CollapseCycles cycles = CollapseCycles::Emulated;
+    bool probed = false;
+    bool probe_ok = false;
+    // weight[d][k] = base cycles of an instruction of class k run by d collapsed
+    // interpreters; weight[0] = 1 is also what the innermost rcnt counts
+    std::array<std::array<uint64_t, CollapseClassCount>, MaxCollapseDepth + 1> weight;
+    std::vector<CollapseLevel> levels;
+    std::vector<CollapseRange> protected_ranges;
+    int64_t host_head = -1; // fingerprinted loop head run by the host
+    bool host_head_ok = false;
+    CollapseStats stats;
+};
+
+uint64_t getExecuteLoopHash(const Machine& m, int64_t head)
+{
+    uint64_t hash = 1469598103934665603ull;
+    for(int64_t i = head + 2; i > head + InstSize - 1 - ExecuteLoopSize; --i) {
+        hash ^= static_cast<uint32_t>(m.mem[static_cast<size_t>(i)]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// cheap test for the first instruction of @execute_loop, "subv m_inst_addr 1"
+inline bool isExecuteLoopHead(const int32_t* mem, int64_t head)
+{
+    return mem[head + 2] == static_cast<int32_t>(OpCode::Subv) &&
+        mem[head + 1] == ExecInstAddr && mem[head] == 1;
+}
+
+// runs the loop code at head for one instruction of every class on a probe
+// machine and counts instruction classes it executes
+void probeCollapseCosts(TowerCollapse& tc, const Machine& m, int64_t head)
+{
+    tc.probed = true;
+    constexpr int32_t probe_base = 20, probe_data = 80, probe_size = 100;
+    constexpr int32_t max_steps = 1000;
+    Machine p;
+    p.data_offset = ExecuteLoopSize + 30;
+    p.mem_size = p.data_offset + probe_base + probe_size;
+    p.max_cycles = INT32_MAX;
+    const int32_t probe_head = ExecuteLoopSize - InstSize;
+
+    std::array<std::array<uint64_t, CollapseClassCount>, CollapseClassCount> path{};
+    std::array<bool, CollapseClassCount> emulated{};
+    for(uint32_t k = 0; k < CollapseClassCount; ++k) {
+        const bool taken = k >= OpCodeCount;
+        const OpCode opcode = taken ? static_cast<OpCode>(k - OpCodeCount + static_cast<uint32_t>(OpCode::Jnz)) :
+            static_cast<OpCode>(k);
+        if (opcode == OpCode::Hlt || opcode == OpCode::Dbg || opcode == OpCode::Dbgext)
+            continue;
+        emulated[k] = true;
+
+        p.mem.assign(static_cast<size_t>(p.mem_size), 0);
+        for(int32_t i = 0; i < ExecuteLoopSize; ++i)
+            p.mem[static_cast<size_t>(i)] = m.mem[static_cast<size_t>(head + InstSize - ExecuteLoopSize + i)];
+        int32_t* const regs = &p.mem[static_cast<size_t>(p.data_offset)];
+        regs[ExecBaseOffs] = probe_base;
+        regs[ExecDataOffs] = probe_data;
+        regs[ExecMemSize] = probe_size;
+        regs[ExecRcnt] = max_steps;
+        regs[ExecInstAddr] = probe_data;
+        // the instruction at probe_data - 3, jump target 3 words below it, cells 1..3
+        int32_t* const inst = regs + probe_data - InstSize;
+        int32_t* const cell = regs + probe_data;
+        int32_t arg1 = 1, arg2 = 2;
+        cell[1] = 3;
+        cell[2] = 1;
+        switch(opcode) {
+        case OpCode::Jr: arg1 = -InstSize; break;
+        case OpCode::Ja: cell[1] = -InstSize - 1; break;
+        case OpCode::Jnz: case OpCode::Jz: case OpCode::Jg:
+        case OpCode::Jge: case OpCode::Jl: case OpCode::Jle:
+            arg1 = -InstSize;
+            cell[2] = isJumpTaken(opcode, 1) == taken ? 1 : (isJumpTaken(opcode, 0) == taken ? 0 : -1);
+            break;
+        case OpCode::Ld: cell[2] = 3; break;
+        default: break;
+        }
+        inst[2] = static_cast<int32_t>(opcode);
+        inst[1] = arg1;
+        inst[0] = arg2;
+
+        p.inst_addr = probe_head + InstSize;
+        p.cycles = 0;
+        int32_t steps = 0;
+        do {
+            const int32_t inst_addr = p.inst_addr - InstSize;
+            const OpCode step_opcode = static_cast<OpCode>(p.mem[static_cast<size_t>(inst_addr + 2)]);
+            if (execute(p) != Result::Continue || ++steps > max_steps)
+                return;
+            uint32_t step_class = static_cast<uint32_t>(step_opcode);
+            if (step_opcode >= OpCode::Jnz && step_opcode <= OpCode::Jle && p.inst_addr != inst_addr)
+                step_class = getTakenJumpClass(step_opcode);
+            ++path[k][step_class];
+        } while(p.inst_addr != probe_head + InstSize);
+    }
+    for(uint32_t k = 0; k < CollapseClassCount; ++k) {
+        for(uint32_t i = 0; i < CollapseClassCount; ++i) {
+            if (path[k][i] && !emulated[i])
+                return;
+        }
+    }
+    tc.weight[0].fill(1);
+    for(uint32_t d = 1; d <= MaxCollapseDepth; ++d) {
+        for(uint32_t k = 0; k < CollapseClassCount; ++k) {
+            uint64_t w = 0;
+            for(uint32_t i = 0; i < CollapseClassCount; ++i)
+                w += path[k][i] * tc.weight[d - 1][i];
+            tc.weight[d][k] = w;
+        }
+    }
+    tc.probe_ok = true;
+}
+
+inline bool isCollapseProtected(const TowerCollapse& tc, int64_t index)
+{
+    for(const auto& r : tc.protected_ranges) {
+        if (index >= r.lo && index < r.hi)
+            return true;
+    }
+    return false;
+}
+
+// starts collapsing the interpreter with loop head at host index head and
+// registers at offset, if it's execute_program within [lo, hi)
+bool enterCollapseLevel(Machine& m, TowerCollapse& tc, int64_t offset, int64_t head,
+    int64_t lo, int64_t hi, bool head_ok)
+{
+    const int64_t code_lo = head + InstSize - ExecuteLoopSize;
+    if (tc.levels.size() >= MaxCollapseDepth || offset < lo || offset + ExecRegCount > hi ||
+        code_lo < lo || head + InstSize > hi || !head_ok)
+        return false;
+    for(int64_t i = offset; i < offset + ExecRegCount; ++i) {
+        if (isCollapseProtected(tc, i))
+            return false;
+    }
+    if (isCollapseProtected(tc, code_lo) || isCollapseProtected(tc, head + InstSize - 1))
+        return false;
+    if (!tc.probed)
+        probeCollapseCosts(tc, m, head);
+    if (!tc.probe_ok)
+        return false;
+
+    CollapseLevel l;
+    l.offset = offset;
+    l.head = head;
+    for(int32_t i = 0; i < ExecRegCount; ++i)
+        l.reg[static_cast<size_t>(i)] = m.mem[static_cast<size_t>(offset + i)];
+    const int32_t base = l.reg[ExecBaseOffs];
+    const int32_t size = l.reg[ExecMemSize];
+    if (size <= 0 || static_cast<int64_t>(base) + size > INT32_MAX)
+        return false; // windows the interpreter checks differently than an interval
+    l.window_lo = std::max(lo, offset + base);
+    l.window_hi = std::min(hi, offset + base + size);
+    l.executed = false;
+    l.inner_head = -1;
+    l.inner_head_ok = false;
+    tc.protected_ranges.push_back({offset, offset + ExecRegCount});
+    tc.protected_ranges.push_back({code_lo, head + InstSize});
+    l.check_protected = false;
+    for(const auto& r : tc.protected_ranges)
+        l.check_protected |= r.lo < l.window_hi && r.hi > l.window_lo;
+    tc.levels.push_back(l);
+    return true;
+}
+
+// writes back registers of the innermost level and ends its collapse
+void leaveCollapseLevel(Machine& m, TowerCollapse& tc)
+{
+    const CollapseLevel& l = tc.levels.back();
+    if (l.executed) {
+        for(int32_t i = ExecRa; i <= ExecInstAddr; ++i)
+            m.mem[static_cast<size_t>(l.offset + i)] = l.reg[static_cast<size_t>(i)];
+    }
+    tc.protected_ranges.resize(tc.protected_ranges.size() - 2);
+    tc.levels.pop_back();
+}
+
+// runs instructions interpreted by the innermost collapsed level until one
+// needs the real interpreter loop
+void runCollapsedLevel(Machine& m, TowerCollapse& tc, const DecodedCode& code, int64_t stop_cycles)
+{
+    const size_t depth = tc.levels.size();
+    const size_t level = depth - 1;
+    int32_t* const mem = m.mem.data();
+    const int32_t base = tc.levels[level].reg[ExecBaseOffs];
+    const int32_t data = tc.levels[level].reg[ExecDataOffs];
+    const int32_t size = tc.levels[level].reg[ExecMemSize];
+    const int64_t offset = tc.levels[level].offset;
+    const int64_t window_lo = tc.levels[level].window_lo;
+    const int64_t window_hi = tc.levels[level].window_hi;
+    const bool check_protected = tc.levels[level].check_protected;
+    const auto& weight = tc.weight;
+    bool skip_head = false;
+
+    // host index of interpreter address z, if the interpreted machine may access it
+    auto getIndex = [&](int32_t z, int64_t& index) {
+        index = offset + z;
+        return index >= window_lo && index < window_hi && !(check_protected && isCollapseProtected(tc, index));
+    };
+    // interpreted data address, with the interpreter's bounds check
+    auto getData = [&](int32_t arg, int32_t& z, int64_t& index) {
+        z = wrapAdd(arg, data);
+        const int32_t rd = wrapSub(z, base);
+        return rd >= 0 && wrapSub(rd, size) < 0 && getIndex(z, index);
+    };
+    auto isValidTarget = [&](int32_t target) {
+        const int32_t rd = wrapSub(target, base);
+        return rd >= 0 && wrapSub(rd, size) < 0;
+    };
+
+    while(true) {
+        CollapseLevel& l = tc.levels[level];
+        const int32_t inst_addr = wrapSub(l.reg[ExecInstAddr], InstSize);
+        int64_t inst_index, index;
+        if (!getIndex(inst_addr, inst_index) || !getIndex(inst_addr + 2, index))
+            break;
+        const int32_t raw_opcode = mem[inst_index + 2];
+        const int32_t arg1 = mem[inst_index + 1];
+        const int32_t arg2 = mem[inst_index];
+
+        if (!skip_head && isExecuteLoopHead(mem, inst_index)) {
+            // interpreted machine runs execute_program too
+            skip_head = true;
+            if (l.inner_head != inst_index) {
+                l.inner_head = inst_index;
+                l.inner_head_ok = inst_index + InstSize - ExecuteLoopSize >= window_lo &&
+                    getExecuteLoopHash(m, inst_index) == ExecuteLoopHash;
+            }
+            if (!enterCollapseLevel(m, tc, offset + data, inst_index, window_lo, window_hi, l.inner_head_ok))
+                continue;
+            runCollapsedLevel(m, tc, code, stop_cycles);
+            CollapseLevel& inner = tc.levels.back();
+            if (inner.executed) {
+                // state after "subv rcnt 1" and "jg @execute_loop rcnt" of the inner loop
+                CollapseLevel& outer = tc.levels[level];
+                outer.reg[ExecRa] = static_cast<int32_t>(OpCode::Jg);
+                outer.reg[ExecRb] = wrapAdd(inst_addr, InstSize);
+                outer.reg[ExecRc] = inner.reg[ExecRcnt];
+                outer.reg[ExecRd] = wrapSub(wrapSub(inst_addr, base), size);
+                outer.reg[ExecRe] = inner.reg[ExecRcnt];
+                outer.reg[ExecInstAddr] = wrapAdd(inst_addr, InstSize);
+                outer.executed = true;
+            }
+            leaveCollapseLevel(m, tc);
+            continue;
+        }
+        skip_head = false;
+
+        if (static_cast<uint32_t>(raw_opcode) >= OpCodeCount)
+            break;
+        const OpCode opcode = static_cast<OpCode>(raw_opcode);
+        uint32_t op_class = static_cast<uint32_t>(raw_opcode);
+        int32_t rb = 0, rc = arg2, rd = 0, re = l.reg[ExecRe];
+        int32_t next_inst_addr = inst_addr;
+        int64_t store_index = -1;
+        int32_t store_value = 0;
+
+        // what the interpreter loop does for the instruction, false if it takes
+        // a path the collapse leaves to it
+        auto emulate = [&]() {
+            int32_t z1, z2, z3;
+            int64_t index1, index2, index3;
+            switch(opcode) {
+            case OpCode::Nop:
+                rb = arg1;
+                break;
+            case OpCode::Jr:
+            {
+                const int32_t target = wrapAdd(arg1, inst_addr);
+                if (arg1 % InstSize != 0 || !isValidTarget(target))
+                    return false;
+                rb = next_inst_addr = wrapAdd(target, InstSize);
+                rd = wrapSub(wrapSub(target, base), size);
+                break;
+            }
+            case OpCode::Ja:
+            {
+                if (!getData(arg1, z1, index1))
+                    return false;
+                const int32_t rel_addr = wrapAdd(mem[index1], 1);
+                const int32_t target = wrapSub(wrapAdd(rel_addr, data), InstSize);
+                if (rel_addr % InstSize != 0 || !isValidTarget(target))
+                    return false;
+                rb = next_inst_addr = wrapAdd(target, InstSize);
+                rd = wrapSub(wrapSub(target, base), size);
+                break;
+            }
+            case OpCode::Jnz:
+            case OpCode::Jz:
+            case OpCode::Jg:
+            case OpCode::Jge:
+            case OpCode::Jl:
+            case OpCode::Jle:
+            {
+                if (!getData(arg2, z2, index2))
+                    return false;
+                rc = mem[index2];
+                if (!isJumpTaken(opcode, rc)) {
+                    rb = arg1;
+                    rd = wrapSub(wrapSub(z2, base), size);
+                    break;
+                }
+                const int32_t target = wrapAdd(arg1, inst_addr);
+                if (arg1 % InstSize != 0 || !isValidTarget(target))
+                    return false;
+                op_class = getTakenJumpClass(opcode);
+                rb = next_inst_addr = wrapAdd(target, InstSize);
+                rd = wrapSub(wrapSub(target, base), size);
+                break;
+            }
+            case OpCode::Lia:
+                if (!getData(arg1, z1, index1))
+                    return false;
+                rb = z1;
+                rd = store_value = wrapSub(wrapAdd(wrapAdd(arg2, inst_addr), 2), data);
+                store_index = index1;
+                break;
+            case OpCode::Ld:
+                if (!getData(arg1, z1, index1) || !getData(arg2, z2, index2) ||
+                    !getData(mem[index2], z3, index3))
+                    return false;
+                rb = z1;
+                rc = store_value = mem[index3];
+                rd = wrapSub(wrapSub(z3, base), size);
+                store_index = index1;
+                break;
+            case OpCode::St:
+                if (!getData(arg1, z1, index1) || !getData(mem[index1], z3, index3) ||
+                    !getData(arg2, z2, index2))
+                    return false;
+                rb = z3;
+                rc = store_value = mem[index2];
+                rd = wrapSub(wrapSub(z2, base), size);
+                store_index = index3;
+                break;
+            case OpCode::Stv:
+                if (!getData(arg1, z1, index1) || !getData(mem[index1], z3, index3))
+                    return false;
+                rb = z3;
+                store_value = arg2;
+                rd = wrapSub(wrapSub(z3, base), size);
+                store_index = index3;
+                break;
+            case OpCode::Mov:
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div:
+            {
+                if (!getData(arg1, z1, index1) || !getData(arg2, z2, index2))
+                    return false;
+                const uint32_t a = static_cast<uint32_t>(mem[index1]);
+                rb = z1;
+                rc = mem[index2];
+                rd = wrapSub(wrapSub(z2, base), size);
+                const uint32_t b = static_cast<uint32_t>(rc);
+                switch(opcode) {
+                case OpCode::Mov: store_value = rc; break;
+                case OpCode::Add: re = store_value = static_cast<int32_t>(a + b); break;
+                case OpCode::Sub: re = store_value = static_cast<int32_t>(a - b); break;
+                case OpCode::Mul: re = store_value = static_cast<int32_t>(a * b); break;
+                default:
+                    if (!rc)
+                        return false;
+                    re = store_value = rc == -1 ? static_cast<int32_t>(0u - a) : static_cast<int32_t>(a) / rc;
+                    break;
+                }
+                store_index = index1;
+                break;
+            }
+            case OpCode::Movv:
+            case OpCode::Addv:
+            case OpCode::Subv:
+            case OpCode::Mulv:
+            case OpCode::Divv:
+            {
+                if (!getData(arg1, z1, index1))
+                    return false;
+                const uint32_t a = static_cast<uint32_t>(mem[index1]);
+                const uint32_t b = static_cast<uint32_t>(arg2);
+                rb = z1;
+                rd = wrapSub(wrapSub(z1, base), size);
+                switch(opcode) {
+                case OpCode::Movv: store_value = arg2; break;
+                case OpCode::Addv: re = store_value = static_cast<int32_t>(a + b); break;
+                case OpCode::Subv: re = store_value = static_cast<int32_t>(a - b); break;
+                case OpCode::Mulv: re = store_value = static_cast<int32_t>(a * b); break;
+                default:
+                    if (!arg2)
+                        return false;
+                    re = store_value = arg2 == -1 ? static_cast<int32_t>(0u - a) : static_cast<int32_t>(a) / arg2;
+                    break;
+                }
+                store_index = index1;
+                break;
+            }
+            default:
+                return false; // hlt, dbg, dbgext
+            }
+            return true;
+        };
+        if (!emulate())
+            break;
+
+        const uint64_t cost = tc.cycles == CollapseCycles::Emulated ? weight[depth][op_class] : 1;
+        const uint64_t cycles = static_cast<uint64_t>(m.cycles) + cost;
+        if (cycles >= static_cast<uint64_t>(m.max_cycles) || cycles > static_cast<uint64_t>(stop_cycles))
+            break;
+        bool rcnt_left = true;
+        for(size_t i = 0; i < depth; ++i)
+            rcnt_left &= tc.levels[i].reg[ExecRcnt] > static_cast<int64_t>(weight[depth - 1 - i][op_class]);
+        if (!rcnt_left)
+            break;
+        if (store_index >= 0) {
+            if (code.code_pages[getCodePage(code, static_cast<uint32_t>(store_index))])
+                break; // host code, needs invalidation
+            if (store_index > l.inner_head - ExecuteLoopSize + InstSize - 1 && store_index < l.inner_head + InstSize)
+                l.inner_head = -1;
+            mem[store_index] = store_value;
+        }
+
+        m.cycles += static_cast<int64_t>(cost);
+        for(size_t i = 0; i < depth; ++i)
+            tc.levels[i].reg[ExecRcnt] -= static_cast<int32_t>(weight[depth - 1 - i][op_class]);
+        l.reg[ExecRa] = raw_opcode;
+        l.reg[ExecRb] = rb;
+        l.reg[ExecRc] = rc;
+        l.reg[ExecRd] = rd;
+        l.reg[ExecRe] = re;
+        l.reg[ExecInstAddr] = next_inst_addr;
+        l.executed = true;
+        ++tc.stats.instructions[level];
+    }
+}
+
+
+// collapses the interpreter if the host is at a known @execute_loop head,
+// true if it ran anything
+bool collapseTower(Machine& m, TowerCollapse& tc, DecodedCode& code, int32_t head, int64_t stop_cycles)
+{
+    if (!isExecuteLoopHead(m.mem.data(), head))
+        return false;
+    if (tc.host_head != head) {
+        tc.host_head = head;
+        tc.host_head_ok = head + InstSize - ExecuteLoopSize >= 0 &&
+            getExecuteLoopHash(m, head) == ExecuteLoopHash;
+        // stores into any part of the loop code drop the cached check, see invalidateCollapse()
+        if (tc.host_head_ok) {
+            for(int32_t i = head + InstSize - ExecuteLoopSize; i < head + InstSize; ++i)
+                code.code_pages[getCodePage(code, static_cast<uint32_t>(i))] = 1;
+        }
+    }
+    if (!enterCollapseLevel(m, tc, m.data_offset, head, 0, m.mem_size, tc.host_head_ok))
+        return false;
+    ++tc.stats.entries;
+    runCollapsedLevel(m, tc, code, stop_cycles);
+    const bool executed = tc.levels.back().executed;
+    leaveCollapseLevel(m, tc);
+    return executed;
+}
+
+// host wrote the instruction at inst_addr
+void invalidateCollapse(TowerCollapse& tc, int32_t inst_addr)
+{
+    if (tc.host_head >= 0 && inst_addr + InstSize > tc.host_head + InstSize - ExecuteLoopSize &&
+        inst_addr < tc.host_head + InstSize)
+        tc.host_head = -1;
+}
+
+/*
+* Tiered engine
+*
+* Starts everything in the reference interpreter and keeps an execution
+* counter per basic block (by its first slot). A block run tiered_decoded
+* times is promoted to the decoded engine, tiered_native times to the JIT
+* (where the JIT is not available the decoded engine is the top tier and
+* keeps running once entered).
+* Code that runs only a few times, like program setup, never pays for
+* decoding or translation.
+*
+* Stores into promoted code, by any tier, demote every block covering
+* the written slot back to the reference interpreter and reset its counter.
+*/
+
+enum class Tier : uint8_t
+{
+    Reference = 0,
+    Decoded,
+    Native,
+    Count
+};
+
+constexpr uint32_t TierCount = static_cast<uint32_t>(Tier::Count);
+
+struct TieredStats
+{
+    std::array<uint64_t, TierCount> cycles{}; // instructions executed by each tier
+    std::array<uint64_t, TierCount> promotions{}; // blocks promoted to each tier
+    uint64_t demotions = 0; // blocks demoted by overwritten code
+    uint64_t collapsed_cycles = 0; // cycles counted by collapseTower()
+};
+
+struct TieredCode
+{
+    JitCode jit; // decoded slots and translated blocks
+    std::vector<Tier> tier; // per block start slot
+    std::vector<uint32_t> count; // per block start slot
+    std::vector<uint8_t> length; // per promoted block start slot
+    std::vector<uint8_t> covered; // number of promoted blocks covering each slot
+    std::vector<CodeBlock> blocks; // promoted blocks
+    uint32_t decoded_threshold = 16;
+    uint32_t native_threshold = 1000;
+    TieredStats stats;
+    TowerCollapse collapse;
+};
+
+void resetTieredCode(TieredCode& tiered, const Machine& m)
+{
+    resetJitCode(tiered.jit, m);
+    const size_t slot_count = tiered.jit.decoded.op.size();
+    tiered.tier.assign(slot_count, Tier::Reference);
+    tiered.count.assign(slot_count, 0);
+    tiered.length.assign(slot_count, 0);
+    tiered.covered.assign(slot_count, 0);
+    tiered.blocks.clear();
+    tiered.stats = TieredStats();
+}
+
+// demotes promoted blocks covering the slot
+void demoteSlot(TieredCode& tiered, uint32_t slot)
+{
+    invalidateJitSlot(tiered.jit, slot);
+    invalidateCollapse(tiered.collapse, tiered.jit.decoded.slot_base + static_cast<int32_t>(slot) * InstSize);
+    if (!tiered.covered[slot])
+        return;
+    for(size_t i = tiered.blocks.size(); i > 0; --i) {
+        const CodeBlock b = tiered.blocks[i - 1];
+        if (slot > b.slot || slot + b.length <= b.slot)
+            continue;
+        tiered.tier[b.slot] = Tier::Reference;
+        tiered.count[b.slot] = 0;
+        for(uint32_t k = 0; k < b.length; ++k)
+            --tiered.covered[b.slot - k];
+        tiered.blocks[i - 1] = tiered.blocks.back();
+        tiered.blocks.pop_back();
+        ++tiered.stats.demotions;
+    }
+}
+
+void applyTieredInvalidations(TieredCode& tiered)
+{
+    for(const uint32_t slot : tiered.jit.invalidated)
+        demoteSlot(tiered, slot);
+    tiered.jit.invalidated.clear();
+}
+
+// word written by the instruction at inst_addr, if it's a store that won't fault
+bool getStoreAddr(const Machine& m, int32_t inst_addr, uint32_t& addr)
+{
+    const uint32_t data_offset = static_cast<uint32_t>(m.data_offset);
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const int32_t arg1 = m.mem[static_cast<uint32_t>(inst_addr + 1)];
+    addr = static_cast<uint32_t>(arg1) + data_offset;
+    if (addr >= mem_size)
+        return false;
+    switch(static_cast<OpCode>(m.mem[static_cast<uint32_t>(inst_addr + 2)])) {
+    case OpCode::St:
+    case OpCode::Stv:
+        addr = static_cast<uint32_t>(m.mem[addr]) + data_offset;
+        return addr < mem_size;
+    case OpCode::Lia:
+    case OpCode::Ld:
+    case OpCode::Mov:
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+    case OpCode::Movv:
+    case OpCode::Addv:
+    case OpCode::Subv:
+    case OpCode::Mulv:
+    case OpCode::Divv:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// runs one basic block on execute(), keeping decoded code in sync with stores
+Result runReferenceBlock(Machine& m, TieredCode& tiered, int64_t stop_cycles)
+{
+    DecodedCode& code = tiered.jit.decoded;
+    Result res = Result::Continue;
+    for(uint32_t length = 0; length < JitMaxBlockLength && m.cycles < stop_cycles; ++length) {
+        const int32_t inst_addr = m.inst_addr - InstSize;
+        if (inst_addr < 0 || inst_addr > m.mem_size - InstSize)
+            return execute(m); // reports the fault
+        const int32_t opcode = m.mem[static_cast<uint32_t>(inst_addr + 2)];
+        uint32_t store_addr;
+        const bool store = getStoreAddr(m, inst_addr, store_addr);
+        res = execute(m);
+        if (res != Result::Continue && res != Result::InfiniteLoop)
+            break;
+        if (store && code.code_pages[getCodePage(code, store_addr)]) {
+            invalidateDecodedCode(code, store_addr);
+            demoteSlot(tiered, getSlot(code, store_addr));
+        }
+        if (res != Result::Continue || static_cast<uint32_t>(opcode) >= OpCodeCount ||
+            !isJitBodyOp(static_cast<DecodedOp>(opcode + 1)))
+            break;
+    }
+    return res;
+}
+
+Result runTiered(Machine& m, TieredCode& tiered, int64_t budget)
+{
+    JitCode& jit = tiered.jit;
+    DecodedCode& code = jit.decoded;
+    if (code.data_offset != m.data_offset || code.mem_size != m.mem_size || tiered.tier.empty())
+        resetTieredCode(tiered, m);
+
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    Result res = Result::Continue;
+    while(res == Result::Continue && m.cycles < stop_cycles) {
+        const int64_t start_cycles = m.cycles;
+        const int32_t inst_addr = m.inst_addr - InstSize;
+        if (!isSlotAddr(code, inst_addr, m.mem_size))
+            return execute(m); // reports the fault
+        if (tiered.collapse.enabled && collapseTower(m, tiered.collapse, code, inst_addr, stop_cycles)) {
+            tiered.stats.collapsed_cycles += static_cast<uint64_t>(m.cycles - start_cycles);
+            continue;
+        }
+        const uint32_t slot = getSlot(code, static_cast<uint32_t>(inst_addr));
+        Tier& tier = tiered.tier[slot];
+        const uint32_t count = ++tiered.count[slot];
+        if (tier == Tier::Reference && count >= tiered.decoded_threshold) {
+            const uint32_t length = getBlockLength(code, m, slot);
+            tier = Tier::Decoded;
+            tiered.length[slot] = static_cast<uint8_t>(length);
+            tiered.blocks.push_back({slot, length});
+            for(uint32_t k = 0; k < length; ++k)
+                ++tiered.covered[slot - k];
+            ++tiered.stats.promotions[static_cast<uint32_t>(Tier::Decoded)];
+        }
+        // collapsed loop heads stay with the manager, jumps mustn't be chained to them
+        if (tier == Tier::Decoded && count == tiered.native_threshold && jit.arena &&
+            !(tiered.collapse.enabled && isExecuteLoopHead(m.mem.data(), inst_addr)) &&
+            translateBlock(jit, m, slot)) {
+            tier = Tier::Native;
+            ++tiered.stats.promotions[static_cast<uint32_t>(Tier::Native)];
+        }
+
+        const Tier run_tier = tier;
+        switch(run_tier) {
+        case Tier::Reference:
+            res = runReferenceBlock(m, tiered, stop_cycles);
+            break;
+        case Tier::Decoded:
+            // as the top tier it runs on instead of returning after every block
+            res = runDecoded(m, code, jit.arena || tiered.collapse.enabled ?
+                std::min<int64_t>(tiered.length[slot], stop_cycles - m.cycles) : stop_cycles - m.cycles);
+            break;
+        case Tier::Native:
+            // a block dropped by the JIT (arena flush) is retranslated
+            if (!jit.entry[slot] && !translateBlock(jit, m, slot)) {
+                tier = Tier::Decoded;
+                continue;
+            }
+            res = enterJitBlock(m, jit, jit.entry[slot], stop_cycles);
+            break;
+        case Tier::Count:
+            break;
+        }
+        applyTieredInvalidations(tiered);
+        tiered.stats.cycles[static_cast<uint32_t>(run_tier)] += static_cast<uint64_t>(m.cycles - start_cycles);
+    }
+    return res;
+}
+
+void dumpTieredStats(const TieredCode& tiered, std::ostream& os)
+{
+    static const char* names[TierCount] = { "reference", "decoded", "native" };
+    for(uint32_t i = 0; i < TierCount; ++i) {
+        os << "tier " << names[i] << ": " << tiered.stats.cycles[i] << " cycles";
+        if (i)
+            os << ", " << tiered.stats.promotions[i] << " promotions";
+        os << std::endl;
+    }
+    os << "tier demotions: " << tiered.stats.demotions << std::endl;
+    if (tiered.collapse.enabled) {
+        const CollapseStats& stats = tiered.collapse.stats;
+        os << "collapse: " << tiered.stats.collapsed_cycles << " cycles, " << stats.entries << " entries";
+        for(uint32_t i = 0; i < MaxCollapseDepth && stats.instructions[i]; ++i)
+            os << ", level " << (i + 2) << " " << stats.instructions[i] << " instructions";
+        os << std::endl;
+    }
+}
+
+
+/*
+* Sampling profiler
+*
+* With VmOptions::sample_interval Vm::run() runs the engine in slices of
+* random length around SampleSliceCycles (so slice ends don't fall on the
+* same instruction of a loop every time) and takes a sample after every
+* slice in which the SampleTimer ticked. A sample is the instruction the
+* machine runs next and, while that's in @execute_loop of execute_program
+* (recognised by the hash the tower collapse uses), the instruction of
+* the machine it interprets, read from the interpreter registers, and so
+* on down the tower. Levels running a copy of the program are marked, so
+* they can be symbolised with its labels.
+*/
+
+constexpr int64_t SampleSliceCycles = 1 << 14;
+
+struct SampleState
+{
+    SampleTimer timer;
+    SampleRing ring;
+    bool timer_ok = true;
+    const std::vector<Op>* ops = nullptr;
+    int64_t loop_head = -1; // instruction index of @execute_loop in the program
+    uint64_t random = 0x9e3779b97f4a7c15ull;
+    // drained samples by program_levels and index bytes of the stack
+    std::unordered_map<std::string, uint64_t> stacks;
+};
+
+// instruction of a level of the interpreter tower
+struct TowerPos
+{
+    int64_t index; // instruction index, -1 outside the program at level 1
+    int64_t inst; // host memory index of the instruction
+    bool program; // the level runs a copy of the program
+};
+
+// instruction index of @execute_loop of execute_program in the program, -1 if none
+int64_t findExecuteLoop(const Machine& m, const std::vector<Op>& ops)
+{
+    const auto count = static_cast<int64_t>(ops.size());
+    for(int64_t k = 0; k + ExecuteLoopInstCount <= count; ++k) {
+        const int64_t head = m.data_offset - (k + 1) * InstSize;
+        if (isExecuteLoopHead(m.mem.data(), head) && getExecuteLoopHash(m, head) == ExecuteLoopHash)
+            return k;
+    }
+    return -1;
+}
+
+// next instruction of the machine and, while it's in @execute_loop at
+// loop_head, of the machine it interprets, read from the registers of
+// execute_program, and so on down the tower; returns the number of levels
+uint32_t walkTower(const Machine& m, const std::vector<Op>& ops, int64_t loop_head,
+    std::array<TowerPos, MaxSampleDepth + 1>& levels)
+{
+    const int32_t* const mem = m.mem.data();
+    const auto count = static_cast<int64_t>(ops.size());
+    const int64_t rel = static_cast<int64_t>(m.data_offset) - m.inst_addr;
+    int64_t k = rel / InstSize;
+    bool program = rel >= 0 && (rel % InstSize) == 0 && k < count;
+    levels[0] = {program ? k : -1, m.inst_addr - InstSize, program};
+    uint32_t depth = 1;
+    int64_t offset = m.data_offset; // host index of address 0 of the level
+    while(program && loop_head >= 0 && k >= loop_head && k < loop_head + ExecuteLoopInstCount &&
+        depth <= MaxSampleDepth) {
+        if (offset < 0 || offset + ExecRegCount > m.mem_size)
+            break;
+        const int32_t data = mem[offset + ExecDataOffs];
+        // the first instructions of the loop fetch the interpreted one, each
+        // second of them decrementing m_inst_addr
+        const int64_t fetched = std::min<int64_t>((k - loop_head + 1) / 2, InstSize);
+        const int64_t inst_addr = static_cast<int64_t>(mem[offset + ExecInstAddr]) + fetched - InstSize;
+        const int64_t guest_rel = static_cast<int64_t>(data) - InstSize - inst_addr;
+        if (guest_rel < 0 || (guest_rel % InstSize) != 0 || guest_rel / InstSize > INT32_MAX)
+            break;
+        k = guest_rel / InstSize;
+        offset += data;
+        const int64_t inst = offset - (k + 1) * InstSize;
+        if (inst < 0 || inst + InstSize > m.mem_size)
+            break;
+        program = k < count &&
+            mem[inst + 2] == static_cast<int32_t>(ops[static_cast<size_t>(k)].code) &&
+            mem[inst + 1] == ops[static_cast<size_t>(k)].arg1 && mem[inst] == ops[static_cast<size_t>(k)].arg2;
+        levels[depth++] = {k, inst, program};
+    }
+    return depth;
+}
+
+void takeSample(const Machine& m, SampleState& ss, uint32_t weight)
+{
+    std::array<TowerPos, MaxSampleDepth + 1> levels;
+    Sample sample;
+    sample.weight = weight;
+    sample.depth = walkTower(m, *ss.ops, ss.loop_head, levels);
+    sample.program_levels = 0;
+    for(uint32_t i = 0; i < sample.depth; ++i) {
+        sample.index[i] = static_cast<int32_t>(levels[i].index);
+        if (levels[i].program)
+            sample.program_levels |= 1u << i;
+    }
+    ss.ring.push(sample);
+}
+
+void resetSampleState(SampleState& ss, const Machine& m, const std::vector<Op>& ops)
+{
+    ss.ops = &ops;
+    ss.loop_head = findExecuteLoop(m, ops);
+    ss.stacks.clear();
+    Sample sample;
+    while(ss.ring.pop(sample)) {}
+}
+
+void drainSamples(SampleState& ss)
+{
+    Sample sample;
+    while(ss.ring.pop(sample)) {
+        std::string key(reinterpret_cast<const char*>(&sample.program_levels), sizeof(sample.program_levels));
+        key.append(reinterpret_cast<const char*>(sample.index.data()), sample.depth * sizeof(int32_t));
+        ss.stacks[key] += sample.weight;
+    }
+}
+
+// runFor() on the engine, which with samples runs in random slices with a
+// sample taken after every one the timer ticked in
+template<typename Run>
+Result runSampled(Machine& m, SampleState* samples, uint64_t budget, RunDeadline deadline, Run run)
+{
+    if (!samples)
+        return runFor(m, budget, deadline, run);
+    return runFor(m, budget, deadline, [samples, &run](Machine& m, int64_t budget) {
+        SampleState& ss = *samples;
+        const int64_t stop_cycles = getStopCycles(m, budget);
+        Result res;
+        do {
+            ss.random ^= ss.random << 13;
+            ss.random ^= ss.random >> 7;
+            ss.random ^= ss.random << 17;
+            const int64_t slice = SampleSliceCycles / 2 + static_cast<int64_t>(ss.random % SampleSliceCycles);
+            const int64_t start_cycles = m.cycles;
+            res = run(m, std::min(slice, stop_cycles - m.cycles));
+            if (const uint32_t ticks = ss.timer.takeTicks())
+                takeSample(m, ss, ticks);
+            if (ss.ring.size() >= SampleRing::Size / 2)
+                drainSamples(ss);
+            if (m.cycles == start_cycles)
+                break; // uncounted cycles
+        } while(res == Result::Continue && m.cycles < stop_cycles);
+        return res;
+    });
+}
+
+
+/*
+* Tower profile
+*
+* The reference engine attributing every base cycle to the instruction
+* each level of the interpreter tower is running (see walkTower()): level
+* 1 is the program, level n + 1 the machine interpreted by execute_program
+* at level n. The cycle is counted for the opcode of the instruction at
+* every level from 2, under the phase of the interpreter below it, found
+* by the instruction of @execute_loop that interpreter is at: fetch of the
+* instruction, the opcode switch tree, bounds and alignment checks of
+* operands and jump targets, the operation itself and the loop around it
+* (jumps back to the loop head and the execution limit).
+*/
+
+enum class TowerPhase : uint8_t
+{
+    Fetch,
+    Switch,
+    Checks,
+    Execute,
+    Loop,
+    Count
+};
+
+constexpr uint32_t TowerPhaseCount = static_cast<uint32_t>(TowerPhase::Count);
+
+struct TowerProfile
+{
+    const std::vector<Op>* ops = nullptr;
+    int64_t loop_head = -1;
+    std::vector<TowerPhase> phase; // of every instruction of @execute_loop
+    // [level - 2][opcode]: base cycles by phase and interpreted instructions
+    std::array<std::array<std::array<uint64_t, TowerPhaseCount>, OpCodeCount>, MaxSampleDepth> cycles;
+    std::array<std::array<uint64_t, OpCodeCount>, MaxSampleDepth> instructions;
+};
+
+// phases of @execute_loop instructions by what they read and write: the
+// switch tree compares ra (the opcode) through rd, checks compare other
+// values through rd, the loop counts rcnt and jumps back with jr
+void classifyTowerPhases(TowerProfile& tp)
+{
+    const std::vector<Op>& ops = *tp.ops;
+    tp.phase.assign(static_cast<size_t>(ExecuteLoopInstCount), TowerPhase::Execute);
+    bool switch_rd = false; // rd holds the opcode
+    for(int32_t j = 0; j < ExecuteLoopInstCount; ++j) {
+        const Op& op = ops[static_cast<size_t>(tp.loop_head + j)];
+        const bool cond_jump = op.code >= OpCode::Jnz && op.code <= OpCode::Jle;
+        TowerPhase& phase = tp.phase[static_cast<size_t>(j)];
+        if (j < 2 * InstSize) {
+            phase = TowerPhase::Fetch;
+        } else if (op.code == OpCode::Mov && op.arg1 == ExecRd && op.arg2 == ExecRa) {
+            phase = TowerPhase::Switch;
+            switch_rd = true;
+            continue;
+        } else if (switch_rd && ((op.code == OpCode::Subv && op.arg1 == ExecRd) || (cond_jump && op.arg2 == ExecRd))) {
+            phase = TowerPhase::Switch;
+            continue;
+        } else if ((cond_jump && op.arg2 == ExecRd) || (!cond_jump && op.arg1 == ExecRd)) {
+            phase = TowerPhase::Checks;
+        } else if (op.code == OpCode::Jr || (cond_jump && op.arg2 == ExecRcnt) || (!cond_jump && op.arg1 == ExecRcnt)) {
+            phase = TowerPhase::Loop;
+        }
+        switch_rd = false;
+    }
+}
+
+void resetTowerProfile(TowerProfile& tp, const Machine& m, const std::vector<Op>& ops)
+{
+    tp.ops = &ops;
+    tp.loop_head = findExecuteLoop(m, ops);
+    if (tp.loop_head >= 0)
+        classifyTowerPhases(tp);
+    for(auto& level : tp.cycles) {
+        for(auto& opcode : level)
+            opcode.fill(0);
+    }
+    for(auto& level : tp.instructions)
+        level.fill(0);
+}
+
+Result runTowerProfile(Machine& m, TowerProfile& tp, int64_t budget)
+{
+    const int64_t stop_cycles = getStopCycles(m, budget);
+    std::array<TowerPos, MaxSampleDepth + 1> levels;
+    Result res;
+    do {
+        const uint32_t depth = walkTower(m, *tp.ops, tp.loop_head, levels);
+        // an instruction starts with the first cycle of the loop head of every level above it
+        bool starts = true;
+        for(uint32_t i = 1; i < depth; ++i) {
+            const auto j = static_cast<size_t>(levels[i - 1].index - tp.loop_head);
+            starts &= !j;
+            const auto opcode = static_cast<uint32_t>(m.mem[static_cast<size_t>(levels[i].inst + 2)]);
+            if (opcode >= OpCodeCount)
+                continue;
+            ++tp.cycles[i - 1][opcode][static_cast<uint32_t>(tp.phase[j])];
+            if (starts)
+                ++tp.instructions[i - 1][opcode];
+        }
+        res = execute(m);
+    } while(res == Result::Continue && m.cycles < stop_cycles);
+    return res;
+}
+
+void dumpTowerProfile(const TowerProfile& tp, std::ostream& os)
+{
+    static const char* phase_names[TowerPhaseCount] = { "fetch", "switch", "checks", "execute", "loop" };
+    if (tp.loop_head < 0) {
+        os << "tower: no execute_program in the program" << std::endl;
+        return;
+    }
+    for(uint32_t level = 0; level < MaxSampleDepth; ++level) {
+        std::vector<std::pair<uint64_t, uint32_t>> order; // base cycles, opcode
+        uint64_t level_cycles = 0, level_instructions = 0;
+        for(uint32_t i = 0; i < OpCodeCount; ++i) {
+            uint64_t cycles = 0;
+            for(const uint64_t c : tp.cycles[level][i])
+                cycles += c;
+            if (cycles)
+                order.emplace_back(cycles, i);
+            level_cycles += cycles;
+            level_instructions += tp.instructions[level][i];
+        }
+        if (!level_cycles)
+            break;
+        std::sort(order.begin(), order.end(),
+            [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+        os << "level " << (level + 2) << ": " << level_instructions << " instructions, "
+           << level_cycles << " base cycles" << std::endl;
+        for(const auto& p : order) {
+            const uint64_t count = tp.instructions[level][p.second];
+            os << "  " << opcode_def[p.second].first << " " << p.first << " base cycles";
+            if (count)
+                os << " (" << count << " instructions, " << p.first / count << " each)";
+            const char* sep = ": ";
+            for(uint32_t k = 0; k < TowerPhaseCount; ++k) {
+                if (tp.cycles[level][p.second][k]) {
+                    os << sep << phase_names[k] << " " << tp.cycles[level][p.second][k];
+                    sep = ", ";
+                }
+            }
+            os << std::endl;
+        }
+    }
+}
+
+/*
+* Lock-step engine
+*/
+
+constexpr uint32_t MaxLockstepLanes = 16;
+
+// machines running one program, the lanes of vm-lockstep-engine.h
+struct LockstepMachine
+{
+    uint32_t lanes;
+    int32_t data_offset;
+    int32_t mem_size; // of every lane
+    int64_t max_cycles;
+    MachineMemory mem; // word w of lane l at w * lanes + l
+    bool uniform_code; // nothing was stored below data_offset, every lane has the same code
+    int32_t inst_addr[MaxLockstepLanes];
+    int64_t cycles[MaxLockstepLanes];
+    int64_t last_dbgext_cycles[MaxLockstepLanes];
+    Result result[MaxLockstepLanes]; // Result::Continue while running
+    OutputSink* output[MaxLockstepLanes];
+};
+
+#if VM_LOCKSTEP
+#define VM_LOCKSTEP_SSE2 1
+#define VM_LOCKSTEP_AVX2 2
+#define VM_LOCKSTEP_AVX512 3
+
+namespace lockstep_base {
+constexpr uint32_t Lanes = 4;
+#if VM_LOCKSTEP_X86
+#define VM_LOCKSTEP_ISA VM_LOCKSTEP_SSE2
+#else
+#define VM_LOCKSTEP_ISA 0
+#endif
+#include "vm-lockstep-engine.h"
+#undef VM_LOCKSTEP_ISA
+}
+
+#if VM_LOCKSTEP_X86
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+namespace lockstep_avx2 {
+constexpr uint32_t Lanes = 8;
+#define VM_LOCKSTEP_ISA VM_LOCKSTEP_AVX2
+#include "vm-lockstep-engine.h"
+#undef VM_LOCKSTEP_ISA
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace lockstep_avx512 {
+constexpr uint32_t Lanes = 16;
+#define VM_LOCKSTEP_ISA VM_LOCKSTEP_AVX512
+#include "vm-lockstep-engine.h"
+#undef VM_LOCKSTEP_ISA
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
+#endif
+
+uint32_t getLockstepLanes()
+{
+#if VM_LOCKSTEP_X86
+    if (__builtin_cpu_supports("avx512f"))
+        return 16;
+    if (__builtin_cpu_supports("avx2"))
+        return 8;
+#endif
+#if VM_LOCKSTEP
+    return 4;
+#else
+    return 0;
+#endif
+}
+
+// lanes of 4, 8 or 16 (getLockstepLanes() at most) machines of ops, all
+// stopped (Result::Halt) until startLane(); false if they don't fit the
+// layout or lane memory exceeds int32 word indices (of gathers)
+bool resetLockstep(LockstepMachine& m, uint32_t lanes, const std::vector<Op>& ops, const VmOptions& options)
+{
+    if (!getMachineLayout(ops.size(), options.layout, m.data_offset, m.mem_size) ||
+        static_cast<int64_t>(m.mem_size) * lanes > INT32_MAX)
+        return false;
+    m.lanes = lanes;
+    m.max_cycles = options.max_cycles;
+    // bounds are checked, guarded memory is plain mapped memory here
+    m.mem.backend = options.memory == MemoryBackend::Guarded ? MemoryBackend::Mapped : options.memory;
+    m.mem.huge_pages = options.huge_pages;
+    m.mem.assign(static_cast<size_t>(m.mem_size) * lanes, 0);
+    m.uniform_code = true;
+    uint32_t ofs = static_cast<uint32_t>(m.data_offset);
+    for(const auto& op : ops) {
+        ofs -= InstSize;
+        for(uint32_t l = 0; l < lanes; ++l) {
+            m.mem[(ofs + 2) * lanes + l] = static_cast<int32_t>(op.code);
+            m.mem[(ofs + 1) * lanes + l] = op.arg1;
+            m.mem[ofs * lanes + l] = op.arg2;
+        }
+    }
+    for(uint32_t l = 0; l < MaxLockstepLanes; ++l) {
+        m.inst_addr[l] = m.data_offset;
+        m.cycles[l] = m.last_dbgext_cycles[l] = 0;
+        m.result[l] = Result::Halt;
+        m.output[l] = getStdoutSink();
+    }
+    return true;
+}
+
+void startLane(LockstepMachine& m, uint32_t lane, OutputSink* output)
+{
+    m.result[lane] = Result::Continue;
+    m.output[lane] = output;
+}
+
+// runs every started lane to its end
+void runLockstep(LockstepMachine& m)
+{
+    switch(m.lanes) {
+#if VM_LOCKSTEP_X86
+    case 16:
+        lockstep_avx512::runLanes(m);
+        break;
+    case 8:
+        lockstep_avx2::runLanes(m);
+        break;
+#endif
+#if VM_LOCKSTEP
+    case 4:
+        lockstep_base::runLanes(m);
+        break;
+#endif
+    default:
+        assert(false);
+    }
+}
+
+/*
+* Result cache
+*
+* A run from reset depends only on the program, the layout, the cycle
+* limit and the engine options which change results (ResultFlag); the
+* engine and memory backend don't change them. A finished run is written
+* as a result file (vm-bytecode.h) named by a hash of those, holding the
+* memory as the words which differ from the machine as reset, and read
+* back by the first run() of a machine reset to the same key. The key
+* stored in the file is compared in full, so a hash collision is a miss.
+*/
+
+enum ResultFlag : uint32_t
+{
+    ResultCyclesExecuted = 1, // tiered collapse with CollapseCycles::Executed
+    ResultUnchecked = 2, // reference engine policies
+    ResultUncounted = 4,
+    ResultNoDbg = 8
+};
+
+// off for runs observed while they run
+bool useResultCache(const VmOptions& o)
+{
+    return !o.result_cache.empty() && !o.policy.trace && !o.policy.profile && !o.policy.tower &&
+        !o.sample_interval && !o.hw_counters;
+}
+
+// counted_cycles is the policy selectReference() picked, checks it drops
+// for programs which can't fail them and dbg of programs without output
+// change nothing, so only the options are
+ResultFileKey getResultKey(const Machine& m, const std::vector<Op>& ops, const VmOptions& o, bool counted_cycles)
+{
+    uint32_t flags = 0;
+    if (o.engine == Engine::Tiered && o.collapse && o.collapse_cycles == CollapseCycles::Executed)
+        flags |= ResultCyclesExecuted;
+    if (o.engine == Engine::Reference) {
+        flags |= (o.policy.unchecked ? static_cast<uint32_t>(ResultUnchecked) : 0u) |
+            (!counted_cycles ? static_cast<uint32_t>(ResultUncounted) : 0u) |
+            (o.policy.no_dbg ? static_cast<uint32_t>(ResultNoDbg) : 0u);
+    }
+    return {static_cast<uint32_t>(ops.size()), m.data_offset, m.mem_size, flags, o.max_cycles};
+}
+
+std::string getResultPath(const std::string& dir, const ResultFileKey& key, const std::vector<Op>& ops)
+{
+    std::vector<char> bytes(sizeof(key) + ops.size() * sizeof(Op));
+    memcpy(bytes.data(), &key, sizeof(key));
+    if (!ops.empty())
+        memcpy(bytes.data() + sizeof(key), ops.data(), ops.size() * sizeof(Op));
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.vmr", static_cast<unsigned long long>(hashText(bytes.data(), bytes.size())));
+    return dir + "/" + name;
+}
+
+bool isResultOf(const ResultEntry& entry, const ResultFileKey& key, const std::vector<Op>& ops)
+{
+    return memcmp(&entry.key, &key, sizeof(key)) == 0 && entry.ops.size() == ops.size() &&
+        (ops.empty() || memcmp(entry.ops.data(), ops.data(), ops.size() * sizeof(Op)) == 0);
+}
+
+// words of m which differ from the machine as resetMachine() loaded ops
+void getChangedWords(const Machine& m, const std::vector<Op>& ops, ResultEntry& entry)
+{
+    const uint32_t size = static_cast<uint32_t>(m.mem_size);
+    const uint32_t code_end = static_cast<uint32_t>(m.data_offset);
+    const uint32_t code_begin = code_end - static_cast<uint32_t>(ops.size()) * InstSize;
+    std::vector<int32_t> code(ops.size() * InstSize);
+    for(size_t k = 0; k < ops.size(); ++k) {
+        const size_t ofs = code.size() - (k + 1) * InstSize;
+        code[ofs + 2] = static_cast<int32_t>(ops[k].code);
+        code[ofs + 1] = ops[k].arg1;
+        code[ofs] = ops[k].arg2;
+    }
+    // the code is compared wherever it is, other words only where memory
+    // may be nonzero
+    std::vector<std::pair<size_t, size_t>> ranges = m.mem.getWrittenRanges();
+    ranges.emplace_back(code_begin, code_end);
+    std::sort(ranges.begin(), ranges.end());
+    const int32_t* words = m.mem.data();
+    constexpr uint32_t Block = 64;
+    uint32_t addr = 0;
+    for(const auto& range : ranges) {
+        addr = std::max(addr, static_cast<uint32_t>(range.first));
+        const uint32_t end = static_cast<uint32_t>(std::min<size_t>(range.second, size));
+        while(addr < end) {
+            // zero blocks outside of the code are skipped at once
+            if (addr % Block == 0 && addr + Block <= end && (addr + Block <= code_begin || addr >= code_end)) {
+                int32_t any = 0;
+                for(uint32_t i = 0; i < Block; ++i)
+                    any |= words[addr + i];
+                if (!any) {
+                    addr += Block;
+                    continue;
+                }
+            }
+            const int32_t loaded = addr >= code_begin && addr < code_end ? code[addr - code_begin] : 0;
+            if (words[addr] != loaded) {
+                if (entry.runs.empty() || entry.runs.back().addr + entry.runs.back().size != addr)
+                    entry.runs.push_back({addr, 0});
+                ++entry.runs.back().size;
+                entry.words.push_back(words[addr]);
+            }
+            ++addr;
+        }
+    }
+}
+
+// the machine as the run of the entry left it, with its output
+void restoreResult(Machine& m, const ResultEntry& entry)
+{
+    size_t word = 0;
+    for(const auto& run : entry.runs) {
+        memcpy(&m.mem[run.addr], entry.words.data() + word, run.size * sizeof(int32_t));
+        word += run.size;
+    }
+    m.inst_addr = entry.inst_addr;
+    m.cycles = entry.cycles;
+    m.last_dbgext_cycles = entry.last_dbgext_cycles;
+    for(const auto& out : entry.output) {
+        if (out.kind == ResultOutput::Dbg)
+            m.output->dbg(out.addr, static_cast<int32_t>(out.a), static_cast<int32_t>(out.b));
+        else
+            m.output->dbgext(out.a, out.b);
+    }
+}
+
+// forwards output to the sink of the Vm and records it for the result file
+class RecordingSink : public OutputSink
+{
+public:
+    OutputSink* target = nullptr;
+    std::vector<ResultFileOutput> output;
+
+    void dbg(int32_t addr, int32_t rel_addr, int32_t value) override
+    {
+        target->dbg(addr, rel_addr, value);
+        output.push_back({ResultOutput::Dbg, addr, rel_addr, value});
+    }
+
+    void dbgext(int64_t cycles, int64_t diff) override
+    {
+        target->dbgext(cycles, diff);
+        output.push_back({ResultOutput::Dbgext, 0, cycles, diff});
+    }
+};
+
+long getProcessId()
+{
+#if VM_PROCESS_ID
+    return static_cast<long>(getpid());
+#else
+    return 0;
+#endif
+}
+
+enum class ResultCacheState
+{
+    Off,
+    Lookup, // reset, the first run() reads the result file
+    Recording // running from reset, output goes through RecordingSink
+};
+
+/*
+* Library API
+*/
+
+ProgramRef compileProgram(const char* code_file_path, CompileError& error,
+    const std::vector<std::pair<std::string, int32_t>>& defs)
+{
+#if VM_EMBED_EXECUTE_PROGRAM
+    static const bool embedded = (registerUnit(&unit_execute_program::get()), true);
+    static_cast<void>(embedded);
+#endif
+    auto program = std::make_shared<Program>();
+    if (isBytecodeFile(code_file_path)) {
+        // already compiled, defs were applied then
+        if (!readBytecode(code_file_path, program->ops, program->debug)) {
+            error = CompileError();
+            error.file = code_file_path;
+            return nullptr;
+        }
+        return program;
+    }
+    if (!readAndCompile(program->ops, program->debug, code_file_path, defs, error))
+        return nullptr;
+    return program;
+}
+
+ProgramRef makeProgram(std::vector<Op> ops)
+{
+    auto program = std::make_shared<Program>();
+    program->ops = std::move(ops);
+    return program;
+}
+
+bool saveProgram(const Program& program, const char* path)
+{
+    return writeBytecode(path, program.ops, program.debug);
+}
+
+/*
+* Profile reports
+*
+* Instructions are mapped back to source through the debug info of the
+* program, which compileProgram() fills from the line map of the
+* assembler (the one that reports errors), and to the nearest label
+* at or above them.
+*/
+
+struct ProfileSite
+{
+    const std::string* file; // nullptr without debug info
+    uint32_t line;
+    const std::string* label; // nullptr when no label precedes it
+    int32_t label_offset;
+};
+
+ProfileSite getProfileSite(const Program& program, size_t index)
+{
+    const DebugInfo& debug = program.debug;
+    ProfileSite site = {nullptr, 0, nullptr, 0};
+    if (index < debug.lines.size() && debug.lines[index].file < debug.files.size()) {
+        site.file = &debug.files[debug.lines[index].file];
+        site.line = debug.lines[index].line;
+    }
+    // labels are sorted by instruction index
+    const auto label = std::upper_bound(debug.labels.begin(), debug.labels.end(), static_cast<int32_t>(index),
+        [](int32_t index, const std::pair<std::string, int32_t>& label) { return index < label.second; });
+    if (label != debug.labels.begin()) {
+        site.label = &std::prev(label)->first;
+        site.label_offset = static_cast<int32_t>(index) - std::prev(label)->second;
+    }
+    return site;
+}
+
+const char* getOpCodeName(OpCode opcode)
+{
+    const auto index = static_cast<uint32_t>(opcode);
+    return index < opcode_def.size() ? opcode_def[index].first.c_str() : "invalid";
+}
+
+bool isCondJump(OpCode opcode)
+{
+    return opcode >= OpCode::Jnz && opcode <= OpCode::Jle;
+}
+
+uint64_t getProfileTotal(const ExecProfile& profile)
+{
+    uint64_t total = profile.outside;
+    for(const uint64_t count : profile.executed)
+        total += count;
+    return total;
+}
+
+void printShare(std::ostream& os, uint64_t count, uint64_t total)
+{
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os.setf(std::ios::fixed, std::ios::floatfield);
+    os.precision(1);
+    os << count << " (" << (total ? 100.0 * static_cast<double>(count) / static_cast<double>(total) : 0.0) << "%)";
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void dumpProfile(const ExecProfile& profile, const Program& program, std::ostream& os, size_t top)
+{
+    const uint64_t total = getProfileTotal(profile);
+    os << "profile: " << total << " instructions, " << profile.outside << " outside the program" << std::endl;
+    std::vector<uint32_t> order;
+    for(uint32_t i = 0; i < OpCodeCount; ++i) {
+        if (profile.opcodes[i])
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&profile](uint32_t a, uint32_t b) { return profile.opcodes[a] > profile.opcodes[b]; });
+    os << "opcodes:" << std::endl;
+    for(const uint32_t i : order) {
+        os << "  " << getOpCodeName(static_cast<OpCode>(i)) << " ";
+        printShare(os, profile.opcodes[i], total);
+        os << std::endl;
+    }
+
+    std::vector<size_t> hot;
+    for(size_t i = 0; i < profile.executed.size(); ++i) {
+        if (profile.executed[i])
+            hot.push_back(i);
+    }
+    const size_t count = std::min(top, hot.size());
+    std::partial_sort(hot.begin(), hot.begin() + static_cast<ptrdiff_t>(count), hot.end(),
+        [&profile](size_t a, size_t b) {
+            return profile.executed[a] != profile.executed[b] ? profile.executed[a] > profile.executed[b] : a < b;
+        });
+    os << "hot spots:" << std::endl;
+    for(size_t k = 0; k < count; ++k) {
+        const size_t i = hot[k];
+        const OpCode opcode = i < program.ops.size() ? program.ops[i].code : OpCode::Nop;
+        const ProfileSite site = getProfileSite(program, i);
+        os << "  ";
+        printShare(os, profile.executed[i], total);
+        os << " [" << i << "]";
+        if (site.file)
+            os << " " << *site.file << ":" << site.line;
+        if (site.label)
+            os << " " << *site.label << "+" << site.label_offset;
+        os << " " << getOpCodeName(opcode);
+        if (isCondJump(opcode))
+            os << ", taken " << profile.taken[i] << ", not taken " << (profile.executed[i] - profile.taken[i]);
+        os << std::endl;
+    }
+}
+
+void writeJsonString(std::ostream& os, const std::string& str)
+{
+    static const char hex[] = "0123456789abcdef";
+    os << '"';
+    for(const char c : str) {
+        const auto u = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (u < 0x20)
+            os << "\\u00" << hex[u >> 4] << hex[u & 15];
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+void writeProfileJson(const ExecProfile& profile, const Program& program, std::ostream& os)
+{
+    os << "{\n  \"instructions\": " << getProfileTotal(profile) << ",\n  \"outside\": " << profile.outside
+       << ",\n  \"opcodes\": {";
+    const char* sep = "";
+    for(uint32_t i = 0; i < OpCodeCount; ++i) {
+        if (profile.opcodes[i]) {
+            os << sep << "\"" << getOpCodeName(static_cast<OpCode>(i)) << "\": " << profile.opcodes[i];
+            sep = ", ";
+        }
+    }
+    os << "},\n  \"slots\": [";
+    sep = "\n";
+    for(size_t i = 0; i < profile.executed.size(); ++i) {
+        if (!profile.executed[i])
+            continue;
+        const OpCode opcode = i < program.ops.size() ? program.ops[i].code : OpCode::Nop;
+        const ProfileSite site = getProfileSite(program, i);
+        os << sep << "    {\"index\": " << i << ", \"opcode\": \"" << getOpCodeName(opcode) << "\"";
+        if (site.file) {
+            os << ", \"file\": ";
+            writeJsonString(os, *site.file);
+            os << ", \"line\": " << site.line;
+        }
+        if (site.label) {
+            os << ", \"label\": ";
+            writeJsonString(os, *site.label);
+            os << ", \"label_offset\": " << site.label_offset;
+        }
+        os << ", \"count\": " << profile.executed[i];
+        if (isCondJump(opcode))
+            os << ", \"taken\": " << profile.taken[i] << ", \"not_taken\": " << (profile.executed[i] - profile.taken[i]);
+        os << "}";
+        sep = ",\n";
+    }
+    os << "\n  ]\n}" << std::endl;
+}
+
+static const std::pair<const char*, Engine> engine_names[] = {
+    { "tiered", Engine::Tiered },
+    { "reference", Engine::Reference },
+    { "threaded", Engine::Threaded },
+    { "decoded", Engine::Decoded },
+    { "fused", Engine::Fused },
+    { "jit", Engine::Jit },
+};
+
+bool parseEngine(const std::string& name, Engine& engine)
+{
+    for(const auto& p : engine_names) {
+        if (name == p.first) {
+            engine = p.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* getEngineName(Engine engine)
+{
+    for(const auto& p : engine_names) {
+        if (engine == p.second)
+            return p.first;
+    }
+    return "unknown";
+}
+
+// superinstructions covering less of the profile aren't used
+constexpr double FusionMinShare = 0.005;
+
+struct Vm::State
+{
+    VmOptions options;
+    ProgramRef program;
+    Machine m;
+    // reference engine
+    ReferenceRun run_reference = nullptr;
+    bool checked_addr = true, counted_cycles = true, dbg = true, guarded_data = false;
+    ExecProfile exec_profile;
+    // decoded and fused engines, the latter profiling the first instructions
+    DecodedCode code;
+    FusionProfile profile;
+    int32_t profile_left = 0;
+    JitCode jit;
+    TieredCode tiered;
+    std::unique_ptr<SampleState> samples; // with sample_interval
+    std::unique_ptr<TowerProfile> tower; // reference engine with policy.tower
+    // with hw_counters: counts and machine cycles of the runs since reset()
+    HwCounterGroup hw_group;
+    HwCounts hw;
+    uint64_t hw_cycles = 0;
+    bool hw_ok = false;
+    // with result_cache
+    ResultCacheState cache = ResultCacheState::Off;
+    RecordingSink recording;
+    std::string result_path;
+    bool stale_engine = false; // memory was restored from a result file
+};
+
+Vm::Vm(const VmOptions& options) : state(new State())
+{
+    state->options = options;
+}
+
+Vm::~Vm() = default;
+
+bool Vm::reset(const ProgramRef& program)
+{
+    State& s = *state;
+    const VmOptions& o = s.options;
+    Machine& m = s.m;
+    if (s.cache == ResultCacheState::Recording)
+        m.output = s.recording.target;
+    s.cache = ResultCacheState::Off;
+    // a backend which fell back to vector memory is tried again
+    m.mem.backend = o.memory;
+    m.mem.huge_pages = o.huge_pages;
+    if (!program || !resetMachine(m, program->ops, o.layout)) {
+        s.program = nullptr;
+        return false;
+    }
+    s.program = program;
+    resetEngine(s);
+    if (useResultCache(o))
+        s.cache = ResultCacheState::Lookup;
+    return true;
+}
+
+bool Vm::fork(const Vm& source)
+{
+    State& s = *state;
+    const State& from = *source.state;
+    if (!from.program)
+        return false;
+    // a fork doesn't start from reset, it isn't cached
+    if (s.cache == ResultCacheState::Recording)
+        s.m.output = s.recording.target;
+    s.cache = ResultCacheState::Off;
+    OutputSink* output = s.m.output;
+    s.m = ::fork(from.m);
+    s.m.output = output;
+    s.program = from.program;
+    resetEngine(s);
+    return true;
+}
+
+// engine state for the machine as it is
+void Vm::resetEngine(State& s)
+{
+    const VmOptions& o = s.options;
+    Machine& m = s.m;
+    const ProgramRef& program = s.program;
+    s.stale_engine = false;
+    m.max_cycles = o.max_cycles;
+    m.profile = nullptr;
+    s.hw = HwCounts();
+    s.hw_cycles = 0;
+    s.hw_ok = false;
+    if (o.sample_interval) {
+        s.samples.reset(new SampleState());
+        resetSampleState(*s.samples, m, program->ops);
+    }
+    switch(o.engine) {
+    case Engine::Reference:
+    {
+        ProgramTraits traits;
+        analyzeProgram(traits, m, program->ops);
+        s.run_reference = selectReference(traits, o.policy, m,
+            s.checked_addr, s.counted_cycles, s.dbg, s.guarded_data);
+        if (o.policy.profile) {
+            resetExecProfile(s.exec_profile, m, program->ops.size());
+            m.profile = &s.exec_profile;
+        }
+        if (o.policy.tower) {
+            s.tower.reset(new TowerProfile());
+            resetTowerProfile(*s.tower, m, program->ops);
+        }
+        break;
+    }
+    case Engine::Threaded:
+        break;
+    case Engine::Decoded:
+        resetDecodedCode(s.code, m);
+        break;
+    case Engine::Fused:
+        resetDecodedCode(s.code, m);
+        s.code.fusion_weight.fill(0);
+        resetFusionProfile(s.profile);
+        s.profile_left = std::max(o.fusion_profile_cycles, 0);
+        break;
+    case Engine::Jit:
+        s.jit.threshold = o.jit_threshold;
+        s.jit.translated = s.jit.invalidated_blocks = s.jit.flushes = 0;
+        resetJitCode(s.jit, m);
+        break;
+    case Engine::Tiered:
+        s.tiered.decoded_threshold = o.tier_decoded;
+        s.tiered.native_threshold = std::max(o.tier_native, o.tier_decoded);
+        s.tiered.collapse = TowerCollapse();
+        s.tiered.collapse.enabled = o.collapse;
+        s.tiered.collapse.cycles = o.collapse_cycles;
+        resetTieredCode(s.tiered, m);
+        break;
+    }
+}
+
+RunResult Vm::run(uint64_t budget, RunDeadline deadline)
+{
+    State& s = *state;
+    Machine& m = s.m;
+    assert(s.program);
+    Result res = Result::Yield;
+    if (s.cache == ResultCacheState::Lookup && replayResult(s, budget, res))
+        return {res, m.cycles, m.inst_addr};
+    if (s.stale_engine) {
+        s.stale_engine = false;
+        resetEngine(s);
+    }
+    SampleState* samples = s.samples.get();
+    if (samples && !samples->timer.start(s.options.sample_interval)) {
+        samples->timer_ok = false;
+        samples = nullptr;
+    }
+    const bool hw_counters = s.options.hw_counters && s.hw_group.start();
+    const int64_t start_cycles = m.cycles;
+    switch(s.options.engine) {
+    case Engine::Reference:
+        if (s.tower) {
+            res = runSampled(m, samples, budget, deadline, [&s](Machine& m, int64_t budget) {
+                return runTowerProfile(m, *s.tower, budget);
+            });
+            break;
+        }
+        res = runSampled(m, samples, budget, deadline, s.run_reference);
+        break;
+    case Engine::Threaded:
+        res = runSampled(m, samples, budget, deadline, [](Machine& m, int64_t budget) { return ::run(m, budget); });
+        break;
+    case Engine::Decoded:
+        res = runSampled(m, samples, budget, deadline, [&s](Machine& m, int64_t budget) { return runDecoded(m, s.code, budget); });
+        break;
+    case Engine::Fused:
+        res = runSampled(m, samples, budget, deadline, [&s](Machine& m, int64_t budget) {
+            if (!s.profile_left)
+                return runDecoded(m, s.code, budget);
+            // pick superinstructions from the profile of the first instructions
+            const int32_t count = static_cast<int32_t>(std::min<int64_t>(budget, s.profile_left));
+            const Result res = profileFusions(s.profile, m, count);
+            s.profile_left = res == Result::Continue ? s.profile_left - count : 0;
+            if (!s.profile_left)
+                selectFusions(s.code, s.profile, FusionMinShare);
+            return res;
+        });
+        break;
+    case Engine::Jit:
+        res = runSampled(m, samples, budget, deadline, [&s](Machine& m, int64_t budget) { return runJit(m, s.jit, budget); });
+        break;
+    case Engine::Tiered:
+        res = runSampled(m, samples, budget, deadline, [&s](Machine& m, int64_t budget) { return runTiered(m, s.tiered, budget); });
+        break;
+    }
+    if (hw_counters) {
+        s.hw_group.stop(s.hw);
+        s.hw_cycles += static_cast<uint64_t>(m.cycles - start_cycles);
+        s.hw_ok = true;
+    }
+    if (samples) {
+        samples->timer.stop();
+        drainSamples(*samples);
+    }
+    if (s.cache == ResultCacheState::Recording && res != Result::Yield)
+        saveResult(s, res);
+    return {res, m.cycles, m.inst_addr};
+}
+
+// with the result file of the run from reset when it has one which ends
+// within budget; otherwise output is recorded to write one
+bool Vm::replayResult(State& s, uint64_t budget, Result& res)
+{
+    Machine& m = s.m;
+    const std::vector<Op>& ops = s.program->ops;
+    const ResultFileKey key = getResultKey(m, ops, s.options, s.counted_cycles);
+    s.cache = ResultCacheState::Off;
+    s.result_path = getResultPath(s.options.result_cache, key, ops);
+    ResultEntry entry;
+    if (readResultFile(s.result_path.c_str(), entry) && isResultOf(entry, key, ops)) {
+        if (static_cast<uint64_t>(entry.cycles - m.cycles) >= budget)
+            return false;
+        restoreResult(m, entry);
+        // engine caches are of the code as reset, a later run() redoes them
+        s.stale_engine = true;
+        res = static_cast<Result>(entry.result);
+        return true;
+    }
+    s.cache = ResultCacheState::Recording;
+    s.recording.target = m.output;
+    s.recording.output.clear();
+    m.output = &s.recording;
+    return false;
+}
+
+void Vm::saveResult(State& s, Result res)
+{
+    Machine& m = s.m;
+    m.output = s.recording.target;
+    s.cache = ResultCacheState::Off;
+    ResultEntry entry;
+    entry.ops = s.program->ops;
+    entry.key = getResultKey(m, entry.ops, s.options, s.counted_cycles);
+    entry.result = static_cast<int32_t>(res);
+    entry.inst_addr = m.inst_addr;
+    entry.cycles = m.cycles;
+    entry.last_dbgext_cycles = m.last_dbgext_cycles;
+    entry.output.swap(s.recording.output);
+    getChangedWords(m, entry.ops, entry);
+    // renamed into place, so other processes never read a partial file;
+    // the name is unique to the process and thread writing it
+    const std::string temp_path = s.result_path + "." + std::to_string(getProcessId()) + "." + std::to_string(
+        std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    if (writeResultFile(temp_path.c_str(), entry))
+        std::rename(temp_path.c_str(), s.result_path.c_str());
+    else
+        std::remove(temp_path.c_str());
+}
+
+void Vm::setOutput(OutputSink* output)
+{
+    State& s = *state;
+    OutputSink* sink = output ? output : getStdoutSink();
+    if (s.cache == ResultCacheState::Recording)
+        s.recording.target = sink;
+    else
+        s.m.output = sink;
+}
+
+const VmOptions& Vm::options() const
+{
+    return state->options;
+}
+
+const Machine& Vm::machine() const
+{
+    return state->m;
+}
+
+Machine& Vm::machine()
+{
+    return state->m;
+}
+
+bool Vm::nativeCode() const
+{
+    switch(state->options.engine) {
+    case Engine::Jit: return state->jit.arena != nullptr;
+    case Engine::Tiered: return state->tiered.jit.arena != nullptr;
+    default: return false;
+    }
+}
+
+void Vm::printStats(std::ostream& os) const
+{
+    const State& s = *state;
+    switch(s.options.engine) {
+    case Engine::Reference:
+        os << "policy: " << (s.guarded_data ? "guarded" : s.checked_addr ? "checked" : "unchecked") << " addressing, "
+           << (s.counted_cycles ? "counted" : "uncounted") << " cycles, dbg " << (s.dbg ? "on" : "off")
+           << ", trace " << (s.options.policy.trace ? "on" : "off")
+           << ", profile " << (s.options.policy.profile ? "on" : "off")
+           << ", tower profile " << (s.tower ? "on" : "off") << std::endl;
+        break;
+    case Engine::Fused:
+        dumpFusions(s.code, s.profile, os);
+        break;
+    case Engine::Jit:
+        os << "jit blocks translated " << s.jit.translated << ", invalidated " << s.jit.invalidated_blocks
+           << ", arena flushes " << s.jit.flushes << ", arena used " << s.jit.arena_used << " bytes" << std::endl;
+        break;
+    case Engine::Tiered:
+        dumpTieredStats(s.tiered, os);
+        break;
+    case Engine::Threaded:
+    case Engine::Decoded:
+        break;
+    }
+}
+
+const ExecProfile* Vm::profile() const
+{
+    return state->m.profile;
+}
+
+bool Vm::writeSamples(std::ostream& os) const
+{
+    const State& s = *state;
+    if (!s.samples || !s.samples->timer_ok || !s.program)
+        return false;
+    // frames are the nearest labels, outermost level first
+    std::vector<std::pair<std::string, uint64_t>> stacks;
+    for(const auto& p : s.samples->stacks) {
+        uint32_t program_levels;
+        memcpy(&program_levels, p.first.data(), sizeof(program_levels));
+        const size_t depth = (p.first.size() - sizeof(program_levels)) / sizeof(int32_t);
+        std::string folded;
+        for(size_t i = 0; i < depth; ++i) {
+            int32_t index;
+            memcpy(&index, p.first.data() + sizeof(program_levels) + i * sizeof(int32_t), sizeof(index));
+            if (i)
+                folded += ';';
+            const ProfileSite site = (program_levels >> i) & 1 ?
+                getProfileSite(*s.program, static_cast<size_t>(index)) : ProfileSite{nullptr, 0, nullptr, 0};
+            if (site.label)
+                folded += *site.label;
+            else if (index < 0)
+                folded += "[outside]";
+            else
+                folded += "[" + std::to_string(index) + "]";
+        }
+        stacks.emplace_back(std::move(folded), p.second);
+    }
+    std::sort(stacks.begin(), stacks.end());
+    for(size_t i = 0; i < stacks.size(); ++i) {
+        // stacks differing in instructions only, not labels, are merged
+        uint64_t count = stacks[i].second;
+        while(i + 1 < stacks.size() && stacks[i + 1].first == stacks[i].first)
+            count += stacks[++i].second;
+        os << stacks[i].first << " " << count << std::endl;
+    }
+    if (s.samples->ring.dropped())
+        os << "[dropped] " << s.samples->ring.dropped() << std::endl;
+    return true;
+}
+
+bool Vm::printTowerProfile(std::ostream& os) const
+{
+    if (!state->tower)
+        return false;
+    dumpTowerProfile(*state->tower, os);
+    return true;
+}
+
+const HwCounts* Vm::hwCounters() const
+{
+    return state->hw_ok ? &state->hw : nullptr;
+}
+
+bool Vm::printHwCounters(std::ostream& os) const
+{
+    const State& s = *state;
+    if (!s.hw_ok)
+        return false;
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os.setf(std::ios::fixed, std::ios::floatfield);
+    os.precision(3);
+    os << "hw counters (" << getEngineName(s.options.engine) << " engine, " << s.hw_cycles
+       << " instructions):" << std::endl;
+    for(uint32_t i = 0; i < HwCounterCount; ++i) {
+        os << "  " << getHwCounterName(static_cast<HwCounter>(i));
+        if (s.hw.available[i])
+            os << " " << s.hw.value[i] << ", " << (s.hw_cycles ? static_cast<double>(s.hw.value[i]) / s.hw_cycles : 0.0)
+               << " per instruction";
+        else
+            os << " not available";
+        os << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+    return true;
+}
+
+/*
+* Batches
+*/
+
+// job indices of a worker: it takes from the back, thieves from the front
+struct WorkQueue
+{
+    std::mutex mutex;
+    std::deque<size_t> items;
+};
+
+bool takeWork(WorkQueue& queue, bool steal, size_t& item)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.items.empty())
+        return false;
+    if (steal) {
+        item = queue.items.front();
+        queue.items.pop_front();
+    } else {
+        item = queue.items.back();
+        queue.items.pop_back();
+    }
+    return true;
+}
+
+// the calling thread on the index-th CPU of the allowed ones, modulo their count
+void pinThread(uint32_t index)
+{
+#if VM_PIN_THREADS
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || !CPU_COUNT(&allowed))
+        return;
+    int skip = static_cast<int>(index % static_cast<uint32_t>(CPU_COUNT(&allowed)));
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+#else
+    static_cast<void>(index);
+#endif
+}
+
+// calls fn(worker, item) for every item below count on the workers, items
+// dealt out in contiguous runs and stolen one at a time when a worker runs out
+void runOnWorkers(size_t count, uint32_t workers, bool pin, const std::function<void(uint32_t, size_t)>& fn)
+{
+    std::vector<WorkQueue> queues(workers);
+    for(uint32_t w = 0; w < workers; ++w) {
+        // backwards, so the owner takes its run in order
+        for(size_t i = count * (w + 1) / workers; i-- > count * w / workers;)
+            queues[w].items.push_back(i);
+    }
+    auto work = [&](uint32_t w) {
+        if (pin)
+            pinThread(w);
+        size_t item;
+        while(true) {
+            bool found = takeWork(queues[w], false, item);
+            for(uint32_t k = 1; k < workers && !found; ++k)
+                found = takeWork(queues[(w + k) % workers], true, item);
+            // nothing is added, so empty queues stay empty
+            if (!found)
+                return;
+            fn(w, item);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(uint32_t w = 0; w < workers; ++w)
+        threads.emplace_back(work, w);
+    for(auto& thread : threads)
+        thread.join();
+}
+
+std::vector<BatchResult> runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options)
+{
+    std::vector<BatchResult> results(jobs.size());
+    uint32_t workers = options.threads ? options.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    workers = static_cast<uint32_t>(std::min<size_t>(workers, std::max<size_t>(jobs.size(), 1)));
+
+    // every distinct program once
+    std::map<std::pair<std::string, std::vector<std::pair<std::string, int32_t>>>, size_t> program_index;
+    std::vector<size_t> job_program(jobs.size());
+    std::vector<const BatchJob*> program_jobs;
+    for(size_t i = 0; i < jobs.size(); ++i) {
+        auto it = program_index.emplace(std::make_pair(jobs[i].path, jobs[i].defs), program_jobs.size()).first;
+        if (it->second == program_jobs.size())
+            program_jobs.push_back(&jobs[i]);
+        job_program[i] = it->second;
+    }
+    std::vector<ProgramRef> programs(program_jobs.size());
+    std::vector<CompileError> errors(program_jobs.size());
+    runOnWorkers(programs.size(), workers, options.pin_threads, [&](uint32_t, size_t p) {
+        programs[p] = compileProgram(program_jobs[p]->path.c_str(), errors[p], program_jobs[p]->defs);
+    });
+
+    std::vector<std::unique_ptr<Vm>> vms(workers);
+    runOnWorkers(jobs.size(), workers, options.pin_threads, [&](uint32_t w, size_t i) {
+        BatchResult& result = results[i];
+        result.run = {Result::Continue, 0, 0};
+        const size_t p = job_program[i];
+        if (!programs[p]) {
+            result.error = describeCompileError(errors[p]);
+            return;
+        }
+        if (!vms[w])
+            vms[w].reset(new Vm(options.vm));
+        Vm& vm = *vms[w];
+        if (!vm.reset(programs[p])) {
+            result.error = "program doesn't fit the code space, or memory exceeds int32 addresses";
+            return;
+        }
+        std::ostringstream output;
+        StreamSink sink(output);
+        vm.setOutput(&sink);
+        result.run = vm.run();
+        vm.setOutput(nullptr);
+        result.output = output.str();
+    });
+    return results;
+}
+
+/*
+* Sweeps
+*/
+
+// index of a data address in a machine's memory, false if outside of it
+bool getWordIndex(int32_t addr, int32_t data_offset, int32_t mem_size, uint32_t& index)
+{
+    index = static_cast<uint32_t>(static_cast<int64_t>(addr) + data_offset);
+    return static_cast<int64_t>(addr) + data_offset >= 0 && static_cast<int64_t>(addr) + data_offset < mem_size;
+}
+
+std::vector<BatchResult> runSweep(const ProgramRef& program, const std::vector<SweepWords>& words,
+    const SweepOptions& options)
+{
+    std::vector<BatchResult> results(words.size());
+    std::vector<std::ostringstream> outputs(words.size());
+    const uint32_t max_lanes = getLockstepLanes();
+    // fewer lanes than 16 run no faster than machine by machine on the JIT
+    uint32_t lanes = options.lanes ? options.lanes : max_lanes >= 16 ? max_lanes : 1;
+    // the widest engine not wider than asked
+    while(lanes > 4 && (lanes > max_lanes || (lanes & (lanes - 1))))
+        lanes = lanes > 8 ? 8 : 4;
+    LockstepMachine lm;
+    const bool lockstep = lanes >= 4 && lanes <= max_lanes && program &&
+        resetLockstep(lm, lanes, program->ops, options.vm);
+    std::vector<std::unique_ptr<StreamSink>> sinks;
+    for(size_t i = 0; i < words.size(); ++i)
+        sinks.emplace_back(new StreamSink(outputs[i]));
+    auto setWords = [&](size_t i, int32_t data_offset, int32_t mem_size, const std::function<int32_t&(uint32_t)>& word) {
+        for(const auto& w : words[i]) {
+            uint32_t index;
+            if (!getWordIndex(w.first, data_offset, mem_size, index)) {
+                results[i].error = "word " + std::to_string(w.first) + " outside of memory";
+                return false;
+            }
+            word(index) = w.second;
+        }
+        return true;
+    };
+
+    if (lockstep) {
+        for(size_t first = 0; first < words.size(); first += lanes) {
+            const uint32_t count = static_cast<uint32_t>(std::min<size_t>(lanes, words.size() - first));
+            if (first)
+                resetLockstep(lm, lanes, program->ops, options.vm);
+            for(uint32_t l = 0; l < count; ++l) {
+                const bool ok = setWords(first + l, lm.data_offset, lm.mem_size, [&](uint32_t index) -> int32_t& {
+                    lm.uniform_code &= index >= static_cast<uint32_t>(lm.data_offset);
+                    return lm.mem[index * lanes + l];
+                });
+                if (ok)
+                    startLane(lm, l, sinks[first + l].get());
+            }
+            runLockstep(lm);
+            for(uint32_t l = 0; l < count; ++l) {
+                BatchResult& result = results[first + l];
+                result.run = {lm.result[l], lm.cycles[l], lm.inst_addr[l]};
+                result.output = outputs[first + l].str();
+            }
+        }
+        return results;
+    }
+
+    // words in the program patch its instructions before reset(), which
+    // picks the reference engine variant for them; data words are set
+    // after it, which the result cache wouldn't see
+    VmOptions vm_options = options.vm;
+    vm_options.result_cache.clear();
+    Vm vm(vm_options);
+    int32_t data_offset = 0, mem_size = 0;
+    const bool fits = program && getMachineLayout(program->ops.size(), options.vm.layout, data_offset, mem_size);
+    const uint32_t code_begin = static_cast<uint32_t>(data_offset) - static_cast<uint32_t>(fits ? program->ops.size() * InstSize : 0);
+    for(size_t i = 0; i < words.size(); ++i) {
+        BatchResult& result = results[i];
+        result.run = {Result::Continue, 0, 0};
+        std::vector<Op> ops;
+        for(const auto& w : words[i]) {
+            uint32_t index;
+            if (fits && getWordIndex(w.first, data_offset, mem_size, index) && index >= code_begin &&
+                index < static_cast<uint32_t>(data_offset)) {
+                if (ops.empty())
+                    ops = program->ops;
+                // opcode, arg1, arg2 from the top of the instruction down
+                const uint32_t word = static_cast<uint32_t>(data_offset) - index - 1;
+                Op& op = ops[word / InstSize];
+                if (word % InstSize == 0)
+                    op.code = static_cast<OpCode>(w.second);
+                else if (word % InstSize == 1)
+                    op.arg1 = w.second;
+                else
+                    op.arg2 = w.second;
+            }
+        }
+        if (!vm.reset(ops.empty() ? program : makeProgram(std::move(ops)))) {
+            result.error = "program doesn't fit the code space, or memory exceeds int32 addresses";
+            continue;
+        }
+        Machine& m = vm.machine();
+        if (!setWords(i, m.data_offset, m.mem_size, [&](uint32_t index) -> int32_t& { return m.mem[index]; }))
+            continue;
+        vm.setOutput(sinks[i].get());
+        result.run = vm.run();
+        vm.setOutput(nullptr);
+        result.output = outputs[i].str();
+    }
+    return results;
+}
@@ -0,0 +1,250 @@
+// Embeddable VM library
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "vm.h"
+#include "vm-asm.h"
+#include "vm-memory.h"
+#include "vm-machine.h"
+#include "vm-perf.h"
+
+/*
+* libselfvm
+*
+* compileProgram() assembles a code file once into an immutable Program,
+* which any number of machines can share, also across threads. It loads
+* bytecode files (vm-bytecode.h) written by saveProgram() as they are. A Vm owns
+* one machine and the state of its engine: reset() loads a program into
+* fresh memory, run() runs it for a budget of cycles and an optional
+* deadline and can be called again after Result::Yield to resume it.
+* dbg and dbgext output goes to the OutputSink set on the Vm (stdout by
+* default). Vm objects share nothing, so every thread can run its own.
+*
+* A run depends on nothing but the program and the machine parameters,
+* so with VmOptions::result_cache every run from reset() to its end is
+* kept in a result file keyed by them, and the first run() after a reset()
+* to the same program and parameters replays it: the result, cycles, dbg
+* and dbgext output and the memory come back without running anything.
+* Words a client writes through machine() before that run aren't part of
+* the key, clients doing so leave result_cache empty.
+*/
+
+struct Program
+{
+    std::vector<Op> ops;
+    DebugInfo debug; // empty for makeProgram()
+};
+
+typedef std::shared_ptr<const Program> ProgramRef;
+
+// nullptr on failure, with error pointing at the offending line or the
+// file that wasn't found (describeCompileError() in vm-asm.h)
+ProgramRef compileProgram(const char* code_file_path, CompileError& error,
+    const std::vector<std::pair<std::string, int32_t>>& defs = {});
+
+ProgramRef makeProgram(std::vector<Op> ops);
+
+// writes the program as a bytecode file
+bool saveProgram(const Program& program, const char* path);
+
+// hot spots of an execution profile: executions per opcode and the top
+// instructions with their source line, label and conditional jump counts
+void dumpProfile(const ExecProfile& profile, const Program& program, std::ostream& os, size_t top = 20);
+// the same for every executed instruction as a JSON object
+void writeProfileJson(const ExecProfile& profile, const Program& program, std::ostream& os);
+
+enum class Engine
+{
+    Tiered,
+    Reference,
+    Threaded,
+    Decoded,
+    Fused,
+    Jit
+};
+
+// false for unknown names
+bool parseEngine(const std::string& name, Engine& engine);
+const char* getEngineName(Engine engine);
+
+// reference engine options
+struct PolicyOptions
+{
+    bool unchecked;   // program verified offline: no addressing checks
+    bool uncounted;   // no cycle counting and no cycle limit
+    bool no_dbg;      // suppress dbg and dbgext output
+    bool trace;
+    bool profile;     // count executions into Vm::profile()
+    bool tower;       // attribute cycles to levels of the interpreter tower
+};
+
+enum class CollapseCycles
+{
+    Emulated, // base cycles of the interpreter loops
+    Executed // one per collapsed instruction
+};
+
+struct VmOptions
+{
+    Engine engine = Engine::Tiered;
+    MemoryBackend memory = DefaultMemoryBackend;
+    HugePages huge_pages = HugePages::Transparent;
+    MachineLayout layout = DefaultLayout;
+    int64_t max_cycles = DefaultMaxCycles;
+    PolicyOptions policy = {false, false, false, false, false, false};
+    int32_t fusion_profile_cycles = 1000000;
+    uint32_t jit_threshold = 16;
+    uint32_t tier_decoded = 16;
+    uint32_t tier_native = 1000;
+    bool collapse = false;
+    CollapseCycles collapse_cycles = CollapseCycles::Emulated;
+    uint32_t sample_interval = 0; // microseconds of thread CPU time between samples, 0 for none
+    bool hw_counters = false; // count hardware events of run() (vm-perf.h)
+    // directory of the result cache, empty for none: runs from reset() are
+    // replayed from it when the same program ran to its end before (off
+    // with trace, profile, tower, sample_interval and hw_counters)
+    std::string result_cache;
+};
+
+struct RunResult
+{
+    Result result; // Result::Yield when run() can resume the machine
+    int64_t cycles; // machine cycles since reset()
+    int32_t inst_addr; // next instruction, or the failing one
+};
+
+class Vm
+{
+public:
+    explicit Vm(const VmOptions& options = VmOptions());
+    ~Vm();
+    Vm(const Vm&) = delete;
+    Vm& operator=(const Vm&) = delete;
+
+    // false if the program doesn't fit the layout or memory exceeds int32 addresses
+    bool reset(const ProgramRef& program);
+    // continues from a copy of source's machine (fork() in vm-machine.h)
+    // with its program, false if source has none; e.g. for many runs from a
+    // machine prepared once, differing in a few words set after the fork.
+    // Several threads may fork one source at once (MachineMemory::fork()
+    // locks it), but it must not run or be reset meanwhile.
+    bool fork(const Vm& source);
+    // runs up to budget cycles until the deadline, the program must be reset first
+    RunResult run(uint64_t budget = UINT64_MAX, RunDeadline deadline = NoDeadline);
+
+    void setOutput(OutputSink* output);
+    const VmOptions& options() const;
+    const Machine& machine() const;
+    Machine& machine();
+    // false when the JIT engine runs the decoded engine instead
+    bool nativeCode() const;
+
+    // engine statistics in the text format of vm: the reference policy,
+    // selected superinstructions, JIT translation or tier counts
+    void printStats(std::ostream& os) const;
+    // instruction counts of the reference engine run with policy.profile,
+    // nullptr otherwise
+    const ExecProfile* profile() const;
+    // samples taken with sample_interval as folded stacks for flame graph
+    // tools, false when sampling is off or not available
+    bool writeSamples(std::ostream& os) const;
+    // base cycles of every opcode at every level of the interpreter tower
+    // by interpreter phase, false unless run with policy.tower
+    bool printTowerProfile(std::ostream& os) const;
+    // hardware counters of the run() calls since reset(), nullptr when
+    // hw_counters is off or no counter is available
+    const HwCounts* hwCounters() const;
+    // the same per machine instruction, false when there are none
+    bool printHwCounters(std::ostream& os) const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+
+    static void resetEngine(State& s);
+    static bool replayResult(State& s, uint64_t budget, Result& res);
+    static void saveResult(State& s, Result res);
+};
+
+/*
+* Batches
+*
+* runBatch() runs independent jobs, each a program run from reset to its
+* end, on a pool of worker threads which take jobs from their own queue
+* and steal from the others when it's empty. Jobs with the same file and
+* defs share one compiled Program (included files share their units, see
+* vm-asm.h), and every worker reuses one Vm, so its memory and engine
+* caches, for all the jobs it runs. Results and output come back in the
+* order of the jobs, whatever ran where.
+*/
+
+struct BatchJob
+{
+    std::string path; // code or bytecode file
+    std::vector<std::pair<std::string, int32_t>> defs; // as for compileProgram()
+};
+
+struct BatchResult
+{
+    std::string error; // compile or load error, the job didn't run unless empty
+    RunResult run;
+    std::string output; // dbg and dbgext output in the format of vm
+};
+
+struct BatchOptions
+{
+    VmOptions vm; // for every job
+    uint32_t threads = 0; // 0 for one per hardware thread
+    bool pin_threads = false; // worker i on the i-th CPU the process may use (Linux)
+};
+
+std::vector<BatchResult> runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options);
+
+/*
+* Sweeps
+*
+* runSweep() runs one program on many machines which differ only in data
+* words set after reset() (e.g. a parameter, or an argument of an
+* instruction, at its negative address). With lanes other than 1 the
+* machines run in lock-step (vm-lockstep-engine.h), as many at once as
+* the vector unit has int32 lanes: 16 with AVX-512, 8 with AVX2, 4
+* otherwise (SSE2 or plain vector code); with lanes 1, or where lock-step
+* isn't available, one after another on the engine of the options. Only
+* 16 lanes beat the JIT, so lanes 0 runs lock-step just with AVX-512.
+*/
+
+typedef std::vector<std::pair<int32_t, int32_t>> SweepWords; // data address, value
+
+struct SweepOptions
+{
+    VmOptions vm; // layout, memory and cycle limit, engine for lanes 1
+    uint32_t lanes = 0; // machines per lock-step run, 0 for 16 with AVX-512, else 1
+};
+
+// int32 lanes of the lock-step engine on this processor, 0 if not built
+uint32_t getLockstepLanes();
+
+// results in the order of words; a machine with a word outside of its
+// memory doesn't run
+std::vector<BatchResult> runSweep(const ProgramRef& program, const std::vector<SweepWords>& words,
+    const SweepOptions& options);
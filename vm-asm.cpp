@@ -0,0 +1,1009 @@
+// Assembler of VM code
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <assert.h>
+
+#include "vm.h"
+#include "vm-asm.h"
+#include "vm-bytecode.h"
+
+struct ParsePos
+{
+    const char* code_text;
+    uint32_t code_size;
+    uint32_t index;
+    uint32_t line;
+};
+
+// token of the code text, pointing into it
+struct TextView
+{
+    const char* text;
+    uint32_t size;
+};
+
+inline bool operator==(const TextView& a, const TextView& b)
+{
+    return a.size == b.size && memcmp(a.text, b.text, a.size) == 0;
+}
+
+TextView toView(const std::string& s)
+{
+    return {s.data(), static_cast<uint32_t>(s.size())};
+}
+
+void skipWhiteSpace(ParsePos& pos)
+{
+    const uint32_t code_size = pos.code_size;
+    for(;pos.index < code_size; ++pos.index) {
+        char ch = pos.code_text[pos.index];
+        if (static_cast<unsigned char>(ch) > 32)
+            break;
+        if (ch == '\n')
+            ++pos.line;
+    }
+}
+
+uint32_t hashName(const TextView& name)
+{
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < name.size; ++i) {
+        hash ^= static_cast<unsigned char>(name.text[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// next token and its hashName()
+bool parseToken(TextView& ret, uint32_t& hash, ParsePos& pos)
+{
+    skipWhiteSpace(pos);
+    const char* code_text = pos.code_text;
+    const uint32_t code_size = pos.code_size;
+    const uint32_t begin = pos.index;
+    uint32_t index = begin;
+    uint32_t h = 2166136261u;
+    for(; index < code_size; ++index) {
+        const auto ch = static_cast<unsigned char>(code_text[index]);
+        if (ch <= 32)
+            break;
+        h = (h ^ ch) * 16777619u;
+    }
+    pos.index = index;
+    ret = {code_text + begin, index - begin};
+    hash = h;
+    return ret.size > 0;
+}
+
+bool parseToken(TextView& ret, ParsePos& pos)
+{
+    uint32_t hash;
+    return parseToken(ret, hash, pos);
+}
+
+bool parseString(std::string& ret, ParsePos& pos)
+{
+    TextView token;
+    const bool found = parseToken(token, pos);
+    ret.assign(token.text, token.size);
+    return found;
+}
+
+void skipLine(ParsePos& pos)
+{
+    const uint32_t code_size = pos.code_size;
+    for(;pos.index < code_size; ++pos.index) {
+        char ch = pos.code_text[pos.index];
+        if (ch == '\n' || ch == '\r')
+            break;
+    }
+    for(;pos.index < code_size; ++pos.index) {
+        char ch = pos.code_text[pos.index];
+        if (ch != '\n' && ch != '\r')
+            break;
+        if (ch == '\n')
+            ++pos.line;
+    }
+}
+
+bool isInteger(const TextView& arg)
+{
+    if (!arg.size)
+        return false;
+    uint32_t index = (arg.text[0] == '-') ? 1 : 0;
+    for(; index < arg.size; ++index) {
+        char ch = arg.text[index];
+        if (ch < '0' || ch > '9')
+            return false;
+    }
+    return true;
+}
+
+// value as std::atoi() gives it
+int32_t parseInteger(const TextView& arg)
+{
+    // up to 9 digits can't overflow
+    if (isInteger(arg) && arg.size <= 9) {
+        const bool negative = arg.text[0] == '-';
+        int32_t value = 0;
+        for(uint32_t index = negative ? 1 : 0; index < arg.size; ++index)
+            value = value * 10 + (arg.text[index] - '0');
+        return negative ? -value : value;
+    }
+    char buf[32];
+    if (arg.size < sizeof(buf)) {
+        memcpy(buf, arg.text, arg.size);
+        buf[arg.size] = 0;
+        return static_cast<int32_t>(std::atoi(buf));
+    }
+    return static_cast<int32_t>(std::atoi(std::string(arg.text, arg.size).c_str()));
+}
+
+/*
+* Symbols
+*
+* Every name is interned once into an open addressing table, later
+* occurrences find it by hash without allocating. A symbol has separate opcode, label
+* and const meanings, like the separate maps it replaces.
+*/
+
+constexpr uint32_t NoSymbol = UINT32_MAX;
+
+struct AsmSymbol
+{
+    uint32_t name_offset;
+    uint32_t name_size;
+    int32_t opcode; // -1 if not an opcode
+    bool has_label;
+    bool has_const;
+    bool is_integer;
+    bool predefined; // const given by the caller, defs of the text leave it
+    int32_t label; // instruction offset
+    int32_t value; // const value
+    int32_t integer; // value of an integer name
+};
+
+class SymbolTable
+{
+public:
+    std::vector<AsmSymbol> symbols;
+
+    AsmSymbol& operator[](uint32_t id) { return symbols[id]; }
+    const AsmSymbol& operator[](uint32_t id) const { return symbols[id]; }
+
+    TextView name(uint32_t id) const
+    {
+        return {names.data() + symbols[id].name_offset, symbols[id].name_size};
+    }
+
+    uint32_t find(const TextView& name) const
+    {
+        return find(name, hashName(name));
+    }
+
+    uint32_t find(const TextView& name, uint32_t hash) const
+    {
+        if (slots.empty())
+            return NoSymbol;
+        const uint32_t mask = static_cast<uint32_t>(slots.size() - 1);
+        for(uint32_t i = hash & mask;; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (slot.id == NoSymbol)
+                return NoSymbol;
+            if (slot.hash == hash && this->name(slot.id) == name)
+                return slot.id;
+        }
+    }
+
+    uint32_t intern(const TextView& name)
+    {
+        return intern(name, hashName(name));
+    }
+
+    uint32_t intern(const TextView& name, uint32_t hash)
+    {
+        if ((symbols.size() + 1) * 2 > slots.size())
+            grow();
+        const uint32_t mask = static_cast<uint32_t>(slots.size() - 1);
+        uint32_t i = hash & mask;
+        for(;; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (slot.id == NoSymbol)
+                break;
+            if (slot.hash == hash && this->name(slot.id) == name)
+                return slot.id;
+        }
+        const bool is_integer = isInteger(name);
+        const uint32_t id = static_cast<uint32_t>(symbols.size());
+        slots[i] = {hash, id};
+        symbols.push_back({static_cast<uint32_t>(names.size()), name.size, -1, false, false, is_integer,
+            false, 0, 0, is_integer ? parseInteger(name) : 0});
+        names.insert(names.end(), name.text, name.text + name.size);
+        return id;
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t id;
+    };
+    // names are copied together, so looking them up stays in cache
+    std::vector<char> names;
+    std::vector<Slot> slots;
+
+    void grow()
+    {
+        std::vector<Slot> old(std::max<size_t>(slots.size() * 2, 256), Slot{0, NoSymbol});
+        old.swap(slots);
+        const uint32_t mask = static_cast<uint32_t>(slots.size() - 1);
+        for(const Slot& slot : old) {
+            if (slot.id == NoSymbol)
+                continue;
+            uint32_t i = slot.hash & mask;
+            while(slots[i].id != NoSymbol)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+struct Symbols
+{
+    SymbolTable table;
+    int32_t last_const;
+};
+
+// "$" + opcode names, for the lifetime of the process
+const std::vector<std::string>& getOpcodeConstNames()
+{
+    static const std::vector<std::string> names = []() {
+        std::vector<std::string> ret;
+        for(const auto& p : opcode_def)
+            ret.push_back("$" + p.first);
+        return ret;
+    }();
+    return names;
+}
+
+void initSymbols(Symbols& sym)
+{
+    const auto& const_names = getOpcodeConstNames();
+    int32_t prev = -1;
+    for(size_t i = 0; i < opcode_def.size(); ++i) {
+        const auto& p = opcode_def[i];
+        assert(static_cast<int32_t>(p.second) > prev);
+        prev = static_cast<int32_t>(p.second);
+        static_cast<void>(prev); // only asserted
+        sym.table[sym.table.intern(toView(p.first))].opcode = static_cast<int32_t>(p.second);
+        AsmSymbol& c = sym.table[sym.table.intern(toView(const_names[i]))];
+        c.has_const = true;
+        c.value = static_cast<int32_t>(p.second);
+    }
+    sym.last_const = -1;
+}
+
+void defineConst(Symbols& sym, const TextView& name, int32_t value)
+{
+    AsmSymbol& s = sym.table[sym.table.intern(name)];
+    s.has_const = true;
+    s.value = value;
+}
+
+// def or enum of the text, returns the value the const has: a predefined
+// one keeps its own
+int32_t defineTextConst(Symbols& sym, const TextView& name, int32_t value)
+{
+    AsmSymbol& s = sym.table[sym.table.intern(name)];
+    if (!s.predefined) {
+        s.has_const = true;
+        s.value = value;
+    }
+    return s.value;
+}
+
+// unit linked at a position of the merged code text
+struct UnitRef
+{
+    uint32_t index; // text index of the line following the include
+    const AsmUnit* unit;
+    int32_t inst_offs; // set by compile()
+};
+
+// Reference to a symbol back-patched when the text is compiled: the value
+// is added to the argument, so lia can take a label and a const.
+struct AsmPatch
+{
+    uint32_t inst;
+    FixupKind kind;
+    uint32_t symbol;
+    uint32_t line; // of the text
+    bool in_unit;
+};
+
+inline bool isLabelFixup(FixupKind kind)
+{
+    return kind == FixupKind::Label1 || kind == FixupKind::Label2;
+}
+
+// defines the unit's symbols like its text would and appends its
+// instructions, leaving its fixups to be patched
+bool linkUnit(std::vector<Op>& ret_ops, std::vector<uint32_t>& ret_lines, Symbols& sym,
+    std::vector<AsmPatch>& patches, UnitRef& ref)
+{
+    const AsmUnit& unit = *ref.unit;
+    ref.inst_offs = static_cast<int32_t>(ret_ops.size()) * InstSize;
+    for(const auto& l : unit.labels) {
+        AsmSymbol& s = sym.table[sym.table.intern(toView(l.first))];
+        if (s.has_label)
+            return false;
+        s.has_label = true;
+        s.label = ref.inst_offs + l.second * InstSize;
+    }
+    for(const auto& c : unit.consts) {
+        // the unit's code is compiled with its own value, the text can
+        // take the predefined one
+        AsmSymbol& s = sym.table[sym.table.intern(toView(c.first))];
+        if (s.predefined && s.value != c.second)
+            return false;
+        defineConst(sym, toView(c.first), c.second);
+    }
+    if (unit.sets_last_const)
+        sym.last_const = unit.last_const;
+    const uint32_t first = static_cast<uint32_t>(ret_ops.size());
+    ret_ops.insert(ret_ops.end(), unit.ops.begin(), unit.ops.end());
+    ret_lines.resize(ret_ops.size(), 0);
+    for(const auto& f : unit.fixups)
+        patches.push_back({first + f.inst, f.kind, sym.table.intern(toView(unit.names[f.name])), 0, true});
+    return true;
+}
+
+// Compiles merged code text in one pass with units linked at their
+// positions: names are interned as they come and resolved by patching once
+// the text ends, as consts can be used before their (last) definition and
+// labels before they're defined. Integer arguments are taken as they are
+// unless intern_integers is set, for text giving integer names to symbols,
+// which is reported back by integer_names. ret_lines gets the merged line of
+// every instruction compiled from text. With unit set, symbols the text
+// doesn't define become its fixups instead of errors. Failing with units
+// linked, the text they stand for may compile, or give the error line.
+bool compilePass(std::vector<Op>& ret_ops, std::vector<uint32_t>& ret_lines, Symbols& sym,
+    const char* code_text, uint32_t code_size, std::vector<UnitRef>& units,
+    AsmUnit* unit, bool intern_integers, bool& integer_names, uint32_t& error_line)
+{
+    static const TextView enum_cmd = {"enum", 4}, def_cmd = {"def", 3};
+    ParsePos pos = {code_text, code_size, 0u, 1u};
+    integer_names = false;
+    bool defined_const = false;
+    int32_t inst_offs = 0;
+    uint32_t unit_index = 0;
+    std::vector<AsmPatch> patches;
+    ret_ops.clear();
+    ret_lines.clear();
+    // a guess, typical lines are longer
+    ret_ops.reserve(code_size / 16);
+    ret_lines.reserve(code_size / 16);
+
+    #define RetError { \
+        error_line = pos.line; \
+        return false; \
+    }
+    #define ParseArg(arg) \
+        if (!parseToken(arg, arg##_hash, pos)) \
+            RetError
+    // integers and labels defined before are added right away, names
+    // when they're known
+    #define AddArg(arg, field, kind) \
+        if (!intern_integers && isInteger(arg)) { \
+            op.field += parseInteger(arg); \
+        } else { \
+            const uint32_t id = sym.table.intern(arg, arg##_hash); \
+            if (isLabelFixup(kind) && sym.table[id].has_label) \
+                op.field += inst_offs - sym.table[id].label; \
+            else \
+                patches.push_back({static_cast<uint32_t>(ret_ops.size()), kind, id, pos.line, false}); \
+        }
+
+    TextView cmd, arg1, arg2, subarg2;
+    uint32_t cmd_hash, arg1_hash, arg2_hash, subarg2_hash;
+    for(;;) {
+        skipWhiteSpace(pos);
+        for(; unit_index < units.size() && units[unit_index].index <= pos.index; ++unit_index) {
+            if (!linkUnit(ret_ops, ret_lines, sym, patches, units[unit_index]))
+                return false;
+            inst_offs = static_cast<int32_t>(ret_ops.size()) * InstSize;
+        }
+        if (!parseToken(cmd, cmd_hash, pos))
+            break;
+        if (cmd.text[0] == '%') {
+            skipLine(pos);
+            continue;
+        }
+        if (cmd.text[cmd.size - 1] == ':') {
+            const TextView name = {cmd.text, cmd.size - 1};
+            AsmSymbol& s = sym.table[sym.table.intern(name)];
+            if (s.has_label)
+                RetError
+            s.has_label = true;
+            s.label = inst_offs;
+            if (unit)
+                unit->labels.push_back({std::string(name.text, name.size), inst_offs / InstSize});
+            continue;
+        }
+        if (cmd == enum_cmd) {
+            ParseArg(arg1)
+            if (unit && !defined_const)
+                RetError
+            sym.last_const = defineTextConst(sym, arg1, sym.last_const + 1);
+            if (unit)
+                unit->consts.push_back({std::string(arg1.text, arg1.size), 0});
+            continue;
+        }
+        if (cmd == def_cmd) {
+            ParseArg(arg1)
+            ParseArg(arg2)
+            sym.last_const = defineTextConst(sym, arg1, parseInteger(arg2));
+            defined_const = true;
+            if (unit)
+                unit->consts.push_back({std::string(arg1.text, arg1.size), 0});
+            continue;
+        }
+        const uint32_t op_line = pos.line;
+        const uint32_t cmd_id = sym.table.find(cmd, cmd_hash);
+        if (cmd_id == NoSymbol || sym.table[cmd_id].opcode < 0)
+            RetError
+        const OpCode opcode = static_cast<OpCode>(sym.table[cmd_id].opcode);
+        Op op = {opcode, 0, 0};
+        switch(opcode) {
+        case OpCode::Nop:
+        case OpCode::Hlt:
+        case OpCode::Dbgext:
+            break;
+        case OpCode::Ja:
+        case OpCode::Dbg:
+            ParseArg(arg1)
+            AddArg(arg1, arg1, FixupKind::Value1)
+            break;
+        case OpCode::Jr:
+        case OpCode::Jnz:
+        case OpCode::Jz:
+        case OpCode::Jg:
+        case OpCode::Jge:
+        case OpCode::Jl:
+        case OpCode::Jle:
+            ParseArg(arg1)
+            AddArg(arg1, arg1, FixupKind::Label1)
+            if (opcode != OpCode::Jr) {
+                ParseArg(arg2)
+                AddArg(arg2, arg2, FixupKind::Value2)
+            }
+            break;
+        case OpCode::Lia:
+            ParseArg(arg1)
+            ParseArg(arg2)
+            ParseArg(subarg2)
+            AddArg(arg1, arg1, FixupKind::Value1)
+            AddArg(arg2, arg2, FixupKind::Label2)
+            AddArg(subarg2, arg2, FixupKind::Value2)
+            break;
+        default:
+            ParseArg(arg1)
+            ParseArg(arg2)
+            AddArg(arg1, arg1, FixupKind::Value1)
+            AddArg(arg2, arg2, FixupKind::Value2)
+            break;
+        }
+        ret_ops.push_back(op);
+        ret_lines.push_back(op_line);
+        inst_offs += InstSize;
+    }
+
+    #undef AddArg
+    #undef ParseArg
+    #undef RetError
+
+    for(const auto& s : sym.table.symbols)
+        integer_names |= s.is_integer && (s.has_label || s.has_const);
+    // units took integers as they are
+    if (integer_names && (!intern_integers || !units.empty()))
+        return false;
+
+    // consts units define must have kept their values (text redefining them
+    // later would have changed uses inside them)
+    for(const auto& ref : units) {
+        for(const auto& c : ref.unit->consts) {
+            if (sym.table[sym.table.find(toView(c.first))].value != c.second)
+                return false;
+        }
+    }
+    for(const auto& p : patches) {
+        const AsmSymbol& s = sym.table[p.symbol];
+        const bool is_label = isLabelFixup(p.kind);
+        int32_t value;
+        if (is_label ? s.has_label : s.has_const) {
+            value = is_label ? static_cast<int32_t>(p.inst) * InstSize - s.label : s.value;
+        } else if (s.is_integer) {
+            value = s.integer;
+        } else if (p.in_unit) {
+            return false;
+        } else if (unit) {
+            // left to where the unit is included
+            const TextView name = sym.table.name(p.symbol);
+            unit->names.push_back(std::string(name.text, name.size));
+            unit->fixups.push_back({p.inst, p.kind, static_cast<uint32_t>(unit->names.size() - 1)});
+            continue;
+        } else {
+            error_line = p.line;
+            return false;
+        }
+        Op& op = ret_ops[p.inst];
+        (p.kind == FixupKind::Value1 || p.kind == FixupKind::Label1 ? op.arg1 : op.arg2) += value;
+    }
+    if (unit) {
+        // final values, as later definitions replace earlier ones
+        for(auto& c : unit->consts)
+            c.second = sym.table[sym.table.find(toView(c.first))].value;
+        unit->sets_last_const = defined_const;
+        unit->last_const = sym.last_const;
+    }
+    return true;
+}
+
+// compilePass() taking integers as they are, unless the text gives
+// integer names to symbols
+bool compile(std::vector<Op>& ret_ops, std::vector<uint32_t>& ret_lines, Symbols& sym,
+    const char* code_text, uint32_t code_size, std::vector<UnitRef>& units,
+    AsmUnit* unit, uint32_t& error_line)
+{
+    const Symbols start = sym;
+    bool integer_names;
+    if (compilePass(ret_ops, ret_lines, sym, code_text, code_size, units, unit, false, integer_names, error_line))
+        return true;
+    if (!integer_names)
+        return false;
+    sym = start;
+    if (unit) {
+        unit->labels.clear();
+        unit->consts.clear();
+        unit->names.clear();
+        unit->fixups.clear();
+    }
+    return compilePass(ret_ops, ret_lines, sym, code_text, code_size, units, unit, true, integer_names, error_line);
+}
+
+void reverseString(std::string& s)
+{
+    for(uint32_t cnt = static_cast<uint32_t>(s.size()), i = ((cnt + 1) >> 1); i > 0; --i)
+        std::swap(s[i - 1], s[cnt - i]);
+}
+
+void stripFile(std::string& s, std::string& file)
+{
+    file.clear();
+    while(!s.empty()) {
+        const auto ch = s.back();
+        if (ch == '\\' || ch == '/')
+            break;
+        file.push_back(ch);
+        s.pop_back();
+    }
+    reverseString(file);
+}
+
+bool readFile(const std::string& path, std::vector<char>& ret)
+{
+    std::ifstream fp;
+    fp.open(path.c_str(), std::ios::binary);
+    if (!fp)
+        return false;
+    fp.seekg(0, fp.end);
+    const auto length = fp.tellg();
+    fp.seekg(0, fp.beg);
+    ret.resize(static_cast<size_t>(length));
+    fp.read(ret.data(), length);
+    return true;
+}
+
+struct LineMap
+{
+    std::string file;
+    uint32_t local_line;
+    uint32_t merged_line;
+};
+
+void decodeErrorFileAndLine(const std::vector<LineMap>& line_map,
+    std::string& error_file, uint32_t& error_line)
+{
+    for(size_t i = line_map.size(); i > 0; --i) {
+        const auto& p = line_map[i - 1];
+        if (error_line >= p.merged_line) {
+            error_file = p.file;
+            error_line -= p.merged_line;
+            error_line += p.local_line;
+            break;
+        }
+    }
+}
+
+uint64_t hashText(const char* text, size_t size)
+{
+    uint64_t hash = 1469598103934665603ull;
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(text[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+* Unit cache
+*
+* Included files are compiled to units once per text: registered units
+* come first, then units compiled before in the process (keyed by file
+* name and text hash, texts which can't be units are remembered too),
+* then unit files in the cache directory, if set. Units are kept for the
+* lifetime of the process, so linked units stay valid. Compiling happens
+* outside the lock, a unit another thread added meanwhile wins.
+*/
+
+struct UnitCache
+{
+    std::mutex mutex;
+    std::vector<const AsmUnit*> registered;
+    std::unordered_map<std::string, std::unique_ptr<AsmUnit>> units;
+    std::string dir;
+};
+
+UnitCache& getUnitCache()
+{
+    static UnitCache cache;
+    return cache;
+}
+
+void registerUnit(const AsmUnit* unit)
+{
+    UnitCache& cache = getUnitCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.registered.push_back(unit);
+}
+
+void setUnitCacheDir(const std::string& dir)
+{
+    UnitCache& cache = getUnitCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.dir = dir;
+}
+
+std::string getUnitKey(const std::string& file, uint64_t hash)
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return std::string(hex) + "-" + file;
+}
+
+bool compileUnitText(AsmUnit& unit, const std::string& file, const std::vector<char>& text,
+    std::string& error_file, uint32_t& error_line);
+
+// unit for the text of an included file, nullptr if it can't be one
+const AsmUnit* findUnit(const std::string& file, const std::vector<char>& text)
+{
+    UnitCache& cache = getUnitCache();
+    const uint64_t hash = hashText(text.data(), text.size());
+    const std::string key = getUnitKey(file, hash);
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        for(const AsmUnit* unit : cache.registered) {
+            if (unit->file == file && unit->hash == hash)
+                return unit;
+        }
+        auto it = cache.units.find(key);
+        if (it != cache.units.end())
+            return it->second.get();
+        dir = cache.dir;
+    }
+    std::unique_ptr<AsmUnit> unit(new AsmUnit());
+    const std::string unit_path = dir.empty() ? std::string() : dir + "/" + key + ".vmu";
+    if (dir.empty() || !readUnitFile(unit_path.c_str(), *unit) || unit->file != file || unit->hash != hash) {
+        std::string error_file;
+        uint32_t error_line;
+        if (!compileUnitText(*unit, file, text, error_file, error_line)) {
+            unit.reset();
+        } else if (!dir.empty()) {
+            // renamed into place, so other processes never read a partial file
+            const std::string temp_path = unit_path + "." + std::to_string(
+                std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+            if (writeUnitFile(temp_path.c_str(), *unit))
+                std::rename(temp_path.c_str(), unit_path.c_str());
+            else
+                std::remove(temp_path.c_str());
+        }
+    }
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto& entry = cache.units[key];
+    if (!entry && unit)
+        entry = std::move(unit);
+    return entry.get();
+}
+
+enum class IncludeMode
+{
+    Text, // included files are merged into the text
+    Units, // included files are linked as units where they can be
+    Forbidden // compiling a unit
+};
+
+bool includeFile(std::vector<char>& ret, const std::string& path, bool included,
+    std::vector<LineMap>& line_map, std::vector<UnitRef>& units, IncludeMode mode, uint32_t& error_line,
+    std::string& missing_file);
+
+// Appends text of file to ret with "include" lines replaced by included
+// files, every line ending with a newline. Runs of lines without includes
+// are copied at once. An included file that can't be read is returned in
+// missing_file.
+bool spliceText(std::vector<char>& ret, const std::string& dir, const std::string& file,
+    const std::vector<char>& text, std::vector<LineMap>& line_map, std::vector<UnitRef>& units,
+    IncludeMode mode, uint32_t& error_line, std::string& missing_file)
+{
+    static const TextView include_cmd = {"include", 7};
+    uint32_t local_line = 1;
+    const char* p = text.data();
+    const char* const end = p + text.size();
+    const char* run = p;
+    while(p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char* next = eol ? eol + 1 : end;
+        ParsePos pos = {p, static_cast<uint32_t>((eol ? eol : end) - p), 0u, 0u};
+        TextView cmd, arg;
+        if (parseToken(cmd, pos) && cmd == include_cmd) {
+            ret.insert(ret.end(), run, p);
+            if (mode == IncludeMode::Forbidden || !parseToken(arg, pos))
+                return false;
+            if (!includeFile(ret, dir + std::string(arg.text, arg.size), true, line_map, units, mode, error_line,
+                missing_file))
+                return false;
+            ++local_line;
+            line_map.push_back({file, local_line, error_line});
+            run = next;
+        } else {
+            ++local_line;
+            ++error_line;
+        }
+        p = next;
+    }
+    ret.insert(ret.end(), run, end);
+    if (run < end && end[-1] != '\n')
+        ret.push_back('\n');
+    return true;
+}
+
+// appends the file at path to ret, or links it as a unit when it's included
+bool includeFile(std::vector<char>& ret, const std::string& path, bool included,
+    std::vector<LineMap>& line_map, std::vector<UnitRef>& units, IncludeMode mode, uint32_t& error_line,
+    std::string& missing_file)
+{
+    std::string file;
+    std::string dir = path;
+    stripFile(dir, file);
+    std::vector<char> text;
+    if (!readFile(path, text)) {
+        missing_file = path;
+        return false;
+    }
+    if (included && mode == IncludeMode::Units) {
+        const AsmUnit* unit = findUnit(file, text);
+        if (unit) {
+            units.push_back({static_cast<uint32_t>(ret.size()), unit, 0});
+            return true;
+        }
+    }
+    line_map.push_back({file, 1, error_line});
+    return spliceText(ret, dir, file, text, line_map, units, mode, error_line, missing_file);
+}
+
+bool readFileWithInclude(std::vector<char>& ret, const char* file_path,
+    std::vector<LineMap>& line_map, std::vector<UnitRef>& units, IncludeMode mode, uint32_t& error_line,
+    std::string& missing_file)
+{
+    return includeFile(ret, file_path, false, line_map, units, mode, error_line, missing_file);
+}
+
+// file table index of a file name
+uint32_t getFileIndex(DebugInfo& debug, const std::string& file)
+{
+    for(size_t i = debug.files.size(); i > 0; --i) {
+        if (debug.files[i - 1] == file)
+            return static_cast<uint32_t>(i - 1);
+    }
+    debug.files.push_back(file);
+    return static_cast<uint32_t>(debug.files.size() - 1);
+}
+
+void fillDebugInfo(DebugInfo& debug, const std::vector<uint32_t>& lines, const std::vector<LineMap>& line_map,
+    const std::vector<UnitRef>& units, const Symbols& sym)
+{
+    debug = DebugInfo();
+    debug.lines.resize(lines.size());
+    // merged lines of text instructions only grow, so the line map is walked
+    // once, looking up file names only where they change
+    size_t map_index = 0, unit_index = 0;
+    uint32_t map_file = UINT32_MAX, unit_file = UINT32_MAX;
+    for(size_t k = 0; k < lines.size(); ++k) {
+        while(unit_index < units.size() && static_cast<size_t>(units[unit_index].inst_offs / InstSize) +
+            units[unit_index].unit->ops.size() <= k) {
+            ++unit_index;
+            unit_file = UINT32_MAX;
+        }
+        if (unit_index < units.size() && static_cast<size_t>(units[unit_index].inst_offs / InstSize) <= k) {
+            const AsmUnit& unit = *units[unit_index].unit;
+            const size_t i = k - static_cast<size_t>(units[unit_index].inst_offs / InstSize);
+            if (unit_file == UINT32_MAX)
+                unit_file = getFileIndex(debug, unit.file);
+            debug.lines[k] = {unit_file, unit.lines[i]};
+            continue;
+        }
+        while(map_index + 1 < line_map.size() && line_map[map_index + 1].merged_line <= lines[k]) {
+            ++map_index;
+            map_file = UINT32_MAX;
+        }
+        const LineMap& p = line_map[map_index];
+        if (map_file == UINT32_MAX)
+            map_file = getFileIndex(debug, p.file);
+        debug.lines[k] = {map_file, lines[k] - p.merged_line + p.local_line};
+    }
+    // predefined $opcode consts are left out
+    for(uint32_t id = 0; id < sym.table.symbols.size(); ++id) {
+        const AsmSymbol& s = sym.table[id];
+        const TextView view = sym.table.name(id);
+        const std::string name(view.text, view.size);
+        if (s.has_label)
+            debug.labels.push_back({name, s.label / InstSize});
+        if (s.has_const && name.front() != '$')
+            debug.consts.push_back({name, s.value});
+    }
+    std::sort(debug.labels.begin(), debug.labels.end(),
+        [](const std::pair<std::string, int32_t>& a, const std::pair<std::string, int32_t>& b) {
+            return a.second != b.second ? a.second < b.second : a.first < b.first;
+        });
+    std::sort(debug.consts.begin(), debug.consts.end());
+}
+
+// compiles the file to ret_ops, linking included files as units if
+// use_units is set; used_units tells whether it did
+bool compileFile(std::vector<Op>& ret_ops, DebugInfo* debug, const char* code_file_path,
+    const std::vector<std::pair<std::string, int32_t>>& defs, bool use_units,
+    CompileError& error, bool& used_units)
+{
+    error = CompileError();
+    error.line = 1;
+    std::vector<LineMap> line_map;
+    std::vector<char> code;
+    std::vector<UnitRef> units;
+    std::string missing_file;
+    used_units = false;
+    if (!readFileWithInclude(code, code_file_path, line_map, units,
+        use_units ? IncludeMode::Units : IncludeMode::Text, error.line, missing_file)) {
+        decodeErrorFileAndLine(line_map, error.file, error.line);
+        if (!missing_file.empty()) {
+            error.line = line_map.empty() ? 0 : error.line;
+            error.file = missing_file;
+            error.not_found = true;
+        }
+        return false;
+    }
+    used_units = !units.empty();
+    Symbols sym;
+    initSymbols(sym);
+    for(const auto& d : defs) {
+        sym.last_const = d.second;
+        defineConst(sym, toView(d.first), d.second);
+        sym.table[sym.table.intern(toView(d.first))].predefined = true;
+    }
+    std::vector<Op> ops;
+    std::vector<uint32_t> lines;
+    if (!compile(ops, lines, sym, code.data(), static_cast<uint32_t>(code.size()), units, nullptr, error.line)) {
+        decodeErrorFileAndLine(line_map, error.file, error.line);
+        return false;
+    }
+    if (debug)
+        fillDebugInfo(*debug, lines, line_map, units, sym);
+    ret_ops.insert(ret_ops.end(), ops.begin(), ops.end());
+    return true;
+}
+
+bool compileUnitText(AsmUnit& unit, const std::string& file, const std::vector<char>& text,
+    std::string& error_file, uint32_t& error_line)
+{
+    unit = AsmUnit();
+    unit.file = file;
+    unit.hash = hashText(text.data(), text.size());
+    error_file = file;
+    error_line = 1;
+    std::vector<LineMap> line_map;
+    std::vector<char> code;
+    std::vector<UnitRef> units;
+    std::string missing_file;
+    if (!spliceText(code, std::string(), file, text, line_map, units, IncludeMode::Forbidden, error_line,
+        missing_file))
+        return false;
+    Symbols sym;
+    initSymbols(sym);
+    return compile(unit.ops, unit.lines, sym, code.data(), static_cast<uint32_t>(code.size()),
+        units, &unit, error_line);
+}
+
+bool compileUnit(AsmUnit& unit, const char* code_file_path, CompileError& error)
+{
+    std::string file;
+    std::string dir = code_file_path;
+    stripFile(dir, file);
+    std::vector<char> text;
+    if (!readFile(code_file_path, text)) {
+        error.file = code_file_path;
+        error.line = 0;
+        error.not_found = true;
+        return false;
+    }
+    error.not_found = false;
+    return compileUnitText(unit, file, text, error.file, error.line);
+}
+
+bool readAndCompile(std::vector<Op>& ret_ops, DebugInfo& debug, const char* code_file_path,
+    const std::vector<std::pair<std::string, int32_t>>& defs, CompileError& error)
+{
+    // failing with units, the text decides: it may redefine consts of a
+    // unit, and errors point at lines of the text
+    bool used_units;
+    if (compileFile(ret_ops, &debug, code_file_path, defs, true, error, used_units))
+        return true;
+    return used_units &&
+        compileFile(ret_ops, &debug, code_file_path, defs, false, error, used_units);
+}
+
+bool readAndCompile(std::vector<Op>& ret_ops, const char* code_file_path,
+    const std::vector<std::pair<std::string, int32_t>>& defs, CompileError& error)
+{
+    DebugInfo debug;
+    return readAndCompile(ret_ops, debug, code_file_path, defs, error);
+}
+
+bool readAndCompile(std::vector<Op>& ret_ops, const char* code_file_path, CompileError& error)
+{
+    return readAndCompile(ret_ops, code_file_path, {}, error);
+}
+
+std::string describeCompileError(const CompileError& error)
+{
+    if (!error.not_found)
+        return "error at " + error.file + " line " + std::to_string(error.line);
+    if (error.line == 0)
+        return "file " + error.file + " not found";
+    return "file " + error.file + " included at line " + std::to_string(error.line) + " not found";
+}
@@ -0,0 +1,112 @@
+// Assembler of VM code
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include "vm.h"
+
+// Where instructions of a compiled program come from (file index and
+// line in that file) and the symbols its code defines.
+struct SourceLine
+{
+    uint32_t file;
+    uint32_t line;
+};
+
+struct DebugInfo
+{
+    std::vector<std::string> files;
+    std::vector<SourceLine> lines; // per instruction
+    std::vector<std::pair<std::string, int32_t>> labels; // instruction index
+    std::vector<std::pair<std::string, int32_t>> consts;
+};
+
+// Include file compiled on its own: instructions with references to
+// symbols it doesn't define left as fixups, which are resolved where it's
+// included. hash is of the file text, so a changed file isn't replaced
+// by a stale unit.
+enum class FixupKind : uint8_t
+{
+    Value1, // arg1 += const value
+    Value2, // arg2 += const value
+    Label1, // arg1 += relative index of the label
+    Label2  // arg2 += relative index of the label (lia)
+};
+
+struct AsmFixup
+{
+    uint32_t inst;
+    FixupKind kind;
+    uint32_t name; // index into AsmUnit::names
+};
+
+struct AsmUnit
+{
+    std::string file; // name it's included by
+    uint64_t hash;
+    std::vector<Op> ops;
+    std::vector<uint32_t> lines; // per instruction
+    std::vector<std::pair<std::string, int32_t>> labels; // instruction index
+    std::vector<std::pair<std::string, int32_t>> consts;
+    bool sets_last_const; // def or enum, last_const is then the value "enum" continues from
+    int32_t last_const;
+    std::vector<std::string> names;
+    std::vector<AsmFixup> fixups;
+};
+
+uint64_t hashText(const char* text, size_t size);
+
+// Where compiling failed: file and line of the offending line, or with
+// not_found set, a file that can't be read and the line including it (0
+// for the file compiled).
+struct CompileError
+{
+    std::string file;
+    uint32_t line = 0;
+    bool not_found = false;
+};
+
+// "error at <file> line <n>", or "file <path> not found"
+std::string describeCompileError(const CompileError& error);
+
+// Compiles a file without includes to a unit. Fails, besides errors of
+// readAndCompile(), on "enum" before any "def" (its value would depend
+// on where the file is included).
+bool compileUnit(AsmUnit& unit, const char* code_file_path, CompileError& error);
+
+// Units readAndCompile() links instead of compiling included files with
+// the same name and text; they must outlive the calls. Other included
+// files are compiled to units once per text and kept in memory, and
+// with a cache directory set also in unit files there (vm-bytecode.h),
+// so later processes skip them too.
+void registerUnit(const AsmUnit* unit);
+void setUnitCacheDir(const std::string& dir);
+
+// Reads code file (resolving includes) and compiles it to instructions.
+bool readAndCompile(std::vector<Op>& ret_ops, const char* code_file_path, CompileError& error);
+
+// Same, with constants defined before the first line as by "def"; defs
+// and enums of the file don't change them.
+bool readAndCompile(std::vector<Op>& ret_ops, const char* code_file_path,
+    const std::vector<std::pair<std::string, int32_t>>& defs, CompileError& error);
+
+// Same, also returning where instructions come from and defined symbols.
+bool readAndCompile(std::vector<Op>& ret_ops, DebugInfo& debug, const char* code_file_path,
+    const std::vector<std::pair<std::string, int32_t>>& defs, CompileError& error);
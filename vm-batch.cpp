@@ -0,0 +1,147 @@
+// VM batch runner
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+#include "selfvm.h"
+
+/*
+* vm-batch
+*
+* Runs every job of a manifest with runBatch(). A manifest line is a code
+* or bytecode file, relative to the manifest, and defs as name=value, e.g.
+* "fibonacci.code ra=3 rb=4", which override defs of the file of the
+* same names; text after % is a comment. For every job in
+* manifest order it prints the line, the dbg output and the result.
+*/
+
+bool readManifest(const char* path, std::vector<BatchJob>& jobs, std::vector<std::string>& lines)
+{
+    std::ifstream fp(path);
+    if (!fp) {
+        std::cout << "can't read " << path << std::endl;
+        return false;
+    }
+    std::string dir = path;
+    dir.erase(dir.find_last_of('/') + 1);
+    std::string line;
+    for(uint32_t line_number = 1; std::getline(fp, line); ++line_number) {
+        line.erase(std::min(line.find('%'), line.size()));
+        std::istringstream tokens(line);
+        BatchJob job;
+        if (!(tokens >> job.path))
+            continue;
+        if (job.path[0] != '/')
+            job.path = dir + job.path;
+        for(std::string def; tokens >> def;) {
+            const size_t eq = def.find('=');
+            char* end = nullptr;
+            // out of int32 range saturates to a long long that's out of it too
+            const long long value = eq == std::string::npos ? 0 : std::strtoll(def.c_str() + eq + 1, &end, 0);
+            if (eq == std::string::npos || eq == 0 || end == def.c_str() + eq + 1 || *end ||
+                value < INT32_MIN || value > INT32_MAX) {
+                std::cout << "error at " << path << " line " << line_number << std::endl;
+                return false;
+            }
+            job.defs.emplace_back(def.substr(0, eq), static_cast<int32_t>(value));
+        }
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+        jobs.push_back(job);
+        lines.push_back(line);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    std::string engine_name = "tiered";
+    bool stats = false;
+    int arg_index = 1;
+    for(; arg_index < argc && argv[arg_index][0] == '-'; ++arg_index) {
+        const std::string opt = argv[arg_index];
+        if (opt == "--threads" && arg_index + 1 < argc) {
+            options.threads = static_cast<uint32_t>(std::max(std::atoi(argv[++arg_index]), 0));
+        } else if (opt == "--pin") {
+            options.pin_threads = true;
+        } else if (opt == "--engine" && arg_index + 1 < argc) {
+            engine_name = argv[++arg_index];
+        } else if (opt == "--collapse") {
+            options.vm.collapse = true;
+        } else if (opt == "--code-space" && arg_index + 1 < argc) {
+            options.vm.layout.code_space = static_cast<int32_t>(std::min(std::max(std::strtoll(argv[++arg_index], nullptr, 10), 1ll),
+                static_cast<long long>(INT32_MAX)));
+        } else if (opt == "--data-space" && arg_index + 1 < argc) {
+            options.vm.layout.data_space = static_cast<int32_t>(std::min(std::max(std::strtoll(argv[++arg_index], nullptr, 10), 1ll),
+                static_cast<long long>(INT32_MAX)));
+        } else if (opt == "--max-cycles" && arg_index + 1 < argc) {
+            const long long count = std::strtoll(argv[++arg_index], nullptr, 10);
+            options.vm.max_cycles = count > 0 ? count : INT64_MAX;
+        } else if (opt == "--asm-cache" && arg_index + 1 < argc) {
+            setUnitCacheDir(argv[++arg_index]);
+        } else if (opt == "--result-cache" && arg_index + 1 < argc) {
+            options.vm.result_cache = argv[++arg_index];
+        } else if (opt == "--stats") {
+            stats = true;
+        } else {
+            std::cout << "unknown option " << opt << std::endl;
+            return -1;
+        }
+    }
+    if (arg_index + 1 != argc || !parseEngine(engine_name, options.vm.engine)) {
+        std::cout << "usage: vm-batch [--threads <count>] [--pin]"
+            " [--engine tiered|reference|threaded|decoded|fused|jit] [--collapse]"
+            " [--code-space <words>] [--data-space <words>] [--max-cycles <count>]"
+            " [--asm-cache <dir>] [--result-cache <dir>] [--stats] <manifest file>" << std::endl;
+        return -1;
+    }
+    if (options.vm.collapse && options.vm.engine != Engine::Tiered) {
+        std::cout << "--collapse needs --engine tiered" << std::endl;
+        return -1;
+    }
+
+    std::vector<BatchJob> jobs;
+    std::vector<std::string> lines;
+    if (!readManifest(argv[arg_index], jobs, lines))
+        return -1;
+    const auto start = std::chrono::steady_clock::now();
+    const std::vector<BatchResult> results = runBatch(jobs, options);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int failed = 0;
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BatchResult& result = results[i];
+        std::cout << "job " << i + 1 << ": " << lines[i] << std::endl;
+        std::cout << result.output;
+        if (!result.error.empty())
+            std::cout << result.error << std::endl;
+        else
+            std::cout << getResult(result.run.result) << ", " << result.run.cycles << " cycles" << std::endl;
+        failed += !result.error.empty() || result.run.result != Result::Halt;
+    }
+    if (stats)
+        std::cout << results.size() << " jobs, " << failed << " not halted, " << seconds << " s, "
+                  << (seconds > 0 ? results.size() / seconds : 0.0) << " jobs/s" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,430 @@
+// VM benchmark suite
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "selfvm.h"
+
+#ifndef VM_SOURCE_DIR
+#define VM_SOURCE_DIR "."
+#endif
+
+/*
+* vm-bench
+*
+* Runs a fixed suite on every engine and writes the results as JSON:
+*   fibonacci - fibonacci.code on its own, with execute_program registers,
+*   tower1..tower4 - recursive_interpreter.code with max_depth 1..4, i.e.
+*                    fibonacci.code under that many interpreters,
+*   copy - generated loops copying blocks of words (memory heavy),
+*   assembler - a generated file of vm-gen like code, assembled only.
+* Every case is compiled and loaded once (startup time), run --warmup
+* times and then --repetitions times, each from a fresh reset. Times are
+* the best and median of the repetitions, ns per base cycle is from the
+* best one. Level cycles are base cycles per cycle of every level, from
+* the "dbgext dbgext" pair each level starts with. Peak RSS is reset
+* before every case where the system allows it (Linux clear_refs).
+*/
+
+// Synthetic code like vm-gen output: register enums, blocks of arithmetic,
+// forward and backward jumps between labels, lia and comments.
+void genSyntheticCode(std::ostream& os, uint32_t lines)
+{
+    os << "% synthetic assembler benchmark\n";
+    os << "def r0 0\n";
+    for(int r = 1; r < 16; ++r)
+        os << "enum r" << r << "\n";
+    uint32_t block = 0;
+    for(uint32_t line = 17; line < lines; ++block) {
+        os << "@block" << block << ":\n";
+        os << "movv r" << block % 16 << " " << block << "\n";
+        os << "addv r" << (block + 1) % 16 << " -" << block % 7 << " % adjust\n";
+        os << "add r" << (block + 2) % 16 << " r" << (block + 3) % 16 << "\n";
+        os << "jnz @block" << block + 1 << " r" << block % 16 << "\n";
+        os << "lia r4 @block" << block << " 3\n";
+        if (block)
+            os << "jr @block" << block - 1 << "\n";
+        else
+            os << "nop\n";
+        os << "ld r5 r" << (block + 5) % 16 << "\n";
+        os << "st r6 r" << (block + 6) % 16 << "\n";
+        line += 9;
+    }
+    os << "@block" << block << ":\n";
+    os << "hlt\n";
+}
+
+// fills words from address 1000 and copies them to 500000, rounds times
+void genCopyLoops(std::ostream& os, int32_t words, int32_t rounds)
+{
+    os << "% memory copy benchmark\n";
+    os << "def src 0\nenum dst\nenum count\nenum rounds\nenum value\n";
+    os << "dbgext\ndbgext\n";
+    os << "movv src 1000\nmovv count " << words << "\n";
+    os << "@fill:\n st src count\n addv src 1\n subv count 1\n jg @fill count\n";
+    os << "movv rounds " << rounds << "\n";
+    os << "@round:\n";
+    os << " movv src 1000\n movv dst 500000\n movv count " << words << "\n";
+    os << " @copy:\n";
+    os << "  ld value src\n  st dst value\n  addv src 1\n  addv dst 1\n  subv count 1\n  jg @copy count\n";
+    os << " subv rounds 1\n jg @round rounds\n";
+    os << "dbgext\nhlt\n";
+}
+
+// keeps dbgext diffs, drops dbg output
+class BenchSink : public OutputSink
+{
+public:
+    std::vector<int64_t> diffs;
+
+    void dbg(int32_t, int32_t, int32_t) override {}
+    void dbgext(int64_t, int64_t diff) override { diffs.push_back(diff); }
+};
+
+struct BenchCase
+{
+    std::string name;
+    std::string path;
+    std::vector<std::pair<std::string, int32_t>> defs;
+    uint32_t levels; // levels starting with "dbgext dbgext"
+};
+
+struct BenchEngine
+{
+    const char* name;
+    Engine engine;
+    bool collapse;
+};
+
+double getMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// peak RSS counts from here on where the system can reset it
+void resetPeakRss()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+int64_t getPeakRssKb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::atoll(line.c_str() + 6);
+    }
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? static_cast<int64_t>(usage.ru_maxrss) : 0;
+}
+
+bool readText(const std::string& path, std::string& text)
+{
+    std::ifstream fp(path, std::ios::binary);
+    std::stringstream ss;
+    ss << fp.rdbuf();
+    text = ss.str();
+    return static_cast<bool>(fp);
+}
+
+bool writeText(const std::string& path, const std::string& text)
+{
+    std::ofstream fp(path, std::ios::binary);
+    fp << text;
+    return static_cast<bool>(fp);
+}
+
+bool isSelected(const std::string& list, const std::string& name)
+{
+    return list.empty() || ("," + list + ",").find("," + name + ",") != std::string::npos;
+}
+
+void writeTimes(std::ostream& os, std::vector<double> ms)
+{
+    std::sort(ms.begin(), ms.end());
+    os << "\"best_ms\": " << ms.front() << ", \"median_ms\": " << ms[ms.size() / 2];
+}
+
+// runs the case on the engine, false on an error
+bool runCase(const BenchCase& c, const BenchEngine& e, int warmup, int repetitions, bool hw_counters,
+    std::ostream& os)
+{
+    VmOptions options;
+    options.engine = e.engine;
+    options.collapse = e.collapse;
+    options.hw_counters = hw_counters;
+    resetPeakRss();
+    const auto start = std::chrono::steady_clock::now();
+    CompileError error;
+    const ProgramRef program = compileProgram(c.path.c_str(), error, c.defs);
+    if (!program) {
+        std::cout << describeCompileError(error) << std::endl;
+        return false;
+    }
+    Vm vm(options);
+    BenchSink sink;
+    vm.setOutput(&sink);
+    if (!vm.reset(program)) {
+        std::cout << c.name << " doesn't fit the code space" << std::endl;
+        return false;
+    }
+    const double startup_ms = getMs(start);
+
+    std::vector<double> ms;
+    RunResult res = {};
+    for(int r = 0; r < warmup + repetitions; ++r) {
+        if (r)
+            vm.reset(program);
+        sink.diffs.clear();
+        const auto run_start = std::chrono::steady_clock::now();
+        res = vm.run();
+        if (r >= warmup)
+            ms.push_back(getMs(run_start));
+    }
+    if (res.result != Result::Halt) {
+        std::cout << c.name << " on " << e.name << " engine: " << getResult(res.result) << std::endl;
+        return false;
+    }
+    const double best_ms = *std::min_element(ms.begin(), ms.end());
+    os << "    {\"case\": \"" << c.name << "\", \"engine\": \"" << e.name << "\", \"cycles\": " << res.cycles
+       << ", \"startup_ms\": " << startup_ms << ", ";
+    writeTimes(os, ms);
+    os << ", \"ns_per_cycle\": " << (res.cycles ? best_ms * 1e6 / static_cast<double>(res.cycles) : 0.0)
+       << ", \"level_cycles\": [";
+    for(uint32_t i = 0; i < c.levels && 2 * i + 1 < sink.diffs.size(); ++i)
+        os << (i ? ", " : "") << sink.diffs[2 * i + 1];
+    os << "], \"peak_rss_kb\": " << getPeakRssKb();
+    if (const HwCounts* counts = vm.hwCounters()) {
+        // of the last repetition, per base cycle
+        os << ", \"hw_counters\": {";
+        const char* sep = "";
+        for(uint32_t i = 0; i < HwCounterCount; ++i) {
+            if (counts->available[i]) {
+                os << sep << "\"" << getHwCounterName(static_cast<HwCounter>(i)) << "\": "
+                   << static_cast<double>(counts->value[i]) / static_cast<double>(std::max<int64_t>(res.cycles, 1));
+                sep = ", ";
+            }
+        }
+        os << "}";
+    }
+    os << "}";
+    return true;
+}
+
+bool runAssembler(const std::string& path, uint32_t lines, int warmup, int repetitions, std::ostream& os)
+{
+    {
+        std::ofstream fp(path);
+        genSyntheticCode(fp, lines);
+        if (!fp) {
+            std::cout << "can't write " << path << std::endl;
+            return false;
+        }
+    }
+    std::vector<double> ms;
+    size_t inst_count = 0;
+    for(int r = 0; r < warmup + repetitions; ++r) {
+        const auto start = std::chrono::steady_clock::now();
+        CompileError error;
+        const ProgramRef program = compileProgram(path.c_str(), error);
+        if (!program) {
+            std::cout << describeCompileError(error) << std::endl;
+            return false;
+        }
+        if (r >= warmup)
+            ms.push_back(getMs(start));
+        inst_count = program->ops.size();
+    }
+    os << "    {\"case\": \"assembler\", \"lines\": " << lines << ", \"instructions\": " << inst_count << ", ";
+    writeTimes(os, ms);
+    os << ", \"lines_per_s\": " << lines / *std::min_element(ms.begin(), ms.end()) * 1000.0 << "}";
+    return true;
+}
+
+// the files of the cases and their directory, removed however the
+// benchmark ends
+struct WorkDir
+{
+    std::string path;
+    std::vector<std::string> files;
+
+    ~WorkDir()
+    {
+        for(const auto& file : files)
+            std::remove(file.c_str());
+        if (!path.empty())
+            rmdir(path.c_str());
+    }
+};
+
+int main(int argc, char** argv)
+{
+    int warmup = 1;
+    int repetitions = 3;
+    uint32_t lines = 1000000;
+    std::string cases_list, engines_list;
+    std::string source_dir = VM_SOURCE_DIR;
+    const char* output_path = nullptr;
+    bool hw_counters = false;
+    int arg_index = 1;
+    for(; arg_index < argc && argv[arg_index][0] == '-'; ++arg_index) {
+        const std::string opt = argv[arg_index];
+        if (opt == "--warmup" && arg_index + 1 < argc) {
+            warmup = std::max(std::atoi(argv[++arg_index]), 0);
+        } else if (opt == "--repetitions" && arg_index + 1 < argc) {
+            repetitions = std::max(std::atoi(argv[++arg_index]), 1);
+        } else if (opt == "--lines" && arg_index + 1 < argc) {
+            lines = static_cast<uint32_t>(std::max(std::atoi(argv[++arg_index]), 1));
+        } else if (opt == "--cases" && arg_index + 1 < argc) {
+            cases_list = argv[++arg_index];
+        } else if (opt == "--engines" && arg_index + 1 < argc) {
+            engines_list = argv[++arg_index];
+        } else if (opt == "--source-dir" && arg_index + 1 < argc) {
+            source_dir = argv[++arg_index];
+        } else if (opt == "--output" && arg_index + 1 < argc) {
+            output_path = argv[++arg_index];
+        } else if (opt == "--hwcounters") {
+            hw_counters = true;
+        } else {
+            std::cout << "unknown option " << opt << std::endl;
+            return -1;
+        }
+    }
+    if (arg_index < argc) {
+        std::cout << "usage: vm-bench [--warmup <count>] [--repetitions <count>] [--lines <count>]"
+            " [--cases fibonacci,tower1,..,tower4,copy,assembler]"
+            " [--engines tiered,collapse,reference,threaded,decoded,fused,jit]"
+            " [--source-dir <dir>] [--output <json file>] [--hwcounters]" << std::endl;
+        return -1;
+    }
+
+    // the tower cases need recursive_interpreter.code with its includes next to it
+    char work_path[] = "/tmp/vm-bench-XXXXXX";
+    if (!mkdtemp(work_path)) {
+        std::cout << "can't create a directory in /tmp" << std::endl;
+        return -1;
+    }
+    WorkDir work_dir;
+    work_dir.path = work_path;
+    const std::string dir = work_dir.path + "/";
+    std::vector<std::string>& files = work_dir.files;
+    std::string tower_text;
+    for(const char* name : { "execute_program.code", "fibonacci.code", "recursive_interpreter.code" }) {
+        std::string text;
+        files.push_back(dir + name);
+        if (!readText(source_dir + "/" + name, text) || !writeText(files.back(), text)) {
+            std::cout << "can't copy " << source_dir << "/" << name << " (see --source-dir)" << std::endl;
+            return -1;
+        }
+        tower_text = text;
+    }
+    static const std::string max_depth_def = "def max_depth 4";
+    const size_t max_depth_pos = tower_text.find(max_depth_def);
+    if (max_depth_pos == std::string::npos) {
+        std::cout << "no \"" << max_depth_def << "\" in recursive_interpreter.code" << std::endl;
+        return -1;
+    }
+
+    std::vector<BenchCase> cases;
+    static const char* execute_regs[] = { "top", "ret_val", "param", "ra", "rb", "rc", "rd", "re" };
+    BenchCase fib = {"fibonacci", dir + "fibonacci.code", {}, 1};
+    for(int32_t i = 0; i < 8; ++i)
+        fib.defs.emplace_back(execute_regs[i], i);
+    cases.push_back(fib);
+    for(int depth = 1; depth <= 4; ++depth) {
+        const std::string name = "tower" + std::to_string(depth);
+        std::string text = tower_text;
+        text.replace(max_depth_pos, max_depth_def.size(), "def max_depth " + std::to_string(depth));
+        files.push_back(dir + name + ".code");
+        if (!writeText(files.back(), text)) {
+            std::cout << "can't write " << files.back() << std::endl;
+            return -1;
+        }
+        cases.push_back({name, files.back(), {}, static_cast<uint32_t>(depth + 1)});
+    }
+    {
+        files.push_back(dir + "copy.code");
+        std::ofstream fp(files.back());
+        genCopyLoops(fp, 100000, 20);
+        cases.push_back({"copy", files.back(), {}, 1});
+    }
+    static const BenchEngine engines[] = {
+        { "tiered", Engine::Tiered, false },
+        { "collapse", Engine::Tiered, true },
+        { "reference", Engine::Reference, false },
+        { "threaded", Engine::Threaded, false },
+        { "decoded", Engine::Decoded, false },
+        { "fused", Engine::Fused, false },
+        { "jit", Engine::Jit, false },
+    };
+
+    std::ostringstream json;
+    json << "{\n  \"warmup\": " << warmup << ", \"repetitions\": " << repetitions << ",\n  \"results\": [";
+    const char* sep = "\n";
+    bool ok = true;
+    // a result is written once its case ran
+    auto addResult = [&](bool case_ok, const std::ostringstream& result) {
+        if (case_ok) {
+            json << sep << result.str();
+            sep = ",\n";
+        }
+        ok &= case_ok;
+    };
+    for(const auto& c : cases) {
+        if (!isSelected(cases_list, c.name))
+            continue;
+        for(const auto& e : engines) {
+            if (!isSelected(engines_list, e.name))
+                continue;
+            std::ostringstream result;
+            addResult(runCase(c, e, warmup, repetitions, hw_counters, result), result);
+        }
+    }
+    if (ok && isSelected(cases_list, "assembler")) {
+        files.push_back(dir + "assembler.code");
+        std::ostringstream result;
+        addResult(runAssembler(files.back(), lines, warmup, repetitions, result), result);
+    }
+    json << "\n  ]\n}\n";
+    if (!ok)
+        return -1;
+
+    if (output_path) {
+        std::ofstream fp(output_path);
+        fp << json.str();
+        if (!fp) {
+            std::cout << "can't write " << output_path << std::endl;
+            return -1;
+        }
+    } else {
+        std::cout << json.str();
+    }
+    return 0;
+}
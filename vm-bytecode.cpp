@@ -0,0 +1,350 @@
+// VM binary bytecode format
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#if defined(__unix__)
+#define VM_MAPPED_BYTECODE 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "vm-bytecode.h"
+#include "vm-machine.h"
+
+bool isBytecodeFile(const char* path)
+{
+    std::ifstream fp(path, std::ios::binary);
+    uint32_t magic = 0;
+    return fp.read(reinterpret_cast<char*>(&magic), sizeof(magic)) && magic == BytecodeMagic;
+}
+
+void addBytecodeString(std::vector<char>& strings, BytecodeString& s, const std::string& text)
+{
+    s.offset = static_cast<uint32_t>(strings.size());
+    s.size = static_cast<uint32_t>(text.size());
+    strings.insert(strings.end(), text.begin(), text.end());
+}
+
+template<typename T>
+void writeArray(std::ofstream& fp, const std::vector<T>& v)
+{
+    if (!v.empty())
+        fp.write(reinterpret_cast<const char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T)));
+}
+
+template<typename T>
+void appendArray(std::vector<char>& bytes, const std::vector<T>& v)
+{
+    const char* p = reinterpret_cast<const char*>(v.data());
+    bytes.insert(bytes.end(), p, p + v.size() * sizeof(T));
+}
+
+bool writeBytecode(const char* path, const std::vector<Op>& ops, const DebugInfo& debug)
+{
+    BytecodeHeader header = {BytecodeMagic, BytecodeVersion, static_cast<uint32_t>(ops.size()),
+        static_cast<uint32_t>(debug.files.size()), static_cast<uint32_t>(debug.labels.size()),
+        static_cast<uint32_t>(debug.consts.size()), 0, 0, 0};
+    std::vector<SourceLine> lines = debug.lines;
+    lines.resize(ops.size(), SourceLine{0, 0});
+    std::vector<char> strings;
+    std::vector<BytecodeString> files(debug.files.size());
+    for(size_t i = 0; i < files.size(); ++i)
+        addBytecodeString(strings, files[i], debug.files[i]);
+    std::vector<BytecodeSymbol> symbols;
+    for(const auto* table : {&debug.labels, &debug.consts}) {
+        for(const auto& s : *table) {
+            symbols.push_back({{0, 0}, s.second});
+            addBytecodeString(strings, symbols.back().name, s.first);
+        }
+    }
+    header.strings_size = static_cast<uint32_t>(strings.size());
+    std::vector<char> body;
+    appendArray(body, ops);
+    appendArray(body, lines);
+    appendArray(body, files);
+    appendArray(body, symbols);
+    appendArray(body, strings);
+    header.checksum = hashText(body.data(), body.size());
+
+    std::ofstream fp(path, std::ios::binary);
+    if (!fp)
+        return false;
+    fp.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fp.write(body.data(), static_cast<std::streamsize>(body.size()));
+    return static_cast<bool>(fp);
+}
+
+// read-only view of a file, mapped where possible
+class FileView
+{
+public:
+    explicit FileView(const char* path)
+    {
+#if VM_MAPPED_BYTECODE
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapping = p;
+                bytes = static_cast<const char*>(p);
+                size_ = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);
+        if (mapping)
+            return;
+#endif
+        std::ifstream fp(path, std::ios::binary);
+        copy.assign(std::istreambuf_iterator<char>(fp), std::istreambuf_iterator<char>());
+        bytes = copy.data();
+        size_ = copy.size();
+    }
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+    ~FileView()
+    {
+#if VM_MAPPED_BYTECODE
+        if (mapping)
+            munmap(mapping, size_);
+#endif
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return size_; }
+
+private:
+    void* mapping = nullptr;
+    std::vector<char> copy;
+    const char* bytes = nullptr;
+    size_t size_ = 0;
+};
+
+template<typename T>
+bool readArray(const FileView& view, size_t& pos, uint32_t count, std::vector<T>& v)
+{
+    const uint64_t bytes = static_cast<uint64_t>(count) * sizeof(T);
+    if (bytes > view.size() - pos)
+        return false;
+    v.resize(count);
+    if (count)
+        memcpy(v.data(), view.data() + pos, static_cast<size_t>(bytes));
+    pos += static_cast<size_t>(bytes);
+    return true;
+}
+
+bool getBytecodeString(const std::vector<char>& strings, const BytecodeString& s, std::string& text)
+{
+    if (s.offset > strings.size() || s.size > strings.size() - s.offset)
+        return false;
+    text.assign(strings.data() + s.offset, s.size);
+    return true;
+}
+
+bool readBytecode(const char* path, std::vector<Op>& ops, DebugInfo& debug)
+{
+    const FileView view(path);
+    BytecodeHeader header;
+    if (view.size() < sizeof(header))
+        return false;
+    memcpy(&header, view.data(), sizeof(header));
+    if (header.magic != BytecodeMagic || header.version != BytecodeVersion ||
+        hashText(view.data() + sizeof(header), view.size() - sizeof(header)) != header.checksum)
+        return false;
+    size_t pos = sizeof(header);
+    std::vector<BytecodeString> files;
+    std::vector<BytecodeSymbol> symbols;
+    std::vector<char> strings;
+    debug = DebugInfo();
+    if (header.label_count + header.const_count < header.label_count ||
+        !readArray(view, pos, header.op_count, ops) ||
+        !readArray(view, pos, header.op_count, debug.lines) ||
+        !readArray(view, pos, header.file_count, files) ||
+        !readArray(view, pos, header.label_count + header.const_count, symbols) ||
+        !readArray(view, pos, header.strings_size, strings) || pos != view.size())
+        return false;
+    for(const auto& op : ops) {
+        if (static_cast<uint32_t>(op.code) >= OpCodeCount)
+            return false;
+    }
+    debug.files.resize(files.size());
+    for(size_t i = 0; i < files.size(); ++i) {
+        if (!getBytecodeString(strings, files[i], debug.files[i]))
+            return false;
+    }
+    for(const auto& line : debug.lines) {
+        if (line.file >= files.size() && !(line.file == 0 && line.line == 0))
+            return false;
+    }
+    for(size_t i = 0; i < symbols.size(); ++i) {
+        auto& table = i < header.label_count ? debug.labels : debug.consts;
+        table.push_back({std::string(), symbols[i].value});
+        if (!getBytecodeString(strings, symbols[i].name, table.back().first))
+            return false;
+    }
+    return true;
+}
+
+bool writeUnitFile(const char* path, const AsmUnit& unit)
+{
+    UnitFileHeader header = {UnitFileMagic, UnitFileVersion, static_cast<uint32_t>(unit.hash),
+        static_cast<uint32_t>(unit.hash >> 32), {0, 0}, static_cast<uint32_t>(unit.ops.size()),
+        static_cast<uint32_t>(unit.labels.size()), static_cast<uint32_t>(unit.consts.size()),
+        static_cast<uint32_t>(unit.names.size()), static_cast<uint32_t>(unit.fixups.size()), 0,
+        unit.sets_last_const ? 1u : 0u, unit.last_const};
+    std::vector<uint32_t> lines = unit.lines;
+    lines.resize(unit.ops.size(), 0);
+    std::vector<char> strings;
+    addBytecodeString(strings, header.file, unit.file);
+    std::vector<BytecodeSymbol> symbols;
+    for(const auto* table : {&unit.labels, &unit.consts}) {
+        for(const auto& s : *table) {
+            symbols.push_back({{0, 0}, s.second});
+            addBytecodeString(strings, symbols.back().name, s.first);
+        }
+    }
+    std::vector<BytecodeString> names(unit.names.size());
+    for(size_t i = 0; i < names.size(); ++i)
+        addBytecodeString(strings, names[i], unit.names[i]);
+    std::vector<UnitFileFixup> fixups;
+    for(const auto& f : unit.fixups)
+        fixups.push_back({f.inst, static_cast<uint32_t>(f.kind), f.name});
+    header.strings_size = static_cast<uint32_t>(strings.size());
+
+    std::ofstream fp(path, std::ios::binary);
+    if (!fp)
+        return false;
+    fp.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeArray(fp, unit.ops);
+    writeArray(fp, lines);
+    writeArray(fp, symbols);
+    writeArray(fp, names);
+    writeArray(fp, fixups);
+    writeArray(fp, strings);
+    return static_cast<bool>(fp);
+}
+
+bool readUnitFile(const char* path, AsmUnit& unit)
+{
+    const FileView view(path);
+    UnitFileHeader header;
+    if (view.size() < sizeof(header))
+        return false;
+    memcpy(&header, view.data(), sizeof(header));
+    if (header.magic != UnitFileMagic || header.version != UnitFileVersion)
+        return false;
+    size_t pos = sizeof(header);
+    std::vector<BytecodeSymbol> symbols;
+    std::vector<BytecodeString> names;
+    std::vector<UnitFileFixup> fixups;
+    std::vector<char> strings;
+    unit = AsmUnit();
+    if (header.label_count + header.const_count < header.label_count ||
+        !readArray(view, pos, header.op_count, unit.ops) ||
+        !readArray(view, pos, header.op_count, unit.lines) ||
+        !readArray(view, pos, header.label_count + header.const_count, symbols) ||
+        !readArray(view, pos, header.name_count, names) ||
+        !readArray(view, pos, header.fixup_count, fixups) ||
+        !readArray(view, pos, header.strings_size, strings) || pos != view.size() ||
+        !getBytecodeString(strings, header.file, unit.file))
+        return false;
+    unit.hash = static_cast<uint64_t>(header.hash_high) << 32 | header.hash_low;
+    unit.sets_last_const = header.sets_last_const != 0;
+    unit.last_const = header.last_const;
+    for(size_t i = 0; i < symbols.size(); ++i) {
+        auto& table = i < header.label_count ? unit.labels : unit.consts;
+        table.push_back({std::string(), symbols[i].value});
+        if (!getBytecodeString(strings, symbols[i].name, table.back().first))
+            return false;
+    }
+    unit.names.resize(names.size());
+    for(size_t i = 0; i < names.size(); ++i) {
+        if (!getBytecodeString(strings, names[i], unit.names[i]))
+            return false;
+    }
+    for(const auto& f : fixups) {
+        if (f.inst >= header.op_count || f.kind > static_cast<uint32_t>(FixupKind::Label2) || f.name >= names.size())
+            return false;
+        unit.fixups.push_back({f.inst, static_cast<FixupKind>(f.kind), f.name});
+    }
+    return true;
+}
+
+bool writeResultFile(const char* path, const ResultEntry& entry)
+{
+    std::vector<char> body;
+    appendArray(body, entry.ops);
+    appendArray(body, entry.output);
+    appendArray(body, entry.runs);
+    appendArray(body, entry.words);
+    const ResultFileHeader header = {ResultFileMagic, ResultFileVersion, entry.key, entry.result, entry.inst_addr,
+        entry.cycles, entry.last_dbgext_cycles, static_cast<uint32_t>(entry.output.size()),
+        static_cast<uint32_t>(entry.runs.size()), static_cast<uint32_t>(entry.words.size()), 0,
+        hashText(body.data(), body.size())};
+
+    std::ofstream fp(path, std::ios::binary);
+    if (!fp)
+        return false;
+    fp.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fp.write(body.data(), static_cast<std::streamsize>(body.size()));
+    return static_cast<bool>(fp);
+}
+
+bool readResultFile(const char* path, ResultEntry& entry)
+{
+    const FileView view(path);
+    ResultFileHeader header;
+    if (view.size() < sizeof(header))
+        return false;
+    memcpy(&header, view.data(), sizeof(header));
+    if (header.magic != ResultFileMagic || header.version != ResultFileVersion || header.key.mem_size < 0 ||
+        header.result < static_cast<int32_t>(Result::Continue) || header.result > static_cast<int32_t>(Result::Yield) ||
+        hashText(view.data() + sizeof(header), view.size() - sizeof(header)) != header.checksum)
+        return false;
+    size_t pos = sizeof(header);
+    entry.key = header.key;
+    entry.result = header.result;
+    entry.inst_addr = header.inst_addr;
+    entry.cycles = header.cycles;
+    entry.last_dbgext_cycles = header.last_dbgext_cycles;
+    if (!readArray(view, pos, header.key.op_count, entry.ops) ||
+        !readArray(view, pos, header.output_count, entry.output) ||
+        !readArray(view, pos, header.run_count, entry.runs) ||
+        !readArray(view, pos, header.word_count, entry.words) || pos != view.size())
+        return false;
+    for(const auto& out : entry.output) {
+        if (out.kind != ResultOutput::Dbg && out.kind != ResultOutput::Dbgext)
+            return false;
+    }
+    // runs within memory, covering the words exactly
+    uint64_t words = 0;
+    for(const auto& run : entry.runs) {
+        if (run.addr > static_cast<uint32_t>(header.key.mem_size) ||
+            run.size > static_cast<uint32_t>(header.key.mem_size) - run.addr)
+            return false;
+        words += run.size;
+    }
+    return words == header.word_count;
+}
@@ -0,0 +1,207 @@
+// VM binary bytecode format
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "vm.h"
+#include "vm-asm.h"
+
+/*
+* Bytecode file (.vmb)
+*
+* A compiled program stored the way it's loaded, all fields native-endian
+* 32-bit words:
+*   BytecodeHeader
+*   Op[op_count]             program order, as compiled
+*   SourceLine[op_count]     file index and line of every instruction
+*   BytecodeString[file_count]
+*   BytecodeSymbol[label_count]  labels, value is the instruction index
+*   BytecodeSymbol[const_count]
+*   char[strings_size]       names, not zero-terminated
+* checksum is hashText() of everything after the header. Reading maps the
+* file and, once the checksum, the counts, opcodes and string ranges are
+* checked, copies the arrays out: nothing is assembled.
+*/
+
+constexpr uint32_t BytecodeMagic = 0x31424d56; // "VMB1"
+constexpr uint32_t BytecodeVersion = 2;
+
+struct BytecodeHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t op_count;
+    uint32_t file_count;
+    uint32_t label_count;
+    uint32_t const_count;
+    uint32_t strings_size;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+struct BytecodeString
+{
+    uint32_t offset; // into the string table
+    uint32_t size;
+};
+
+struct BytecodeSymbol
+{
+    BytecodeString name;
+    int32_t value;
+};
+
+/*
+* Unit file (.vmu)
+*
+* An AsmUnit in the same style, as the unit cache of the assembler keeps
+* them on disk:
+*   UnitFileHeader
+*   Op[op_count]
+*   uint32_t[op_count]       lines
+*   BytecodeSymbol[label_count]
+*   BytecodeSymbol[const_count]
+*   BytecodeString[name_count]
+*   UnitFileFixup[fixup_count]
+*   char[strings_size]
+*/
+
+constexpr uint32_t UnitFileMagic = 0x31554d56; // "VMU1"
+constexpr uint32_t UnitFileVersion = 1;
+
+struct UnitFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash_low;
+    uint32_t hash_high;
+    BytecodeString file;
+    uint32_t op_count;
+    uint32_t label_count;
+    uint32_t const_count;
+    uint32_t name_count;
+    uint32_t fixup_count;
+    uint32_t strings_size;
+    uint32_t sets_last_const;
+    int32_t last_const;
+};
+
+struct UnitFileFixup
+{
+    uint32_t inst;
+    uint32_t kind;
+    uint32_t name;
+};
+
+static_assert(sizeof(Op) == InstSize * sizeof(int32_t), "Op is stored as is");
+
+// true if the file starts with BytecodeMagic
+bool isBytecodeFile(const char* path);
+
+bool writeBytecode(const char* path, const std::vector<Op>& ops, const DebugInfo& debug);
+
+// false if the file can't be read or isn't valid bytecode
+bool readBytecode(const char* path, std::vector<Op>& ops, DebugInfo& debug);
+
+bool writeUnitFile(const char* path, const AsmUnit& unit);
+
+// false if the file can't be read or isn't a valid unit
+bool readUnitFile(const char* path, AsmUnit& unit);
+
+/*
+* Result file (.vmr)
+*
+* A finished run kept by the result cache of Vm (selfvm.h), in the same
+* style:
+*   ResultFileHeader
+*   Op[op_count]             the program, compared on a hit with the key
+*   ResultFileOutput[output_count]  dbg and dbgext calls in order
+*   ResultFileRun[run_count] words which differ from the machine as reset
+*   int32_t[word_count]      their values, run after run
+* checksum is hashText() of everything after the header.
+*/
+
+constexpr uint32_t ResultFileMagic = 0x31524d56; // "VMR1"
+constexpr uint32_t ResultFileVersion = 1;
+
+// machine parameters a run depends on besides the program
+struct ResultFileKey
+{
+    uint32_t op_count;
+    int32_t data_offset;
+    int32_t mem_size;
+    uint32_t flags; // engine options which change results, see selfvm.cpp
+    int64_t max_cycles;
+};
+
+struct ResultFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    ResultFileKey key;
+    int32_t result;
+    int32_t inst_addr;
+    int64_t cycles;
+    int64_t last_dbgext_cycles;
+    uint32_t output_count;
+    uint32_t run_count;
+    uint32_t word_count;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+enum class ResultOutput : uint32_t
+{
+    Dbg, // addr, a = rel_addr, b = value
+    Dbgext // a = cycles, b = diff
+};
+
+struct ResultFileOutput
+{
+    ResultOutput kind;
+    int32_t addr;
+    int64_t a;
+    int64_t b;
+};
+
+struct ResultFileRun
+{
+    uint32_t addr;
+    uint32_t size;
+};
+
+struct ResultEntry
+{
+    ResultFileKey key;
+    std::vector<Op> ops;
+    int32_t result;
+    int32_t inst_addr;
+    int64_t cycles;
+    int64_t last_dbgext_cycles;
+    std::vector<ResultFileOutput> output;
+    std::vector<ResultFileRun> runs;
+    std::vector<int32_t> words;
+};
+
+bool writeResultFile(const char* path, const ResultEntry& entry);
+
+// false if the file can't be read, isn't a valid result or its checksum
+// doesn't match
+bool readResultFile(const char* path, ResultEntry& entry);
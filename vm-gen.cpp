@@ -22,12 +22,15 @@
 #include <vector>
 #include <cstdint>
 #include <cstdlib>
+#include <cctype>
 #include <unordered_map>
 #include <algorithm>
 #include <math.h>
 #include <assert.h>
 
 #include "vm.h"
+#include "vm-asm.h"
+#include "vm-machine.h"
 
 void printTab(std::ostream& os, int32_t lev)
 {
@@ -296,39 +299,45 @@ void genBinaryOpSwitchRec(std::ostream& os, int32_t s, int32_t e, int32_t lev)
     genBinaryOpSwitchRec(os, m + 1, e, lev + 1);
 }
 
-void genExecuteProgram(std::ostream& os)
-{
-    const char* autogen_begin = "%%% auto-generated begin: do not edit %%%\n\n";
-    const char* autogen_end = "\n%%% auto-generated end %%%\n";
+const char* autogen_begin = "%%% auto-generated begin: do not edit %%%\n\n";
+const char* autogen_end = "\n%%% auto-generated end %%%\n";
+
+constexpr int32_t execute_limit = 10000000;
 
+const static std::vector<std::string> execute_regs = {
+  "top",
+  "ret_val",
+  "param",
+  "ra",
+  "rb",
+  "rc",
+  "rd",
+  "re",
+  "rcnt",
+  "m_inst_addr",
+  "m_base_offs",
+  "m_data_offs",
+  "m_mem_size",
+};
+
+void genExecuteHeader(std::ostream& os)
+{
     os << autogen_begin;
     os << "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n";
     os << "%%% Self-interpreting VM, Tomasz Dobrowolski (C) 2019 %%%\n";
     os << "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n";
 
-    const std::vector<std::string> regs = {
-      "top",
-      "ret_val",
-      "param",
-      "ra",
-      "rb",
-      "rc",
-      "rd",
-      "re",
-      "rcnt",
-      "m_inst_addr",
-      "m_base_offs",
-      "m_data_offs",
-      "m_mem_size",
-    };
-    for(size_t i = 0; i < regs.size(); ++i) {
-        os << "def " << regs[i] << " " << i << std::endl;
+    for(size_t i = 0; i < execute_regs.size(); ++i) {
+        os << "def " << execute_regs[i] << " " << i << std::endl;
     }
     os << std::endl;
 
     os << "jr @main\n\n";
+}
 
-    const char* execute_begin =
+void genExecuteLoop(std::ostream& os, const char* entry_label)
+{
+    const char* execute_doc =
         "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n"
         "%% Execute self-interpreting machine code   %%\n"
         "%% with safety checks.                      %%\n"
@@ -344,11 +353,14 @@ void genExecuteProgram(std::ostream& os)
         "%%  -11111114 = division by zero            %%\n"
         "%%  -11111115 = infinite loop               %%\n"
         "%%  -11111116 = unknown operation code      %%\n"
-        "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n"
-        "@execute_program:\n"
-        " mov m_inst_addr m_data_offs\n"
-        "\n"
-        " movv rcnt 10000000 % execution limit\n"
+        "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n";
+    os << execute_doc;
+    os << entry_label << ":\n"
+          " mov m_inst_addr m_data_offs\n"
+          "\n"
+          " movv rcnt " << execute_limit << " % execution limit\n";
+
+    const char* execute_begin =
         " @execute_loop:\n"
         "  subv m_inst_addr 1\n"
         "  ld ra m_inst_addr\n"
@@ -405,6 +417,12 @@ void genExecuteProgram(std::ostream& os)
        " ld ra top\n"
        " ja ra\n";
     os << execute_end;
+}
+
+void genExecuteProgram(std::ostream& os)
+{
+    genExecuteHeader(os);
+    genExecuteLoop(os, "@execute_program");
     os << autogen_end;
 }
 
@@ -418,13 +436,996 @@ bool genExecuteProgram(const char* file_path)
     return true;
 }
 
+/*
+* Specialisation of execute_program to a fixed guest program
+* (first Futamura projection)
+*
+* The guest code and the machine window (m_base_offs, m_data_offs,
+* m_mem_size) are static, so every guest instruction becomes a few host
+* instructions working directly on the window: no fetch, no decode, no
+* opcode switch, static operands checked here instead of at run time.
+* Checks that depend on memory contents (indirect addresses, ja targets,
+* division by zero) are emitted the way the interpreter does them, and
+* fail into its error handlers with the same values in rb/rd, so output
+* and ret_val are the same.
+*
+* rcnt is charged for a whole basic block on entry. Whenever that would
+* run out, the guest stores into its own code, or control leaves the
+* guest code, the residual program sets m_inst_addr and rcnt and
+* continues in the generic @execute_loop, which is emitted too. Called
+* with another window or with memory not holding the guest code it runs
+* the generic interpreter from the start, so it can replace
+* execute_program.code anywhere.
+*/
+
+struct SpecProgram
+{
+    std::vector<Op> ops;
+    int32_t base_offs;
+    int32_t data_offs;
+    int32_t mem_size;
+    std::vector<bool> leader;         // starts a basic block
+    std::vector<uint32_t> block_end;  // end of the basic block of every instruction
+};
+
+struct GenOpInfo
+{
+    bool next;                       // can continue with the following instruction
+    bool jump;                       // ends basic block
+    std::vector<uint32_t> targets;   // instructions jumped to directly
+};
+
+inline int32_t wrapAdd(int32_t a, int32_t b)
+{
+    return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+}
+
+// m_inst_addr value of the interpreter when it is about to fetch instruction k
+inline int32_t getSpecInstAddr(const SpecProgram& sp, int64_t k)
+{
+    return static_cast<int32_t>(sp.data_offs - k * InstSize);
+}
+
+inline bool isSpecCode(const SpecProgram& sp, int32_t addr)
+{
+    return addr < sp.data_offs && addr >= getSpecInstAddr(sp, static_cast<int64_t>(sp.ops.size()));
+}
+
+// cycles charged on entry to instruction k for the rest of its basic block
+int32_t getBlockCharge(const std::vector<Op>& ops, const std::vector<uint32_t>& block_end, uint32_t k)
+{
+    if (block_end.empty())
+        return 1;
+    const uint32_t end = block_end[k];
+    return static_cast<int32_t>(end - k) - (ops[end - 1].code == OpCode::Hlt ? 1 : 0);
+}
+
+inline int32_t getSpecCharge(const SpecProgram& sp, uint32_t k)
+{
+    return getBlockCharge(sp.ops, sp.block_end, k);
+}
+
+void genSpecExit(std::ostream& os, int32_t inst_addr, int32_t rcnt_add)
+{
+    // continue in the interpreter
+    if (rcnt_add)
+        os << "  addv rcnt " << rcnt_add << "\n";
+    os << "  movv m_inst_addr " << inst_addr << "\n";
+    os << "  jr @execute_loop\n";
+}
+
+// host address of a static guest operand, or jump to the interpreter's bounds error
+bool genSpecAddr(std::ostream& os, const SpecProgram& sp, int32_t arg, int32_t& ret_addr)
+{
+    ret_addr = wrapAdd(arg, sp.data_offs);
+    int32_t rd = wrapAdd(ret_addr, -sp.base_offs);
+    if (rd >= 0) {
+        rd = wrapAdd(rd, -sp.mem_size);
+        if (rd < 0)
+            return true;
+    }
+    os << "  movv rd " << rd << "\n";
+    os << "  jr @execute_error_bounds\n";
+    return false;
+}
+
+void genSpecVerifyAddr(std::ostream& os, const SpecProgram& sp, const char* reg)
+{
+    os << "  mov rd " << reg << "\n";
+    os << "  subv rd " << sp.base_offs << "\n";
+    os << "  jl @execute_error_bounds rd\n";
+    os << "  subv rd " << sp.mem_size << "\n";
+    os << "  jge @execute_error_bounds rd\n";
+}
+
+void genSpecStore(std::ostream& os, std::ostream& stubs, const SpecProgram& sp,
+    uint32_t k, const char* reg, GenOpInfo& info)
+{
+    // store to the address in reg is done, leave if it hit the guest code
+    info.next = true;
+    const int32_t code_size = static_cast<int32_t>(sp.ops.size()) * InstSize;
+    if (!code_size)
+        return;
+    os << "  mov rd " << reg << "\n";
+    os << "  subv rd " << (sp.data_offs - code_size) << "\n";
+    os << "  jl @spec_" << k << "_stored rd\n";
+    os << "  subv rd " << code_size << "\n";
+    os << "  jl @spec_" << k << "_code rd\n";
+    os << "  @spec_" << k << "_stored:\n";
+    stubs << " @spec_" << k << "_code:\n";
+    genSpecExit(stubs, getSpecInstAddr(sp, k + 1), getSpecCharge(sp, k) - 1);
+}
+
+void genSpecStore(std::ostream& os, const SpecProgram& sp, uint32_t k, int32_t addr, GenOpInfo& info)
+{
+    info.next = !isSpecCode(sp, addr);
+    if (!info.next)
+        genSpecExit(os, getSpecInstAddr(sp, k + 1), getSpecCharge(sp, k) - 1);
+}
+
+// jump by rel from instruction k, after the decision it's taken
+void genSpecJump(std::ostream& os, const SpecProgram& sp, uint32_t k, int32_t rel, GenOpInfo& info)
+{
+    if (rel % InstSize) {
+        os << "  movv rb " << rel << "\n";
+        os << "  jr @execute_error_jump\n";
+        return;
+    }
+    int32_t rb;
+    if (!genSpecAddr(os, sp, wrapAdd(rel, getSpecInstAddr(sp, k + 1) - sp.data_offs), rb))
+        return;
+    const int32_t inst_addr = wrapAdd(rb, InstSize);
+    const int64_t target = (static_cast<int64_t>(sp.data_offs) - inst_addr) / InstSize;
+    if (target >= 0 && target < static_cast<int64_t>(sp.ops.size())) {
+        info.targets.push_back(static_cast<uint32_t>(target));
+        os << "  jr @spec_" << target << "\n";
+        return;
+    }
+    genSpecExit(os, inst_addr, 0);
+}
+
+GenOpInfo genSpecOp(std::ostream& os, std::ostream& stubs, const SpecProgram& sp, uint32_t k)
+{
+    const Op& op = sp.ops[k];
+    const auto opcode_index = static_cast<uint32_t>(op.code);
+    const char* name = opcode_index < opcode_def.size() ? opcode_def[opcode_index].first.c_str() : codegen_error;
+    GenOpInfo info = {false, false, {}};
+    int32_t addr1, addr2;
+    switch(op.code) {
+    case OpCode::Nop:
+        info.next = true;
+        break;
+    case OpCode::Hlt:
+        os << "  jr @execute_loopend\n";
+        break;
+    case OpCode::Jr:
+        info.jump = true;
+        genSpecJump(os, sp, k, op.arg1, info);
+        break;
+    case OpCode::Ja:
+        info.jump = true;
+        if (!genSpecAddr(os, sp, op.arg1, addr1))
+            break;
+        os << "  mov rb " << addr1 << "\n";
+        os << "  addv rb 1\n";
+        os << "  mov rd rb\n";
+        os << "  divv rd 3\n";
+        os << "  mulv rd 3\n";
+        os << "  sub rd rb\n";
+        os << "  jnz @execute_error_jump rd\n";
+        os << "  addv rb " << (sp.data_offs - InstSize) << "\n";
+        genSpecVerifyAddr(os, sp, "rb");
+        os << "  addv rb 3\n";
+        os << "  jr @spec_dispatch\n";
+        break;
+    case OpCode::Jnz:
+    case OpCode::Jz:
+    case OpCode::Jg:
+    case OpCode::Jge:
+    case OpCode::Jl:
+    case OpCode::Jle:
+    {
+        info.jump = true;
+        if (!genSpecAddr(os, sp, op.arg2, addr2))
+            break;
+        std::ostringstream taken;
+        genSpecJump(taken, sp, k, op.arg1, info);
+        if (info.targets.empty()) {
+            os << "  " << name << " @spec_" << k << "_taken " << addr2 << "\n";
+            stubs << " @spec_" << k << "_taken:\n" << taken.str();
+        } else {
+            os << "  " << name << " @spec_" << info.targets.front() << " " << addr2 << "\n";
+        }
+        info.next = true;
+        break;
+    }
+    case OpCode::Lia:
+        if (!genSpecAddr(os, sp, op.arg1, addr1))
+            break;
+        os << "  movv " << addr1 << " " << wrapAdd(op.arg2, getSpecInstAddr(sp, k + 1) + 2 - sp.data_offs) << "\n";
+        genSpecStore(os, sp, k, addr1, info);
+        break;
+    case OpCode::Ld:
+        if (!genSpecAddr(os, sp, op.arg1, addr1) || !genSpecAddr(os, sp, op.arg2, addr2))
+            break;
+        os << "  mov rc " << addr2 << "\n";
+        os << "  addv rc " << sp.data_offs << "\n";
+        genSpecVerifyAddr(os, sp, "rc");
+        os << "  ld " << addr1 << " rc\n";
+        genSpecStore(os, sp, k, addr1, info);
+        break;
+    case OpCode::St:
+    case OpCode::Stv:
+        if (!genSpecAddr(os, sp, op.arg1, addr1))
+            break;
+        os << "  mov rb " << addr1 << "\n";
+        os << "  addv rb " << sp.data_offs << "\n";
+        genSpecVerifyAddr(os, sp, "rb");
+        if (op.code == OpCode::St) {
+            if (!genSpecAddr(os, sp, op.arg2, addr2))
+                break;
+            os << "  st rb " << addr2 << "\n";
+        } else {
+            os << "  stv rb " << op.arg2 << "\n";
+        }
+        genSpecStore(os, stubs, sp, k, "rb", info);
+        break;
+    case OpCode::Mov:
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+        if (!genSpecAddr(os, sp, op.arg1, addr1) || !genSpecAddr(os, sp, op.arg2, addr2))
+            break;
+        if (op.code == OpCode::Div)
+            os << "  jz @execute_error_divzero " << addr2 << "\n";
+        os << "  " << name << " " << addr1 << " " << addr2 << "\n";
+        genSpecStore(os, sp, k, addr1, info);
+        break;
+    case OpCode::Movv:
+    case OpCode::Addv:
+    case OpCode::Subv:
+    case OpCode::Mulv:
+    case OpCode::Divv:
+        if (!genSpecAddr(os, sp, op.arg1, addr1))
+            break;
+        if (op.code == OpCode::Divv && !op.arg2) {
+            os << "  jr @execute_error_divzero\n";
+            break;
+        }
+        os << "  " << name << " " << addr1 << " " << op.arg2 << "\n";
+        genSpecStore(os, sp, k, addr1, info);
+        break;
+    case OpCode::Dbg:
+        if (!genSpecAddr(os, sp, op.arg1, addr1))
+            break;
+        os << "  mov rb " << addr1 << "\n";
+        os << "  dbg rb\n";
+        info.next = true;
+        break;
+    case OpCode::Dbgext:
+        os << "  dbgext\n";
+        info.next = true;
+        break;
+    default:
+        os << "  jr @execute_error_opcode\n";
+        break;
+    }
+    return info;
+}
+
+void findBlocks(std::vector<bool>& leader, std::vector<uint32_t>& block_end, const std::vector<GenOpInfo>& infos)
+{
+    const auto count = static_cast<uint32_t>(infos.size());
+    leader.assign(count + 1, false);
+    leader[0] = true;
+    leader[count] = true;
+    for(uint32_t k = 0; k < count; ++k) {
+        if (!infos[k].next || infos[k].jump)
+            leader[k + 1] = true;
+        for(const auto target : infos[k].targets)
+            leader[target] = true;
+    }
+    block_end.assign(count, count);
+    for(uint32_t k = count; k > 0; --k)
+        block_end[k - 1] = leader[k] ? k : block_end[k];
+}
+
+void genSpecialisedProgram(std::ostream& os, SpecProgram& sp, const char* guest_file)
+{
+    const auto count = static_cast<uint32_t>(sp.ops.size());
+
+    // first pass finds basic blocks, second one emits code charging rcnt for them
+    std::vector<GenOpInfo> infos;
+    sp.leader.clear();
+    sp.block_end.clear();
+    for(uint32_t k = 0; k < count; ++k) {
+        std::ostringstream code, stubs;
+        infos.push_back(genSpecOp(code, stubs, sp, k));
+    }
+    findBlocks(sp.leader, sp.block_end, infos);
+
+    genExecuteHeader(os);
+
+    os << "% execute_program specialised to " << guest_file << "\n";
+    os << "% for m_base_offs = " << sp.base_offs << ", m_data_offs = " << sp.data_offs
+       << ", m_mem_size = " << sp.mem_size << "\n";
+    os << "% (vm-gen --specialize). Arguments and results are the same as\n"
+          "% for @execute_generic below, which runs when called with other\n"
+          "% arguments or code, and takes over when the guest code modifies\n"
+          "% itself, jumps out of it or gets close to the execution limit.\n";
+    os << "@execute_program:\n";
+    os << " mov rd m_base_offs\n";
+    os << " subv rd " << sp.base_offs << "\n";
+    os << " jnz @execute_generic rd\n";
+    os << " mov rd m_data_offs\n";
+    os << " subv rd " << sp.data_offs << "\n";
+    os << " jnz @execute_generic rd\n";
+    os << " mov rd m_mem_size\n";
+    os << " subv rd " << sp.mem_size << "\n";
+    os << " jnz @execute_generic rd\n";
+    os << "\n % guest code\n";
+    for(uint32_t k = 0; k < count; ++k) {
+        const Op& op = sp.ops[k];
+        const int32_t words[] = { static_cast<int32_t>(op.code), op.arg1, op.arg2 };
+        for(int32_t i = 0; i < InstSize; ++i) {
+            os << " mov rd " << (getSpecInstAddr(sp, k) - 1 - i) << "\n";
+            os << " subv rd " << words[i] << "\n";
+            os << " jnz @execute_generic rd\n";
+        }
+    }
+    os << "\n movv rcnt " << execute_limit << " % execution limit\n";
+
+    std::ostringstream stubs;
+    for(uint32_t k = 0; k < count; ++k) {
+        const Op& op = sp.ops[k];
+        const auto opcode_index = static_cast<uint32_t>(op.code);
+        os << "\n % " << k << ": "
+           << (opcode_index < opcode_def.size() ? opcode_def[opcode_index].first.c_str() : "invalid")
+           << " " << op.arg1 << " " << op.arg2 << "\n";
+        const int32_t charge = getSpecCharge(sp, k);
+        if (sp.leader[k]) {
+            os << " @spec_" << k << ":\n";
+            if (charge > 0) {
+                os << "  subv rcnt " << charge << "\n";
+                os << "  jle @spec_" << k << "_limit rcnt\n";
+            }
+        } else {
+            // entry from ja into the middle of a block
+            stubs << " @spec_" << k << ":\n";
+            if (charge > 0) {
+                stubs << "  subv rcnt " << charge << "\n";
+                stubs << "  jle @spec_" << k << "_limit rcnt\n";
+            }
+            stubs << "  jr @spec_" << k << "_body\n";
+            os << " @spec_" << k << "_body:\n";
+        }
+        if (charge > 0) {
+            stubs << " @spec_" << k << "_limit:\n";
+            genSpecExit(stubs, getSpecInstAddr(sp, k), charge);
+        }
+        genSpecOp(os, stubs, sp, k);
+    }
+    if (!count || infos.back().next) {
+        os << "\n % end of guest code\n";
+        genSpecExit(os, getSpecInstAddr(sp, count), 0);
+    }
+
+    os << "\n % ja: rb = m_inst_addr of the target\n";
+    os << " @spec_dispatch:\n";
+    os << "  mov rc rb\n";
+    os << "  subv rc " << sp.data_offs << "\n";
+    os << "  jg @spec_dispatch_exit rc\n";
+    os << "  mov rd rc\n";
+    os << "  addv rd " << (static_cast<int32_t>(count) * InstSize) << "\n";
+    os << "  jle @spec_dispatch_exit rd\n";
+    os << "  lia rd @spec_table 0\n";
+    os << "  add rd rc\n";
+    os << "  ja rd\n";
+    os << " @spec_dispatch_exit:\n";
+    os << "  mov m_inst_addr rb\n";
+    os << "  jr @execute_loop\n";
+    os << " @spec_table:\n";
+    for(uint32_t k = 0; k < count; ++k)
+        os << "  jr @spec_" << k << "\n";
+
+    os << "\n" << stubs.str() << "\n";
+
+    genExecuteLoop(os, "@execute_generic");
+    os << autogen_end;
+}
+
+bool genSpecialisedProgram(const char* file_path, const char* guest_path,
+    int32_t base_offs, int32_t data_offs, int32_t mem_size)
+{
+    // guest programs are included after execute_program.code and use its registers
+    std::vector<std::pair<std::string, int32_t>> defs;
+    for(size_t i = 0; i < execute_regs.size(); ++i)
+        defs.emplace_back(execute_regs[i], static_cast<int32_t>(i));
+    SpecProgram sp;
+    CompileError error;
+    if (!readAndCompile(sp.ops, guest_path, defs, error)) {
+        std::cout << describeCompileError(error) << std::endl;
+        return false;
+    }
+    const int64_t code_size = static_cast<int64_t>(sp.ops.size()) * InstSize;
+    if (base_offs < static_cast<int32_t>(execute_regs.size()) || mem_size <= 0 ||
+        data_offs - code_size < base_offs || data_offs > static_cast<int64_t>(base_offs) + mem_size) {
+        std::cout << "guest code doesn't fit the machine window" << std::endl;
+        return false;
+    }
+    sp.base_offs = base_offs;
+    sp.data_offs = data_offs;
+    sp.mem_size = mem_size;
+
+    std::ofstream fp;
+    fp.open(file_path);
+    if (!fp)
+        return false;
+    std::string guest_file = guest_path;
+    guest_file.erase(0, guest_file.find_last_of("/\\") + 1);
+    genSpecialisedProgram(fp, sp, guest_file.c_str());
+    return true;
+}
+
+/*
+* Ahead-of-time translation to C++
+*
+* vm-gen --emit-cpp writes a translation unit which runs a program the way
+* vm does. Every instruction becomes a labelled statement on machine
+* memory with its operands resolved and checked at generation time, jumps
+* with static targets become gotos and ja goes through a switch over the
+* program's instructions.
+*
+* Cycles are charged per basic block, which is entered only when it can't
+* reach the cycle limit. Running into the limit, stores into the program
+* code and jumps out of it hand the machine over to execute() (the
+* reference interpreter from vm-machine.h), which runs it to the end, so
+* output and cycle counts are the same as of vm.
+*/
+
+struct CppProgram
+{
+    std::vector<Op> ops;
+    int32_t data_offset;
+    int32_t mem_size;
+    bool has_ja;
+    std::vector<bool> leader;
+    std::vector<uint32_t> block_end;
+};
+
+// execute()'s inst_addr of instruction k
+inline int32_t getCppInstAddr(const CppProgram& cp, int64_t k)
+{
+    return static_cast<int32_t>(cp.data_offset - (k + 1) * InstSize);
+}
+
+inline bool getCppAddr(const CppProgram& cp, int32_t arg, uint32_t& ret_addr)
+{
+    ret_addr = static_cast<uint32_t>(wrapAdd(arg, cp.data_offset));
+    return ret_addr < static_cast<uint32_t>(cp.mem_size);
+}
+
+inline bool isCppCode(const CppProgram& cp, uint32_t addr)
+{
+    return addr < static_cast<uint32_t>(cp.data_offset) &&
+        addr >= static_cast<uint32_t>(getCppInstAddr(cp, static_cast<int64_t>(cp.ops.size()) - 1));
+}
+
+void genCppFault(std::ostream& os, const CppProgram& cp, uint32_t k, const char* result)
+{
+    os << "    VM_FAULT(" << result << ", " << getCppInstAddr(cp, k) << ", "
+       << getBlockCharge(cp.ops, cp.block_end, k) << ")\n";
+}
+
+void genCppLeave(std::ostream& os, int32_t inst_addr, int32_t cycles_left)
+{
+    os << "    VM_LEAVE(" << (inst_addr + InstSize) << ", " << cycles_left << ")\n";
+}
+
+// jump by rel from instruction k, after the decision it's taken
+void genCppJump(std::ostream& os, const CppProgram& cp, uint32_t k, int32_t rel, GenOpInfo& info)
+{
+    const int32_t inst_addr = getCppInstAddr(cp, k);
+    const int32_t target_addr = wrapAdd(inst_addr, rel);
+    if ((rel % InstSize) != 0 || target_addr < 0 || target_addr >= cp.mem_size) {
+        genCppFault(os, cp, k, "InvalidJumpAddr");
+        return;
+    }
+    const int64_t target = k - rel / InstSize;
+    if (target >= 0 && target < static_cast<int64_t>(cp.ops.size())) {
+        info.targets.push_back(static_cast<uint32_t>(target));
+        os << "    goto vm_" << target << ";\n";
+        return;
+    }
+    genCppLeave(os, target_addr, 0);
+}
+
+void genCppStore(std::ostream& os, const CppProgram& cp, uint32_t k, uint32_t addr, GenOpInfo& info)
+{
+    info.next = !isCppCode(cp, addr);
+    if (!info.next)
+        genCppLeave(os, getCppInstAddr(cp, k + 1), getBlockCharge(cp.ops, cp.block_end, k) - 1);
+}
+
+GenOpInfo genCppOp(std::ostream& os, const CppProgram& cp, uint32_t k)
+{
+    const Op& op = cp.ops[k];
+    GenOpInfo info = {false, false, {}};
+    const int32_t charge = getBlockCharge(cp.ops, cp.block_end, k);
+    const auto code_size = static_cast<uint32_t>(cp.ops.size()) * InstSize;
+    uint32_t addr1, addr2;
+    switch(op.code) {
+    case OpCode::Nop:
+        info.next = true;
+        break;
+    case OpCode::Hlt:
+        os << "    VM_HALT(" << getCppInstAddr(cp, k) << ", " << charge << ")\n";
+        break;
+    case OpCode::Jr:
+        info.jump = true;
+        genCppJump(os, cp, k, op.arg1, info);
+        break;
+    case OpCode::Ja:
+        info.jump = true;
+        if (!getCppAddr(cp, op.arg1, addr1)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        os << "    rel_addr = vmAdd(mem[" << addr1 << "], 1);\n";
+        os << "    if ((rel_addr % InstSize) != 0)\n";
+        os << "    ";
+        genCppFault(os, cp, k, "InvalidJumpAddr");
+        os << "    target_addr = vmAdd(" << (cp.data_offset - InstSize) << ", rel_addr);\n";
+        os << "    if (target_addr < 0 || target_addr >= " << cp.mem_size << ")\n";
+        os << "    ";
+        genCppFault(os, cp, k, "InvalidJumpAddr");
+        os << "    goto vm_dispatch;\n";
+        break;
+    case OpCode::Jnz:
+    case OpCode::Jz:
+    case OpCode::Jg:
+    case OpCode::Jge:
+    case OpCode::Jl:
+    case OpCode::Jle:
+    {
+        info.jump = true;
+        info.next = true;
+        if (!getCppAddr(cp, op.arg2, addr2)) {
+            info.next = false;
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        const char* cond = "";
+        switch(op.code) {
+        case OpCode::Jnz: cond = " != 0"; break;
+        case OpCode::Jz: cond = " == 0"; break;
+        case OpCode::Jg: cond = " > 0"; break;
+        case OpCode::Jge: cond = " >= 0"; break;
+        case OpCode::Jl: cond = " < 0"; break;
+        default: cond = " <= 0"; break;
+        }
+        os << "    if (mem[" << addr2 << "]" << cond << ")\n";
+        os << "    ";
+        genCppJump(os, cp, k, op.arg1, info);
+        break;
+    }
+    case OpCode::Lia:
+        if (!getCppAddr(cp, op.arg1, addr1)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        os << "    mem[" << addr1 << "] = "
+           << wrapAdd(getCppInstAddr(cp, k) + InstSize - 1 - cp.data_offset, op.arg2) << ";\n";
+        genCppStore(os, cp, k, addr1, info);
+        break;
+    case OpCode::Ld:
+        if (!getCppAddr(cp, op.arg1, addr1) || !getCppAddr(cp, op.arg2, addr2)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        os << "    addr = static_cast<uint32_t>(mem[" << addr2 << "]) + " << cp.data_offset << "u;\n";
+        os << "    if (addr >= " << cp.mem_size << "u)\n";
+        os << "    ";
+        genCppFault(os, cp, k, "InvalidDataAddr");
+        os << "    mem[" << addr1 << "] = mem[addr];\n";
+        genCppStore(os, cp, k, addr1, info);
+        break;
+    case OpCode::St:
+    case OpCode::Stv:
+        if (!getCppAddr(cp, op.arg1, addr1)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        os << "    addr = static_cast<uint32_t>(mem[" << addr1 << "]) + " << cp.data_offset << "u;\n";
+        os << "    if (addr >= " << cp.mem_size << "u)\n";
+        os << "    ";
+        genCppFault(os, cp, k, "InvalidDataAddr");
+        if (op.code == OpCode::St) {
+            if (!getCppAddr(cp, op.arg2, addr2)) {
+                genCppFault(os, cp, k, "InvalidDataAddr");
+                break;
+            }
+            os << "    mem[addr] = mem[" << addr2 << "];\n";
+        } else {
+            os << "    mem[addr] = " << op.arg2 << ";\n";
+        }
+        info.next = true;
+        if (code_size) {
+            os << "    if (addr - " << getCppInstAddr(cp, static_cast<int64_t>(cp.ops.size()) - 1)
+               << "u < " << code_size << "u)\n";
+            os << "    ";
+            genCppLeave(os, getCppInstAddr(cp, k + 1), charge - 1);
+        }
+        break;
+    case OpCode::Mov:
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+        if (!getCppAddr(cp, op.arg1, addr1) || !getCppAddr(cp, op.arg2, addr2)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        if (op.code == OpCode::Mov) {
+            os << "    mem[" << addr1 << "] = mem[" << addr2 << "];\n";
+        } else if (op.code == OpCode::Div) {
+            os << "    if (!mem[" << addr2 << "])\n";
+            os << "    ";
+            genCppFault(os, cp, k, "DivByZero");
+            os << "    mem[" << addr1 << "] /= mem[" << addr2 << "];\n";
+        } else {
+            const char* func = op.code == OpCode::Add ? "vmAdd" : op.code == OpCode::Sub ? "vmSub" : "vmMul";
+            os << "    mem[" << addr1 << "] = " << func << "(mem[" << addr1 << "], mem[" << addr2 << "]);\n";
+        }
+        genCppStore(os, cp, k, addr1, info);
+        break;
+    case OpCode::Movv:
+    case OpCode::Addv:
+    case OpCode::Subv:
+    case OpCode::Mulv:
+    case OpCode::Divv:
+        if (!getCppAddr(cp, op.arg1, addr1)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        if (op.code == OpCode::Movv) {
+            os << "    mem[" << addr1 << "] = " << op.arg2 << ";\n";
+        } else if (op.code == OpCode::Divv) {
+            if (!op.arg2) {
+                genCppFault(os, cp, k, "DivByZero");
+                break;
+            }
+            os << "    mem[" << addr1 << "] /= " << op.arg2 << ";\n";
+        } else {
+            const char* func = op.code == OpCode::Addv ? "vmAdd" : op.code == OpCode::Subv ? "vmSub" : "vmMul";
+            os << "    mem[" << addr1 << "] = " << func << "(mem[" << addr1 << "], " << op.arg2 << ");\n";
+        }
+        genCppStore(os, cp, k, addr1, info);
+        break;
+    case OpCode::Dbg:
+        if (!getCppAddr(cp, op.arg1, addr1)) {
+            genCppFault(os, cp, k, "InvalidDataAddr");
+            break;
+        }
+        os << "    m.output->dbg(" << addr1 << ", " << op.arg1 << ", mem[" << addr1 << "]);\n";
+        info.next = true;
+        break;
+    case OpCode::Dbgext:
+        os << "    VM_DBGEXT(" << charge << ")\n";
+        info.next = true;
+        break;
+    default:
+        genCppFault(os, cp, k, "InvalidOpCode");
+        break;
+    }
+    return info;
+}
+
+void genCppProgram(std::ostream& os, CppProgram& cp, const char* code_file)
+{
+    const auto count = static_cast<uint32_t>(cp.ops.size());
+    cp.has_ja = false;
+    for(const auto& op : cp.ops)
+        cp.has_ja |= op.code == OpCode::Ja;
+
+    // first pass finds basic blocks, second one emits code charging cycles for them
+    std::vector<GenOpInfo> infos;
+    cp.leader.clear();
+    cp.block_end.clear();
+    for(uint32_t k = 0; k < count; ++k) {
+        std::ostringstream code;
+        infos.push_back(genCppOp(code, cp, k));
+    }
+    findBlocks(cp.leader, cp.block_end, infos);
+    std::vector<bool> jump_target(count + 1, false);
+    for(const auto& info : infos)
+        for(const auto target : info.targets)
+            jump_target[target] = true;
+
+    os << "// " << code_file << " translated to C++ by vm-gen --emit-cpp, do not edit.\n";
+    os << "// Build with the self-vm sources on the include path, e.g.\n";
+    os << "// c++ -std=c++14 -O2 -I <self-vm> <this file>\n\n";
+    os << "#include <iostream>\n#include <iterator>\n#include <vector>\n#include <cstdint>\n\n";
+    os << "#include \"vm.h\"\n#include \"vm-machine.h\"\n\n";
+
+    os << "const static Op program[] = {\n";
+    for(const auto& op : cp.ops) {
+        const auto opcode_index = static_cast<uint32_t>(op.code);
+        os << "    { ";
+        if (opcode_index < opcode_def.size()) {
+            std::string name = opcode_def[opcode_index].first;
+            name[0] = static_cast<char>(toupper(name[0]));
+            os << "OpCode::" << name;
+        } else {
+            os << "static_cast<OpCode>(" << opcode_index << ")";
+        }
+        os << ", " << op.arg1 << ", " << op.arg2 << " },\n";
+    }
+    if (!count)
+        os << "    { OpCode::Hlt, 0, 0 },\n"; // not reached, keeps the array non-empty
+    os << "};\n\n";
+
+    os << "inline int32_t vmAdd(int32_t a, int32_t b) { return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }\n";
+    os << "inline int32_t vmSub(int32_t a, int32_t b) { return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)); }\n";
+    os << "inline int32_t vmMul(int32_t a, int32_t b) { return static_cast<int32_t>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b)); }\n\n";
+
+    os << "// Runs the program until it ends, or returns Result::Continue\n";
+    os << "// with the machine ready for execute().\n";
+    os << "Result runProgram(Machine& m)\n{\n";
+    os << "    #define VM_FAULT(res, at, left) { \\\n"
+          "        m.inst_addr = at; \\\n"
+          "        m.cycles = cycles - (left); \\\n"
+          "        return Result::res; \\\n"
+          "    }\n";
+    os << "    #define VM_HALT(at, left) VM_FAULT(Halt, at, left)\n";
+    os << "    #define VM_LEAVE(at, left) { \\\n"
+          "        m.inst_addr = at; \\\n"
+          "        m.cycles = cycles - (left); \\\n"
+          "        return Result::Continue; \\\n"
+          "    }\n";
+    os << "    #define VM_BLOCK(at, block_cycles) \\\n"
+          "        if (cycles >= max_cycles - (block_cycles)) \\\n"
+          "            VM_LEAVE(at, 0) \\\n"
+          "        cycles += block_cycles;\n";
+    os << "    #define VM_DBGEXT(left) \\\n"
+          "        writeDbgext(m, cycles - (left));\n\n";
+    os << "    int32_t* const mem = m.mem.data();\n";
+    os << "    int64_t cycles = m.cycles;\n";
+    os << "    const int64_t max_cycles = m.max_cycles;\n";
+    os << "    uint32_t addr;\n";
+    os << "    int32_t rel_addr, target_addr;\n";
+    os << "    (void)addr; (void)rel_addr; (void)target_addr;\n";
+    os << "    if (m.inst_addr != " << (getCppInstAddr(cp, 0) + InstSize) << ")\n";
+    os << "        return Result::Continue;\n";
+
+    std::ostringstream entries;
+    for(uint32_t k = 0; k < count; ++k) {
+        const Op& op = cp.ops[k];
+        const auto opcode_index = static_cast<uint32_t>(op.code);
+        os << "\n    // " << k << ": "
+           << (opcode_index < opcode_def.size() ? opcode_def[opcode_index].first.c_str() : "invalid")
+           << " " << op.arg1 << " " << op.arg2 << "\n";
+        const int32_t charge = getBlockCharge(cp.ops, cp.block_end, k);
+        const int32_t inst_addr = getCppInstAddr(cp, k) + InstSize;
+        if (cp.leader[k]) {
+            if (jump_target[k] || cp.has_ja)
+                os << "vm_" << k << ":\n";
+            if (charge > 0)
+                os << "    VM_BLOCK(" << inst_addr << ", " << charge << ")\n";
+        } else if (cp.has_ja) {
+            // entry from ja into the middle of a block
+            os << "vm_" << k << "_body:\n";
+            entries << "vm_" << k << ":\n";
+            if (charge > 0)
+                entries << "    VM_BLOCK(" << inst_addr << ", " << charge << ")\n";
+            entries << "    goto vm_" << k << "_body;\n";
+        }
+        genCppOp(os, cp, k);
+    }
+    if (!count || infos.back().next) {
+        os << "\n    // end of program code\n";
+        genCppLeave(os, getCppInstAddr(cp, count), 0);
+    }
+    if (cp.has_ja) {
+        os << "\nvm_dispatch:\n";
+        os << "    switch(target_addr) {\n";
+        for(uint32_t k = 0; k < count; ++k)
+            os << "    case " << getCppInstAddr(cp, k) << ": goto vm_" << k << ";\n";
+        os << "    default: break;\n";
+        os << "    }\n";
+        os << "    VM_LEAVE(target_addr + InstSize, 0)\n";
+        os << "\n" << entries.str();
+    }
+    os << "\n    #undef VM_DBGEXT\n";
+    os << "    #undef VM_BLOCK\n";
+    os << "    #undef VM_LEAVE\n";
+    os << "    #undef VM_HALT\n";
+    os << "    #undef VM_FAULT\n";
+    os << "}\n\n";
+
+    os << "int main()\n{\n";
+    os << "    Machine m;\n";
+    os << "    if (!resetMachine(m, std::vector<Op>(std::begin(program), std::begin(program) + " << count << "))) {\n";
+    os << "        std::cout << \"program doesn't fit the code space, or memory exceeds int32 addresses\" << std::endl;\n";
+    os << "        return -1;\n";
+    os << "    }\n";
+    os << "    Result res = runProgram(m);\n";
+    os << "    while(res == Result::Continue)\n";
+    os << "        res = execute(m);\n";
+    os << "    dumpMachine(m, 128, 32);\n";
+    os << "    std::cout << getResult(res) << std::endl;\n";
+    os << "    return 0;\n";
+    os << "}\n";
+}
+
+bool genCppProgram(const char* file_path, const char* code_path)
+{
+    CppProgram cp;
+    CompileError error;
+    if (!readAndCompile(cp.ops, code_path, error)) {
+        std::cout << describeCompileError(error) << std::endl;
+        return false;
+    }
+    // same memory layout as vm
+    if (!getMachineLayout(cp.ops.size(), DefaultLayout, cp.data_offset, cp.mem_size)) {
+        std::cout << "program doesn't fit the code space, or memory exceeds int32 addresses" << std::endl;
+        return false;
+    }
+
+    std::ofstream fp;
+    fp.open(file_path);
+    if (!fp)
+        return false;
+    std::string code_file = code_path;
+    code_file.erase(0, code_file.find_last_of("/\\") + 1);
+    genCppProgram(fp, cp, code_file.c_str());
+    return true;
+}
+
+std::string cppString(const std::string& text)
+{
+    std::string ret = "\"";
+    for(const char ch : text) {
+        if (ch == '"' || ch == '\\')
+            ret += '\\';
+        ret += ch;
+    }
+    return ret + "\"";
+}
+
+// arrays hold a dummy element when empty, begin() + count is the end
+template<typename T, typename Emit>
+void genUnitArray(std::ostream& os, const char* type, const char* name, const std::vector<T>& v, Emit emit)
+{
+    os << "constexpr size_t " << name << "_count = " << v.size() << ";\n";
+    os << "constexpr " << type << " " << name << "[] = {\n";
+    for(const auto& e : v) {
+        os << "    ";
+        emit(e);
+        os << ",\n";
+    }
+    if (v.empty()) {
+        os << "    {},\n";
+    }
+    os << "};\n\n";
+}
+
+void genUnitHeader(std::ostream& os, const AsmUnit& unit, const std::string& name)
+{
+    os << "// " << unit.file << " compiled to an assembler unit by vm-gen --emit-unit, do not edit.\n";
+    os << "// Registered with registerUnit(&" << name << "::get()), includes of the same\n";
+    os << "// file link it instead of compiling the text while the text hash matches.\n\n";
+    os << "#pragma once\n\n#include <iterator>\n#include <string>\n#include <vector>\n#include <cstdint>\n\n";
+    os << "#include \"vm.h\"\n#include \"vm-asm.h\"\n\n";
+    os << "namespace " << name << "\n{\n\n";
+    os << "struct Symbol\n{\n    const char* name;\n    int32_t value;\n};\n\n";
+    genUnitArray(os, "Op", "ops", unit.ops, [&os](const Op& op) {
+        os << "{ static_cast<OpCode>(" << static_cast<int32_t>(op.code) << "), " << op.arg1 << ", " << op.arg2 << " }";
+    });
+    genUnitArray(os, "uint32_t", "lines", unit.lines, [&os](uint32_t line) { os << line; });
+    auto emit_symbol = [&os](const std::pair<std::string, int32_t>& s) {
+        os << "{ " << cppString(s.first) << ", " << s.second << " }";
+    };
+    genUnitArray(os, "Symbol", "labels", unit.labels, emit_symbol);
+    genUnitArray(os, "Symbol", "consts", unit.consts, emit_symbol);
+    genUnitArray(os, "const char*", "names", unit.names, [&os](const std::string& n) { os << cppString(n); });
+    genUnitArray(os, "AsmFixup", "fixups", unit.fixups, [&os](const AsmFixup& f) {
+        os << "{ " << f.inst << ", static_cast<FixupKind>(" << static_cast<uint32_t>(f.kind) << "), " << f.name << " }";
+    });
+    os << "inline const AsmUnit& get()\n{\n";
+    os << "    static const AsmUnit unit = []() {\n";
+    os << "        AsmUnit u;\n";
+    os << "        u.file = " << cppString(unit.file) << ";\n";
+    os << "        u.hash = " << unit.hash << "ull;\n";
+    os << "        u.ops.assign(std::begin(ops), std::begin(ops) + ops_count);\n";
+    os << "        u.lines.assign(std::begin(lines), std::begin(lines) + lines_count);\n";
+    os << "        for(size_t i = 0; i < labels_count; ++i)\n";
+    os << "            u.labels.push_back({labels[i].name, labels[i].value});\n";
+    os << "        for(size_t i = 0; i < consts_count; ++i)\n";
+    os << "            u.consts.push_back({consts[i].name, consts[i].value});\n";
+    os << "        u.sets_last_const = " << (unit.sets_last_const ? "true" : "false") << ";\n";
+    os << "        u.last_const = " << unit.last_const << ";\n";
+    os << "        u.names.assign(std::begin(names), std::begin(names) + names_count);\n";
+    os << "        u.fixups.assign(std::begin(fixups), std::begin(fixups) + fixups_count);\n";
+    os << "        return u;\n";
+    os << "    }();\n";
+    os << "    return unit;\n";
+    os << "}\n\n";
+    os << "}\n";
+}
+
+bool genUnitHeader(const char* file_path, const char* code_path)
+{
+    AsmUnit unit;
+    CompileError error;
+    if (!compileUnit(unit, code_path, error)) {
+        std::cout << describeCompileError(error) << std::endl;
+        return false;
+    }
+    // namespace named after the file: unit_execute_program for execute_program.code
+    std::string name = "unit_" + unit.file.substr(0, unit.file.find('.'));
+    for(auto& ch : name) {
+        if (!isalnum(static_cast<unsigned char>(ch)))
+            ch = '_';
+    }
+
+    std::ofstream fp;
+    fp.open(file_path);
+    if (!fp)
+        return false;
+    genUnitHeader(fp, unit, name);
+    return true;
+}
+
 int main(int argc, char** argv)
 {
-    if (argc < 2) {
-        std::cout << "usage: vm-gen <output text file>" << std::endl;
+    const char* guest_path = nullptr;
+    const char* cpp_code_path = nullptr;
+    const char* unit_code_path = nullptr;
+    // window of the nested machines in recursive_interpreter.code
+    int32_t base_offs = 10000;
+    int32_t data_offs = 19998;
+    int32_t mem_size = 100000;
+    int arg_index = 1;
+    for(; arg_index < argc && argv[arg_index][0] == '-'; ++arg_index) {
+        const std::string opt = argv[arg_index];
+        if (opt == "--specialize" && arg_index + 1 < argc) {
+            guest_path = argv[++arg_index];
+        } else if (opt == "--emit-cpp" && arg_index + 1 < argc) {
+            cpp_code_path = argv[++arg_index];
+        } else if (opt == "--emit-unit" && arg_index + 1 < argc) {
+            unit_code_path = argv[++arg_index];
+        } else if (opt == "--window" && arg_index + 3 < argc) {
+            base_offs = std::atoi(argv[++arg_index]);
+            data_offs = std::atoi(argv[++arg_index]);
+            mem_size = std::atoi(argv[++arg_index]);
+        } else {
+            std::cout << "unknown option " << opt << std::endl;
+            return -1;
+        }
+    }
+    if (arg_index + 1 != argc) {
+        std::cout << "usage: vm-gen [--specialize <guest code file> [--window <base> <data> <size>]]"
+            " [--emit-cpp <code file>] [--emit-unit <code file>] <output text file>" << std::endl;
         return -1;
     }
-    if (!genExecuteProgram(argv[1])) {
+    if (cpp_code_path) {
+        if (!genCppProgram(argv[arg_index], cpp_code_path))
+            return -1;
+        return 0;
+    }
+    if (unit_code_path) {
+        if (!genUnitHeader(argv[arg_index], unit_code_path))
+            return -1;
+        return 0;
+    }
+    if (guest_path) {
+        if (!genSpecialisedProgram(argv[arg_index], guest_path, base_offs, data_offs, mem_size))
+            return -1;
+        return 0;
+    }
+    if (!genExecuteProgram(argv[arg_index])) {
         return -1;
     }
     return 0;
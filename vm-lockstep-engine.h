@@ -0,0 +1,479 @@
+// VM lock-step engine
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// No include guard: selfvm.cpp includes this once per instruction set,
+// each time in a namespace of its own defining Lanes and VM_LOCKSTEP_ISA
+// (VM_LOCKSTEP_SSE2, AVX2 or AVX512, 0 for plain vector extensions) and
+// under a target pragma, so every instruction set has its own functions
+// and none is shared with code compiled for another.
+//
+// A LockstepMachine holds Lanes machines running one program, word w of
+// lane l at mem[w * Lanes + l], so the words an instruction with direct
+// operands uses are one vector in every lane. The lanes at the highest
+// instruction address (the earliest in program order, which lanes
+// leaving a loop or skipping code wait at) run as a group while they
+// fetch the same instruction: arithmetic is a vector operation stored
+// for the lanes of the group, ld and st gather and scatter (AVX2 has no
+// scatter), dbg goes lane by lane. Lanes fetching the same address are
+// only compared for different code once something was stored below
+// data_offset. A conditional jump taken by some lanes or ja to
+// different targets splits the group, and lanes join
+// again when they reach the same address. Results, cycles and output of
+// every lane are those of the reference engine.
+
+typedef int32_t LaneInts __attribute__((vector_size(Lanes * sizeof(int32_t))));
+typedef uint32_t LaneWords __attribute__((vector_size(Lanes * sizeof(int32_t))));
+typedef uint32_t LaneMask; // bit per lane
+
+inline LaneInts loadRow(const int32_t* row)
+{
+    LaneInts v;
+    memcpy(&v, row, sizeof(v));
+    return v;
+}
+
+// the lanes of active, mask is the same as a vector of all ones or zeros
+// per lane
+inline void storeRow(int32_t* row, LaneInts v, LaneMask active, LaneInts mask)
+{
+    if (active == (1u << (Lanes - 1) << 1) - 1) {
+        memcpy(row, &v, sizeof(v));
+        return;
+    }
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512
+    static_cast<void>(mask);
+    _mm512_mask_storeu_epi32(row, static_cast<__mmask16>(active), reinterpret_cast<__m512i>(v));
+#else
+    static_cast<void>(active);
+    const LaneInts prev = loadRow(row);
+    v = (v & mask) | (prev & ~mask);
+    memcpy(row, &v, sizeof(v));
+#endif
+}
+
+inline LaneInts getMaskVector(LaneMask mask)
+{
+    LaneInts v;
+    for(uint32_t l = 0; l < Lanes; ++l)
+        v[l] = (mask >> l & 1) ? -1 : 0;
+    return v;
+}
+
+// lanes where v (a comparison) is true
+inline LaneMask getMaskBits(LaneInts v)
+{
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512
+    return _mm512_test_epi32_mask(reinterpret_cast<__m512i>(v), reinterpret_cast<__m512i>(v));
+#elif VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX2
+    return static_cast<LaneMask>(_mm256_movemask_ps(_mm256_castsi256_ps(reinterpret_cast<__m256i>(v))));
+#elif VM_LOCKSTEP_ISA == VM_LOCKSTEP_SSE2
+    return static_cast<LaneMask>(_mm_movemask_ps(_mm_castsi128_ps(reinterpret_cast<__m128i>(v))));
+#else
+    LaneMask mask = 0;
+    for(uint32_t l = 0; l < Lanes; ++l)
+        mask |= static_cast<LaneMask>(v[l] != 0) << l;
+    return mask;
+#endif
+}
+
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512 || VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX2
+// lanes divided at once, as many doubles as fill a vector register
+constexpr uint32_t DivideLanes = VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512 ? 8 : 4;
+typedef int32_t DivideInts __attribute__((vector_size(DivideLanes * sizeof(int32_t))));
+typedef double DivideDoubles __attribute__((vector_size(DivideLanes * sizeof(double))));
+#endif
+
+// a / d truncated like int32 division, d nonzero; AVX divides in doubles,
+// which hold int32s exactly, and the rounding error of the quotient is
+// below the distance 1 / |d| of an inexact quotient to the next integer
+inline LaneInts divideLanes(LaneInts a, LaneInts d)
+{
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512 || VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX2
+    LaneInts q;
+    for(uint32_t l = 0; l < Lanes; l += DivideLanes) {
+        DivideInts x, y;
+        memcpy(&x, reinterpret_cast<const int32_t*>(&a) + l, sizeof(x));
+        memcpy(&y, reinterpret_cast<const int32_t*>(&d) + l, sizeof(y));
+        const DivideInts r = __builtin_convertvector(__builtin_convertvector(x, DivideDoubles) /
+            __builtin_convertvector(y, DivideDoubles), DivideInts);
+        memcpy(reinterpret_cast<int32_t*>(&q) + l, &r, sizeof(r));
+    }
+    return q;
+#else
+    return a / d;
+#endif
+}
+
+// word index of every lane's word at its address
+inline LaneInts getLaneIndex(LaneWords addr)
+{
+    LaneInts index = reinterpret_cast<LaneInts>(addr * Lanes);
+    for(uint32_t l = 0; l < Lanes; ++l)
+        index[l] += static_cast<int32_t>(l);
+    return index;
+}
+
+inline LaneInts gatherLanes(const int32_t* mem, LaneWords addr, LaneMask active, LaneInts mask)
+{
+    const LaneInts index = getLaneIndex(addr);
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512
+    static_cast<void>(mask);
+    return reinterpret_cast<LaneInts>(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(),
+        static_cast<__mmask16>(active), reinterpret_cast<__m512i>(index), mem, 4));
+#elif VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX2
+    static_cast<void>(active);
+    return reinterpret_cast<LaneInts>(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+        mem, reinterpret_cast<__m256i>(index), reinterpret_cast<__m256i>(mask), 4));
+#else
+    static_cast<void>(mask);
+    LaneInts v = {};
+    for(uint32_t l = 0; l < Lanes; ++l) {
+        if (active >> l & 1)
+            v[l] = mem[static_cast<uint32_t>(index[l])];
+    }
+    return v;
+#endif
+}
+
+inline void scatterLanes(int32_t* mem, LaneWords addr, LaneInts v, LaneMask active)
+{
+    const LaneInts index = getLaneIndex(addr);
+#if VM_LOCKSTEP_ISA == VM_LOCKSTEP_AVX512
+    _mm512_mask_i32scatter_epi32(mem, static_cast<__mmask16>(active), reinterpret_cast<__m512i>(index),
+        reinterpret_cast<__m512i>(v), 4);
+#else
+    for(uint32_t l = 0; l < Lanes; ++l) {
+        if (active >> l & 1)
+            mem[static_cast<uint32_t>(index[l])] = v[l];
+    }
+#endif
+}
+
+// lanes of mask stop with res at inst_addr after steps cycles
+inline void endLanes(LockstepMachine& m, LaneMask mask, int64_t steps, Result res, int32_t inst_addr)
+{
+    for(uint32_t l = 0; l < Lanes; ++l) {
+        if (mask >> l & 1) {
+            m.cycles[l] += steps;
+            m.result[l] = res;
+            m.inst_addr[l] = inst_addr;
+        }
+    }
+}
+
+// lanes of mask continue later from inst_addr after steps cycles,
+// or stop at the cycle limit like execute()
+inline void parkLanes(LockstepMachine& m, LaneMask mask, int64_t steps, int32_t inst_addr)
+{
+    for(uint32_t l = 0; l < Lanes; ++l) {
+        if (mask >> l & 1) {
+            m.cycles[l] += steps;
+            m.inst_addr[l] = inst_addr;
+            if (m.cycles[l] >= m.max_cycles)
+                m.result[l] = Result::InfiniteLoop;
+        }
+    }
+}
+
+// runs the lanes of active from pc (as Machine::inst_addr) until they
+// split, end, or pass below wait_pc, where other lanes wait
+inline void runLaneGroup(LockstepMachine& m, int32_t pc, LaneMask active, int32_t wait_pc)
+{
+    #define LaneAddr(ret, arg) \
+        const uint32_t ret = static_cast<uint32_t>(arg + data_offset); \
+        if (ret >= mem_size) { \
+            endLanes(m, active, steps, Result::InvalidDataAddr, inst); \
+            return; \
+        }
+    // lanes of bad stop with res, the group goes on with the rest
+    #define EndSomeLanes(bad, res) \
+        if (bad) { \
+            endLanes(m, bad, steps, res, inst); \
+            active &= ~(bad); \
+            if (!active) \
+                return; \
+            mask = getMaskVector(active); \
+        }
+    #define Row(addr) (mem + static_cast<size_t>(addr) * Lanes)
+    // a store below data_offset may change code of some lanes only
+    #define StoreTo(addr) \
+        if ((addr) < static_cast<uint32_t>(data_offset)) \
+            m.uniform_code = false;
+    #define CondJump(cond) { \
+        LaneAddr(addr2, arg2) \
+        const LaneInts v = loadRow(Row(addr2)); \
+        LaneMask taken = active & getMaskBits(cond); \
+        const int32_t target = inst + arg1; \
+        if (taken && ((arg1 % InstSize) != 0 || target < 0 || target >= m.mem_size)) { \
+            EndSomeLanes(taken, Result::InvalidJumpAddr) \
+            taken = 0; \
+        } \
+        if (taken == active) { \
+            pc = target + InstSize; \
+        } else if (taken) { \
+            parkLanes(m, taken, steps + 1, target + InstSize); \
+            parkLanes(m, active & ~taken, steps + 1, inst); \
+            return; \
+        } else { \
+            pc = inst; \
+        } \
+        break; \
+    }
+
+    int32_t* const mem = m.mem.data();
+    const uint32_t mem_size = static_cast<uint32_t>(m.mem_size);
+    const int32_t data_offset = m.data_offset;
+    int64_t budget = INT64_MAX;
+    for(uint32_t l = 0; l < Lanes; ++l) {
+        if ((active >> l & 1) && m.max_cycles - m.cycles[l] < budget)
+            budget = m.max_cycles - m.cycles[l];
+    }
+    LaneInts mask = getMaskVector(active);
+    int64_t steps = 0;
+    while(true) {
+        const int32_t inst = pc - InstSize;
+        if (inst < 0 || inst > m.mem_size - InstSize) {
+            endLanes(m, active, steps, Result::InvalidInstAddr, inst);
+            return;
+        }
+        const int32_t* code = Row(inst);
+        const uint32_t leader = static_cast<uint32_t>(__builtin_ctz(active));
+        const int32_t opcode = code[2 * Lanes + leader];
+        const int32_t arg1 = code[Lanes + leader];
+        const int32_t arg2 = code[leader];
+        // lanes which modified their code differently run later on their own
+        if (!m.uniform_code) {
+            const LaneMask same = active & getMaskBits((loadRow(code + 2 * Lanes) == opcode) &
+                (loadRow(code + Lanes) == arg1) & (loadRow(code) == arg2));
+            if (same != active) {
+                parkLanes(m, active & ~same, steps, pc);
+                active = same;
+                mask = getMaskVector(active);
+                wait_pc = pc;
+            }
+        }
+        switch(static_cast<OpCode>(opcode)) {
+        case OpCode::Nop:
+            pc = inst;
+            break;
+        case OpCode::Hlt:
+            endLanes(m, active, steps, Result::Halt, inst);
+            return;
+        case OpCode::Ja:
+        {
+            LaneAddr(addr1, arg1)
+            const int32_t* row = Row(addr1);
+            LaneMask bad = 0;
+            int32_t targets[Lanes];
+            for(uint32_t l = 0; l < Lanes; ++l) {
+                if (!(active >> l & 1))
+                    continue;
+                const int32_t rel_addr = row[l] + 1;
+                targets[l] = data_offset - InstSize + rel_addr;
+                if ((rel_addr % InstSize) != 0 || targets[l] < 0 || targets[l] >= m.mem_size)
+                    bad |= 1u << l;
+            }
+            EndSomeLanes(bad, Result::InvalidJumpAddr)
+            bool split = false;
+            for(uint32_t l = 0; l < Lanes; ++l)
+                split |= (active >> l & 1) && targets[l] != targets[__builtin_ctz(active)];
+            if (split) {
+                for(uint32_t l = 0; l < Lanes; ++l) {
+                    if (active >> l & 1)
+                        parkLanes(m, 1u << l, steps + 1, targets[l] + InstSize);
+                }
+                return;
+            }
+            pc = targets[__builtin_ctz(active)] + InstSize;
+            break;
+        }
+        case OpCode::Jr:
+        {
+            const int32_t target = inst + arg1;
+            if ((arg1 % InstSize) != 0 || target < 0 || target >= m.mem_size) {
+                endLanes(m, active, steps, Result::InvalidJumpAddr, inst);
+                return;
+            }
+            pc = target + InstSize;
+            break;
+        }
+        case OpCode::Jnz: CondJump(v != 0)
+        case OpCode::Jz: CondJump(v == 0)
+        case OpCode::Jg: CondJump(v > 0)
+        case OpCode::Jge: CondJump(v >= 0)
+        case OpCode::Jl: CondJump(v < 0)
+        case OpCode::Jle: CondJump(v <= 0)
+        case OpCode::Lia:
+        {
+            LaneAddr(addr1, arg1)
+            StoreTo(addr1)
+            storeRow(Row(addr1), LaneInts{} + (inst + InstSize - 1 + arg2 - data_offset), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::Ld:
+        {
+            LaneAddr(addr1, arg1)
+            LaneAddr(paddr2, arg2)
+            const LaneWords addr2 = reinterpret_cast<LaneWords>(loadRow(Row(paddr2))) + static_cast<uint32_t>(data_offset);
+            EndSomeLanes(active & getMaskBits(reinterpret_cast<LaneInts>(addr2 >= mem_size)), Result::InvalidDataAddr)
+            StoreTo(addr1)
+            storeRow(Row(addr1), gatherLanes(mem, addr2, active, mask), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::St:
+        case OpCode::Stv:
+        {
+            LaneAddr(paddr1, arg1)
+            const LaneWords addr1 = reinterpret_cast<LaneWords>(loadRow(Row(paddr1))) + static_cast<uint32_t>(data_offset);
+            EndSomeLanes(active & getMaskBits(reinterpret_cast<LaneInts>(addr1 >= mem_size)), Result::InvalidDataAddr)
+            if (active & getMaskBits(reinterpret_cast<LaneInts>(addr1 < static_cast<uint32_t>(data_offset))))
+                m.uniform_code = false;
+            if (static_cast<OpCode>(opcode) == OpCode::St) {
+                LaneAddr(addr2, arg2)
+                scatterLanes(mem, addr1, loadRow(Row(addr2)), active);
+            } else {
+                scatterLanes(mem, addr1, LaneInts{} + arg2, active);
+            }
+            pc = inst;
+            break;
+        }
+        case OpCode::Mov:
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        {
+            LaneAddr(addr1, arg1)
+            LaneAddr(addr2, arg2)
+            const LaneWords a = reinterpret_cast<LaneWords>(loadRow(Row(addr1)));
+            const LaneWords b = reinterpret_cast<LaneWords>(loadRow(Row(addr2)));
+            const OpCode code = static_cast<OpCode>(opcode);
+            const LaneWords v = code == OpCode::Mov ? b : code == OpCode::Add ? a + b : code == OpCode::Sub ? a - b : a * b;
+            StoreTo(addr1)
+            storeRow(Row(addr1), reinterpret_cast<LaneInts>(v), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::Movv:
+        case OpCode::Addv:
+        case OpCode::Subv:
+        case OpCode::Mulv:
+        {
+            LaneAddr(addr1, arg1)
+            const LaneWords a = reinterpret_cast<LaneWords>(loadRow(Row(addr1)));
+            const uint32_t b = static_cast<uint32_t>(arg2);
+            const OpCode code = static_cast<OpCode>(opcode);
+            const LaneWords v = code == OpCode::Movv ? LaneWords{} + b : code == OpCode::Addv ? a + b :
+                code == OpCode::Subv ? a - b : a * b;
+            StoreTo(addr1)
+            storeRow(Row(addr1), reinterpret_cast<LaneInts>(v), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::Div:
+        {
+            LaneAddr(addr1, arg1)
+            LaneAddr(addr2, arg2)
+            const LaneInts d = loadRow(Row(addr2));
+            EndSomeLanes(active & getMaskBits(d == 0), Result::DivByZero)
+            StoreTo(addr1)
+            // other lanes divide by 1
+            storeRow(Row(addr1), divideLanes(loadRow(Row(addr1)), (d & mask) | (~mask & 1)), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::Divv:
+        {
+            LaneAddr(addr1, arg1)
+            if (!arg2) {
+                endLanes(m, active, steps, Result::DivByZero, inst);
+                return;
+            }
+            StoreTo(addr1)
+            storeRow(Row(addr1), divideLanes(loadRow(Row(addr1)), LaneInts{} + arg2), active, mask);
+            pc = inst;
+            break;
+        }
+        case OpCode::Dbg:
+        {
+            LaneAddr(addr1, arg1)
+            const int32_t* row = Row(addr1);
+            for(uint32_t l = 0; l < Lanes; ++l) {
+                if (active >> l & 1)
+                    m.output[l]->dbg(static_cast<int32_t>(addr1), arg1, row[l]);
+            }
+            pc = inst;
+            break;
+        }
+        case OpCode::Dbgext:
+        {
+            for(uint32_t l = 0; l < Lanes; ++l) {
+                if (active >> l & 1) {
+                    const int64_t cycles = m.cycles[l] + steps;
+                    m.output[l]->dbgext(cycles, cycles - m.last_dbgext_cycles[l]);
+                    m.last_dbgext_cycles[l] = cycles;
+                }
+            }
+            pc = inst;
+            break;
+        }
+        default:
+            endLanes(m, active, steps, Result::InvalidOpCode, inst);
+            return;
+        }
+        // the group stops at the cycle limit of a lane, and where lanes wait
+        // or before passing them
+        if (++steps >= budget || pc <= wait_pc) {
+            parkLanes(m, active, steps, pc);
+            return;
+        }
+    }
+
+    #undef CondJump
+    #undef StoreTo
+    #undef Row
+    #undef EndSomeLanes
+    #undef LaneAddr
+}
+
+// runs every lane until it ends
+inline void runLanes(LockstepMachine& m)
+{
+    while(true) {
+        int32_t pc = INT32_MIN;
+        LaneMask running = 0;
+        for(uint32_t l = 0; l < Lanes; ++l) {
+            if (m.result[l] == Result::Continue) {
+                running |= 1u << l;
+                pc = m.inst_addr[l] > pc ? m.inst_addr[l] : pc;
+            }
+        }
+        if (!running)
+            return;
+        LaneMask active = 0;
+        int32_t wait_pc = INT32_MIN;
+        for(uint32_t l = 0; l < Lanes; ++l) {
+            if (!(running >> l & 1))
+                continue;
+            if (m.inst_addr[l] == pc)
+                active |= 1u << l;
+            else if (m.inst_addr[l] > wait_pc)
+                wait_pc = m.inst_addr[l];
+        }
+        runLaneGroup(m, pc, active, wait_pc);
+    }
+}
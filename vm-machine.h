@@ -0,0 +1,683 @@
+// VM machine state and reference interpreter
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define VM_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#endif
+#endif
+
+#include "vm.h"
+#include "vm-memory.h"
+
+enum class Result : int32_t
+{
+    Continue = 0,
+    Halt,
+    InfiniteLoop,
+    InvalidInstAddr,
+    InvalidDataAddr,
+    InvalidJumpAddr,
+    InvalidOpCode,
+    DivByZero,
+    Yield // runFor() budget or deadline reached, machine can be resumed
+};
+
+/*
+* Output of dbg and dbgext
+*
+* Every engine hands it to the OutputSink of the machine, which is
+* stdout in the text format of vm unless the host sets its own.
+*/
+
+class OutputSink
+{
+public:
+    virtual ~OutputSink() = default;
+    // addr is the memory index of the printed word, rel_addr its address
+    virtual void dbg(int32_t addr, int32_t rel_addr, int32_t value) = 0;
+    // diff is the count of cycles since the previous dbgext
+    virtual void dbgext(int64_t cycles, int64_t diff) = 0;
+};
+
+class StreamSink : public OutputSink
+{
+public:
+    explicit StreamSink(std::ostream& os) : os(os) {}
+
+    void dbg(int32_t addr, int32_t rel_addr, int32_t value) override
+    {
+        os << "dbg " << addr << " [" << rel_addr << "]: " << value << std::endl;
+    }
+
+    void dbgext(int64_t cycles, int64_t diff) override
+    {
+        os << "base cycles = " << cycles << ", diff = " << diff << std::endl;
+    }
+
+private:
+    std::ostream& os;
+};
+
+inline OutputSink* getStdoutSink()
+{
+    static StreamSink sink(std::cout);
+    return &sink;
+}
+
+struct ExecProfile;
+
+struct Machine
+{
+    int32_t inst_addr; // should be initialized to data_offset at start
+    int32_t data_offset;
+    int32_t mem_size;
+    int64_t cycles;
+    int64_t max_cycles;
+    int64_t last_dbgext_cycles;
+    MachineMemory mem;
+    OutputSink* output = getStdoutSink();
+    ExecProfile* profile = nullptr; // counted by execute() with a profiling policy
+};
+
+inline void writeDbgext(Machine& m, int64_t cycles)
+{
+    m.output->dbgext(cycles, cycles - m.last_dbgext_cycles);
+    m.last_dbgext_cycles = cycles;
+}
+
+/*
+* Execution policies
+*
+* execute() is a template over the features it checks or provides, and
+* disabled ones are compiled out of its instantiation:
+*   checked_addr - data bounds, jump alignment and bounds, fetch bounds
+*                  (unchecked is only valid for programs known not to
+*                  need them, otherwise behaviour is undefined),
+*   counted_cycles - cycle counter and the cycle limit,
+*   dbg - dbg and dbgext output,
+*   trace - every instruction is printed before it runs,
+*   guarded_data - data bounds are left to the guard region of guarded
+*                  memory, must be run under runGuarded(),
+*   profile - every instruction is counted into the ExecProfile of the
+*             machine, which must be set.
+* execute(m) without a policy is the fully checked CheckedPolicy.
+*/
+
+template<bool CheckedAddr, bool CountedCycles, bool Dbg, bool Trace, bool GuardedData = false, bool Profile = false>
+struct ExecPolicy
+{
+    static constexpr bool checked_addr = CheckedAddr;
+    static constexpr bool counted_cycles = CountedCycles;
+    static constexpr bool dbg = Dbg;
+    static constexpr bool trace = Trace;
+    static constexpr bool guarded_data = GuardedData;
+    static constexpr bool profile = Profile;
+};
+
+typedef ExecPolicy<true, true, true, false> CheckedPolicy;
+
+constexpr uint32_t OpCodeCount = static_cast<uint32_t>(OpCode::Dbgext) + 1;
+
+/*
+* Execution profile
+*
+* Executions of every program instruction (indexed as in the op array,
+* from data_offset down), taken counts of conditional jumps and executions
+* per opcode. Instructions run outside the program, e.g. code written into
+* data, are only counted per opcode and in outside. Only execute() with
+* the profile policy counts, so other instantiations don't pay for it.
+*/
+
+struct ExecProfile
+{
+    int32_t code_top; // data_offset, the first instruction is below it
+    std::vector<uint64_t> executed;
+    std::vector<uint64_t> taken;
+    std::array<uint64_t, OpCodeCount> opcodes; // valid opcodes only
+    uint64_t outside;
+};
+
+inline void resetExecProfile(ExecProfile& profile, const Machine& m, size_t inst_count)
+{
+    profile.code_top = m.data_offset;
+    profile.executed.assign(inst_count, 0);
+    profile.taken.assign(inst_count, 0);
+    profile.opcodes.fill(0);
+    profile.outside = 0;
+}
+
+// instruction index of inst_addr, or the instruction count when outside the program
+inline size_t getProfileIndex(const ExecProfile& profile, int32_t inst_addr)
+{
+    const int64_t offset = static_cast<int64_t>(profile.code_top) - InstSize - inst_addr;
+    if (offset < 0 || (offset % InstSize) != 0 || offset / InstSize >= static_cast<int64_t>(profile.executed.size()))
+        return profile.executed.size();
+    return static_cast<size_t>(offset / InstSize);
+}
+
+inline void profileInstruction(ExecProfile& profile, int32_t inst_addr, OpCode opcode)
+{
+    const size_t index = getProfileIndex(profile, inst_addr);
+    if (index < profile.executed.size())
+        ++profile.executed[index];
+    else
+        ++profile.outside;
+    if (static_cast<uint32_t>(opcode) < OpCodeCount)
+        ++profile.opcodes[static_cast<uint32_t>(opcode)];
+}
+
+inline void profileTaken(ExecProfile& profile, int32_t inst_addr)
+{
+    const size_t index = getProfileIndex(profile, inst_addr);
+    if (index < profile.taken.size())
+        ++profile.taken[index];
+}
+
+inline void traceInstruction(const Machine& m, int32_t inst_addr, OpCode opcode, int32_t arg1, int32_t arg2)
+{
+    const auto opcode_index = static_cast<uint32_t>(opcode);
+    std::cout << "trace " << inst_addr << " [" << (inst_addr - m.data_offset) << "]: "
+              << (opcode_index < opcode_def.size() ? opcode_def[opcode_index].first : "invalid")
+              << " " << arg1 << " " << arg2 << std::endl;
+}
+
+template<typename Policy>
+inline Result execute(Machine& m)
+{
+    #define GetAddr(ret, arg) \
+        const uint32_t ret = static_cast<uint32_t>(arg + m.data_offset); \
+        if (Policy::checked_addr && !Policy::guarded_data && ret >= static_cast<uint32_t>(m.mem_size)) \
+            return Result::InvalidDataAddr;
+    // accesses faulting in an order where a check would have come first
+    #define TouchAddr(addr) \
+        if (Policy::guarded_data) \
+            static_cast<void>(*static_cast<volatile const int32_t*>(&m.mem[addr]));
+    #define DoJump(base_addr, rel_addr) { \
+        if (Policy::checked_addr && (rel_addr % InstSize) != 0) \
+            return Result::InvalidJumpAddr; \
+        const int32_t inst_addr2 = base_addr + rel_addr; \
+        if (Policy::checked_addr && (inst_addr2 < 0 || inst_addr2 >= m.mem_size)) \
+            return Result::InvalidJumpAddr; \
+        m.inst_addr = inst_addr2 + InstSize; \
+    }
+    #define CondJump(base_addr, rel_addr) { \
+        if (Policy::profile) \
+            profileTaken(*m.profile, inst_addr); \
+        DoJump(base_addr, rel_addr) \
+    }
+
+    const int32_t inst_addr = m.inst_addr - InstSize;
+    m.inst_addr = inst_addr;
+    // a fault must find inst_addr and cycles stored
+    if (Policy::guarded_data)
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (Policy::checked_addr && (inst_addr < 0 || inst_addr > m.mem_size - InstSize))
+        return Result::InvalidInstAddr;
+    const OpCode opcode = static_cast<OpCode>(m.mem[static_cast<uint32_t>(inst_addr + 2)]);
+    const int32_t arg1 = m.mem[static_cast<uint32_t>(inst_addr + 1)];
+    const int32_t arg2 = m.mem[static_cast<uint32_t>(inst_addr)];
+    if (Policy::trace)
+        traceInstruction(m, inst_addr, opcode, arg1, arg2);
+    if (Policy::profile)
+        profileInstruction(*m.profile, inst_addr, opcode);
+    switch(opcode) {
+    case OpCode::Nop:
+        break;
+    case OpCode::Hlt:
+        return Result::Halt;
+    case OpCode::Ja:
+    {
+        GetAddr(addr1, arg1)
+        int32_t rel_addr = m.mem[addr1] + 1;
+        DoJump(m.data_offset - InstSize, rel_addr)
+        break;
+    }
+    case OpCode::Jr:
+    {
+        DoJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jnz:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] != 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jz:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] == 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jg:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] > 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jge:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] >= 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jl:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] < 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Jle:
+    {
+        GetAddr(addr2, arg2)
+        if (m.mem[addr2] <= 0)
+            CondJump(inst_addr, arg1)
+        break;
+    }
+    case OpCode::Lia:
+    {
+        GetAddr(addr1, arg1)
+        int32_t abs_addr = inst_addr + InstSize - 1 + arg2;
+        m.mem[addr1] = abs_addr - m.data_offset;
+        break;
+    }
+    case OpCode::Ld:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(paddr2, arg2)
+        GetAddr(addr2, m.mem[paddr2])
+        m.mem[addr1] = m.mem[addr2];
+        break;
+    }
+    case OpCode::St:
+    {
+        GetAddr(paddr1, arg1)
+        GetAddr(addr1, m.mem[paddr1])
+        GetAddr(addr2, arg2)
+        m.mem[addr1] = m.mem[addr2];
+        break;
+    }
+    case OpCode::Stv:
+    {
+        GetAddr(paddr1, arg1)
+        GetAddr(addr1, m.mem[paddr1])
+        m.mem[addr1] = arg2;
+        break;
+    }
+    case OpCode::Mov:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(addr2, arg2)
+        m.mem[addr1] = m.mem[addr2];
+        break;
+    }
+    case OpCode::Add:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(addr2, arg2)
+        m.mem[addr1] += m.mem[addr2];
+        break;
+    }
+    case OpCode::Sub:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(addr2, arg2)
+        m.mem[addr1] -= m.mem[addr2];
+        break;
+    }
+    case OpCode::Mul:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(addr2, arg2)
+        m.mem[addr1] *= m.mem[addr2];
+        break;
+    }
+    case OpCode::Div:
+    {
+        GetAddr(addr1, arg1)
+        GetAddr(addr2, arg2)
+        TouchAddr(addr1)
+        const int32_t d = m.mem[addr2];
+        if (!d)
+            return Result::DivByZero;
+        m.mem[addr1] /= d;
+        break;
+    }
+    case OpCode::Movv:
+    {
+        GetAddr(addr1, arg1)
+        m.mem[addr1] = arg2;
+        break;
+    }
+    case OpCode::Addv:
+    {
+        GetAddr(addr1, arg1)
+        m.mem[addr1] += arg2;
+        break;
+    }
+    case OpCode::Subv:
+    {
+        GetAddr(addr1, arg1)
+        m.mem[addr1] -= arg2;
+        break;
+    }
+    case OpCode::Mulv:
+    {
+        GetAddr(addr1, arg1)
+        m.mem[addr1] *= arg2;
+        break;
+    }
+    case OpCode::Divv:
+    {
+        GetAddr(addr1, arg1)
+        TouchAddr(addr1)
+        if (!arg2)
+            return Result::DivByZero;
+        m.mem[addr1] /= arg2;
+        break;
+    }
+    case OpCode::Dbg:
+    {
+        GetAddr(addr1, arg1)
+        TouchAddr(addr1)
+        if (Policy::dbg)
+            m.output->dbg(static_cast<int32_t>(addr1), arg1, m.mem[addr1]);
+        break;
+    }
+    case OpCode::Dbgext:
+    {
+        if (Policy::dbg)
+            writeDbgext(m, m.cycles);
+        break;
+    }
+    default:
+        return Result::InvalidOpCode;
+    }
+    if (Policy::counted_cycles && ++m.cycles >= m.max_cycles)
+        return Result::InfiniteLoop;
+
+    #undef CondJump
+    #undef DoJump
+    #undef TouchAddr
+    #undef GetAddr
+    return Result::Continue;
+}
+
+inline Result execute(Machine& m)
+{
+    return execute<CheckedPolicy>(m);
+}
+
+/*
+* Budgeted execution
+*
+* Engines take a budget of cycles and return Result::Continue when it
+* runs out before the program ends; the next call, with any engine,
+* resumes exactly where it stopped. runFor() runs such an engine for a
+* budget of cycles and an optional wall-clock deadline, which is checked
+* between slices of RunSliceCycles, and returns Result::Yield when one of
+* them stopped the machine. MachineSlices (and MachineTask, a C++20
+* coroutine, where available) wrap it for schedulers resuming a machine
+* one slice at a time.
+*/
+
+typedef std::chrono::steady_clock::time_point RunDeadline;
+
+const RunDeadline NoDeadline = RunDeadline::max();
+constexpr int64_t RunSliceCycles = 1 << 20;
+
+// cycle count at which a budget starting now ends, or the cycle limit if
+// that comes first (an engine runs at least one instruction anyway)
+inline int64_t getStopCycles(const Machine& m, int64_t budget)
+{
+    budget = std::max<int64_t>(budget, 0);
+    return budget < m.max_cycles - m.cycles ? m.cycles + budget : m.max_cycles;
+}
+
+// run(m, budget) is an engine returning Result::Continue after budget cycles
+template<typename Run>
+Result runFor(Machine& m, uint64_t budget, RunDeadline deadline, Run run)
+{
+    const bool timed = deadline != NoDeadline;
+    while(budget) {
+        if (timed && std::chrono::steady_clock::now() >= deadline)
+            break;
+        const uint64_t slice = std::min<uint64_t>(budget, timed ? RunSliceCycles : INT64_MAX);
+        const int64_t start_cycles = m.cycles;
+        const Result res = run(m, static_cast<int64_t>(slice));
+        if (res != Result::Continue)
+            return res;
+        budget -= std::min(budget, static_cast<uint64_t>(m.cycles - start_cycles));
+    }
+    return Result::Yield;
+}
+
+// the same on execute()
+inline Result runFor(Machine& m, uint64_t budget, RunDeadline deadline = NoDeadline)
+{
+    return runFor(m, budget, deadline, [](Machine& m, int64_t budget) {
+        const int64_t stop_cycles = getStopCycles(m, budget);
+        Result res;
+        do {
+            res = execute(m);
+        } while(res == Result::Continue && m.cycles < stop_cycles);
+        return res;
+    });
+}
+
+// a run of the machine as a sequence of slices, e.g.
+// "while(slices.next()) <run something else>"; the machine must outlive it
+template<typename Run>
+class MachineSlices
+{
+public:
+    MachineSlices(Machine& m, uint64_t slice, Run run) : m(m), slice(slice), run(run) {}
+
+    // runs the next slice, false once the machine stopped for good
+    bool next(RunDeadline deadline = NoDeadline)
+    {
+        if (res == Result::Yield)
+            res = runFor(m, slice, deadline, run);
+        return res == Result::Yield;
+    }
+
+    // final result, Result::Yield while it's running
+    Result result() const { return res; }
+
+private:
+    Machine& m;
+    uint64_t slice;
+    Run run;
+    Result res = Result::Yield;
+};
+
+template<typename Run>
+MachineSlices<Run> makeMachineSlices(Machine& m, uint64_t slice, Run run)
+{
+    return MachineSlices<Run>(m, slice, run);
+}
+
+#if VM_COROUTINES
+
+// coroutine running a machine, suspended after every slice,
+// see runMachineTask()
+class MachineTask
+{
+public:
+    struct promise_type
+    {
+        Result res = Result::Yield;
+
+        MachineTask get_return_object() { return MachineTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(Result) noexcept { return {}; }
+        void return_value(Result r) { res = r; }
+        void unhandled_exception() { std::terminate(); }
+    };
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    MachineTask(MachineTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    MachineTask(const MachineTask&) = delete;
+    MachineTask& operator=(const MachineTask&) = delete;
+    ~MachineTask() { if (handle) handle.destroy(); }
+
+    // runs the next slice, false once the machine stopped for good
+    bool resume()
+    {
+        if (!handle.done())
+            handle.resume();
+        return !handle.done();
+    }
+
+    // final result, Result::Yield while it's running
+    Result result() const { return handle.promise().res; }
+
+private:
+    explicit MachineTask(Handle handle) : handle(handle) {}
+    Handle handle;
+};
+
+// the machine must outlive the task, run is kept in it
+template<typename Run>
+MachineTask runMachineTask(Machine& m, uint64_t slice, Run run)
+{
+    Result res;
+    while((res = runFor(m, slice, NoDeadline, run)) == Result::Yield)
+        co_yield res;
+    co_return res;
+}
+
+#endif
+
+// cycle limit reported as infinite loop, set by resetMachine()
+constexpr int64_t DefaultMaxCycles = 500000000;
+
+// words below data_offset (the program and space for code) and from it,
+// code_space 0 is the default of 100000 words more than there are instructions
+struct MachineLayout
+{
+    int32_t code_space;
+    int32_t data_space;
+};
+
+constexpr MachineLayout DefaultLayout = {0, 1000000};
+
+// data_offset and mem_size of a program of inst_count instructions,
+// false if it doesn't fit the layout or it exceeds int32 addresses
+inline bool getMachineLayout(size_t inst_count, const MachineLayout& layout, int32_t& data_offset, int32_t& mem_size)
+{
+    const int64_t count = static_cast<int64_t>(inst_count);
+    const int64_t code_space = layout.code_space ? layout.code_space : count + 100000;
+    if (code_space < count * InstSize || layout.data_space <= 0 ||
+        code_space + layout.data_space > INT32_MAX)
+        return false;
+    data_offset = static_cast<int32_t>(code_space);
+    mem_size = data_offset + layout.data_space;
+    return true;
+}
+
+// false as for getMachineLayout()
+inline bool resetMachine(Machine& m, const std::vector<Op>& ops, const MachineLayout& layout = DefaultLayout)
+{
+    if (!getMachineLayout(ops.size(), layout, m.data_offset, m.mem_size))
+        return false;
+    m.cycles = 0;
+    m.max_cycles = DefaultMaxCycles;
+    m.last_dbgext_cycles = m.cycles;
+    m.inst_addr = m.data_offset;
+    m.mem.assign(static_cast<size_t>(m.mem_size), 0);
+    uint32_t ofs = static_cast<uint32_t>(m.data_offset);
+    for(const auto& op : ops) {
+        ofs -= InstSize;
+        m.mem[ofs + 2] = static_cast<int32_t>(op.code);
+        m.mem[ofs + 1] = op.arg1;
+        m.mem[ofs] = op.arg2;
+    }
+    return true;
+}
+
+// a copy of m to run on its own, O(1) for mapped memory, which both share
+// copy-on-write (MachineMemory::fork()); output goes to the same sink,
+// the profile (of m's engine) isn't copied
+inline Machine fork(const Machine& m)
+{
+    Machine copy;
+    copy.inst_addr = m.inst_addr;
+    copy.data_offset = m.data_offset;
+    copy.mem_size = m.mem_size;
+    copy.cycles = m.cycles;
+    copy.max_cycles = m.max_cycles;
+    copy.last_dbgext_cycles = m.last_dbgext_cycles;
+    copy.mem.fork(m.mem);
+    copy.output = m.output;
+    return copy;
+}
+
+inline void dumpMachine(const Machine& m, int32_t inst_count, int32_t data_count, std::ostream& os = std::cout)
+{
+    std::unordered_map<int32_t, std::string> opcodes;
+    for(const auto& p : opcode_def)
+        opcodes[static_cast<int32_t>(p.second)] = p.first;
+    os << "------------" << std::endl;
+    os << "memory dump:" << std::endl;
+    for(int32_t i = std::max(0, m.data_offset - inst_count*InstSize); i < m.data_offset; i += 3) {
+        auto it = opcodes.find(m.mem[static_cast<uint32_t>(i + 2)]);
+        os << i << " [" << (i - m.data_offset) << "]: " << m.mem[static_cast<uint32_t>(i)] << " "
+                  << m.mem[static_cast<uint32_t>(i + 1)] << " "
+                  << (it == opcodes.end() ? "invalid" : it->second) << std::endl;
+
+    }
+    os << "------------" << std::endl;
+    for(int32_t i = m.data_offset, cnt = std::min(i + data_count, m.mem_size); i < cnt; ++i)
+        os << i << " [" << (i - m.data_offset) << "]: " << m.mem[static_cast<uint32_t>(i)] << std::endl;
+}
+
+inline const char* getResult(Result res)
+{
+    switch(res) {
+    case Result::Continue: return "continue";
+    case Result::Halt: return "halt";
+    case Result::InfiniteLoop: return "infinite loop";
+    case Result::DivByZero: return "division by zero";
+    case Result::InvalidOpCode: return "invalid opcode";
+    case Result::InvalidDataAddr: return "invalid data addr";
+    case Result::InvalidInstAddr: return "invalid inst addr";
+    case Result::InvalidJumpAddr: return "invalid jump addr";
+    case Result::Yield: return "yield";
+    default:
+        return "unknown runtime error";
+    }
+}
@@ -0,0 +1,510 @@
+// VM machine memory backends
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#if defined(__linux__)
+#define VM_MAPPED_MEMORY 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define VM_GUARDED_MEMORY 1
+#include <setjmp.h>
+#include <signal.h>
+#endif
+#endif
+
+/*
+* Machine memory
+*
+* Vector backend is a plain zero-filled std::vector. Mapped backend is an
+* anonymous mapping, zeroed lazily by the kernel: pages cost nothing until
+* touched, so a large address space is cheap to reset. Guarded backend is
+* a mapping too, with the words ending on a page boundary followed by a
+* PROT_NONE reservation large enough for every uint32 word index: any data
+* address an instruction can compute (arg + data_offset as uint32) either
+* hits the memory or faults on the reservation, so the bounds check can be
+* left to the MMU. Faults are turned back into results by runGuarded().
+*
+* Mappings of at least HugePageSize bytes are aligned to huge pages and
+* either advised to use transparent huge pages or (explicit) mapped from
+* the hugetlb pool, which falls back to transparent ones when the pool
+* is empty.
+*
+* fork() copies memory in O(1) when it's mapped (not from the hugetlb
+* pool): the words are written once to a snapshot, a memfd, which the
+* source and every copy then map privately, so each side copies only the
+* pages it writes. The source keeps its snapshot while it has no pages of
+* its own (read from /proc/self/pagemap), so forking many copies of a
+* machine prepared once costs one snapshot, taken at the first fork.
+* Taking it remaps the source's pages, so forks of one source from
+* several threads are serialized by a mutex of the source; the source
+* must not be written meanwhile.
+*/
+
+#if VM_MAPPED_MEMORY
+struct MemorySnapshot
+{
+    int fd;
+
+    explicit MemorySnapshot(int fd) : fd(fd) {}
+    MemorySnapshot(const MemorySnapshot&) = delete;
+    MemorySnapshot& operator=(const MemorySnapshot&) = delete;
+    ~MemorySnapshot() { close(fd); }
+};
+#endif
+
+enum class MemoryBackend
+{
+    Vector,
+    Mapped,
+    Guarded
+};
+
+enum class HugePages
+{
+    Off,
+    Transparent,
+    Explicit
+};
+
+#if VM_MAPPED_MEMORY
+constexpr MemoryBackend DefaultMemoryBackend = MemoryBackend::Mapped;
+#else
+constexpr MemoryBackend DefaultMemoryBackend = MemoryBackend::Vector;
+#endif
+constexpr size_t HugePageSize = 2 << 20;
+
+class MachineMemory
+{
+public:
+    MemoryBackend backend = DefaultMemoryBackend;
+    HugePages huge_pages = HugePages::Transparent;
+
+    MachineMemory() = default;
+    MachineMemory(const MachineMemory&) = delete;
+    MachineMemory& operator=(const MachineMemory&) = delete;
+    MachineMemory(MachineMemory&& other) noexcept { swap(other); }
+    MachineMemory& operator=(MachineMemory&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            swap(other);
+        }
+        return *this;
+    }
+    ~MachineMemory() { release(); }
+
+    // reallocates count words set to value, mapped backends fall back to
+    // vector when the mapping can't be made; memory of the same size and
+    // backend is reused (a Vm reset for every program of a batch), the
+    // pages of a mapping dropped to zero them
+    void assign(size_t count, int32_t value)
+    {
+        if (count == count_ && backend == mapped_backend && huge_pages == mapped_huge_pages) {
+#if VM_MAPPED_MEMORY
+            // dropped pages of a snapshot would read it again
+            if (mapping && !snapshot && (!pages_size || madvise(pages, pages_size, MADV_DONTNEED) == 0)) {
+                if (value)
+                    std::fill(words, words + count, value);
+                return;
+            }
+#endif
+            if (!mapping) {
+                std::fill(vec.begin(), vec.end(), value);
+                return;
+            }
+        }
+        release();
+#if VM_MAPPED_MEMORY
+        if (backend != MemoryBackend::Vector && mapWords(count)) {
+            if (value)
+                std::fill(words, words + count, value);
+            return;
+        }
+#endif
+        backend = MemoryBackend::Vector;
+        vec.assign(count, value);
+        words = vec.data();
+        count_ = count;
+        mapped_backend = backend;
+        mapped_huge_pages = huge_pages;
+    }
+
+    // makes this memory a copy of other, sharing its pages copy-on-write
+    // where both can (see above), otherwise copying them
+    void fork(const MachineMemory& other)
+    {
+        release();
+        backend = other.mapped_backend;
+        huge_pages = other.mapped_huge_pages;
+#if VM_MAPPED_MEMORY
+        std::unique_lock<std::mutex> lock(other.fork_mutex);
+        if (other.mapping && !other.hugetlb_ && other.shareSnapshot()) {
+            if (mapWords(other.count_) && pages_size == other.pages_size &&
+                mapSnapshot(pages, pages_size, other.snapshot->fd)) {
+                snapshot = other.snapshot;
+                hugetlb_ = false;
+                return;
+            }
+            release();
+        }
+        lock.unlock();
+#endif
+        assign(other.count_, 0);
+        std::copy(other.words, other.words + other.count_, words);
+    }
+
+    int32_t* data() { return words; }
+    const int32_t* data() const { return words; }
+    size_t size() const { return count_; }
+    int32_t& operator[](size_t i) { return words[i]; }
+    const int32_t& operator[](size_t i) const { return words[i]; }
+
+    // word ranges [first, second) outside of which every word is zero:
+    // of a mapping the pages written or holding data of its snapshot, all
+    // words of other memory or when the page map can't be read
+    std::vector<std::pair<size_t, size_t>> getWrittenRanges() const
+    {
+        std::vector<std::pair<size_t, size_t>> ranges;
+#if VM_MAPPED_MEMORY
+        const std::vector<uint64_t> entries = mapping && !hugetlb_ ? readPageMap() : std::vector<uint64_t>();
+        if (!entries.empty()) {
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const std::vector<bool> data = getDataPages(entries);
+            // words end at the end of the pages
+            const size_t skipped = pages_size - count_ * sizeof(int32_t);
+            for(size_t i = 0; i < data.size(); ++i) {
+                if (!data[i])
+                    continue;
+                const size_t begin = std::max(i * page, skipped), end = (i + 1) * page;
+                if (begin >= end)
+                    continue;
+                const size_t first = (begin - skipped) / sizeof(int32_t), last = (end - skipped) / sizeof(int32_t);
+                if (!ranges.empty() && ranges.back().second == first)
+                    ranges.back().second = last;
+                else
+                    ranges.emplace_back(first, last);
+            }
+            return ranges;
+        }
+#endif
+        if (count_)
+            ranges.emplace_back(0, count_);
+        return ranges;
+    }
+
+    // address range faulting on out of bounds word indices (guarded backend)
+    const char* guardBegin() const { return reinterpret_cast<const char*>(words + count_); }
+    const char* guardEnd() const { return static_cast<const char*>(mapping) + mapping_size; }
+    // set when the words are on huge pages from the hugetlb pool
+    bool hugetlb() const { return hugetlb_; }
+
+private:
+    std::vector<int32_t> vec;
+    int32_t* words = nullptr;
+    size_t count_ = 0;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    char* pages = nullptr; // the accessible part of the mapping
+    size_t pages_size = 0;
+    MemoryBackend mapped_backend = MemoryBackend::Vector; // what words were allocated with
+    HugePages mapped_huge_pages = HugePages::Off;
+    bool hugetlb_ = false;
+#if VM_MAPPED_MEMORY
+    // what pages are a private mapping of, replaced by a fork after writes
+    mutable std::shared_ptr<MemorySnapshot> snapshot;
+    // held by fork() while it shares this memory's snapshot, not moved
+    mutable std::mutex fork_mutex;
+#endif
+
+    void swap(MachineMemory& other)
+    {
+        std::swap(backend, other.backend);
+        std::swap(huge_pages, other.huge_pages);
+        vec.swap(other.vec);
+        std::swap(words, other.words);
+        std::swap(count_, other.count_);
+        std::swap(mapping, other.mapping);
+        std::swap(mapping_size, other.mapping_size);
+        std::swap(pages, other.pages);
+        std::swap(pages_size, other.pages_size);
+        std::swap(mapped_backend, other.mapped_backend);
+        std::swap(mapped_huge_pages, other.mapped_huge_pages);
+        std::swap(hugetlb_, other.hugetlb_);
+#if VM_MAPPED_MEMORY
+        snapshot.swap(other.snapshot);
+#endif
+    }
+
+#if VM_MAPPED_MEMORY
+    bool mapWords(size_t count)
+    {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const bool huge = huge_pages != HugePages::Off && count * sizeof(int32_t) >= HugePageSize;
+        const size_t align = huge ? HugePageSize : page;
+        const size_t bytes = (count * sizeof(int32_t) + align - 1) / align * align;
+        const size_t guard = backend == MemoryBackend::Guarded ?
+            (static_cast<size_t>(UINT32_MAX) + 1) * sizeof(int32_t) : 0;
+        // reserve everything first, then make the words accessible
+        const size_t size = bytes + guard + (huge ? HugePageSize : 0);
+        void* p = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        char* start = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) / align * align);
+#ifdef MAP_HUGETLB
+        if (huge && huge_pages == HugePages::Explicit && bytes)
+            hugetlb_ = mmap(start, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED;
+#endif
+        // mapped over the reservation, which a failed hugetlb mapping may have dropped
+        if (!hugetlb_ && bytes) {
+            if (mmap(start, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                munmap(p, size);
+                return false;
+            }
+#ifdef MADV_HUGEPAGE
+            if (huge)
+                madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+        }
+        mapping = p;
+        mapping_size = size;
+        pages = start;
+        pages_size = bytes;
+        mapped_backend = backend;
+        mapped_huge_pages = huge_pages;
+        words = reinterpret_cast<int32_t*>(start + bytes) - count;
+        count_ = count;
+        return true;
+    }
+
+    // replaces the pages at start with a private mapping of the file, in
+    // one step, so they're left as they were on failure
+    static bool mapSnapshot(char* start, size_t size, int fd)
+    {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        if (mremap(p, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, start) == MAP_FAILED) {
+            munmap(p, size);
+            return false;
+        }
+        return true;
+    }
+
+    // /proc/self/pagemap entries of the pages, empty if it can't be read
+    std::vector<uint64_t> readPageMap() const
+    {
+        const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return {};
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        std::vector<uint64_t> entries(pages_size / page);
+        const size_t bytes = entries.size() * sizeof(uint64_t);
+        const off_t offset = static_cast<off_t>(reinterpret_cast<uintptr_t>(pages) / page * sizeof(uint64_t));
+        if (pread(fd, entries.data(), bytes, offset) != static_cast<ssize_t>(bytes))
+            entries.clear();
+        ::close(fd);
+        return entries;
+    }
+
+    // written since the page was mapped from the snapshot (or at all):
+    // swapped, or present and anonymous (not of the file). That includes
+    // the zero page, which pagemap shows the same way, so pages only read
+    // where the mapping had none make the next fork take a new snapshot
+    static bool isOwnPage(uint64_t entry)
+    {
+        return (entry >> 62 & 1) || ((entry >> 63 & 1) && !(entry >> 61 & 1));
+    }
+
+    // pages which may hold data: of their own or with data in the current
+    // snapshot, all of them when the page map is missing
+    std::vector<bool> getDataPages(const std::vector<uint64_t>& entries) const
+    {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        std::vector<bool> data(pages_size / page, entries.empty());
+        for(size_t i = 0; i < entries.size(); ++i)
+            data[i] = isOwnPage(entries[i]);
+        if (snapshot && !entries.empty()) {
+            for(off_t ofs = 0; (ofs = lseek(snapshot->fd, ofs, SEEK_DATA)) >= 0;) {
+                const off_t hole = lseek(snapshot->fd, ofs, SEEK_HOLE);
+                const off_t end = hole < 0 ? static_cast<off_t>(pages_size) : hole;
+                for(; ofs < end; ofs += static_cast<off_t>(page))
+                    data[static_cast<size_t>(ofs) / page] = true;
+            }
+        }
+        return data;
+    }
+
+    // the pages as a snapshot, with pages of zeros left as holes; only
+    // pages getDataPages() gives are read
+    std::shared_ptr<MemorySnapshot> writeSnapshot(const std::vector<uint64_t>& entries) const
+    {
+        const int fd = static_cast<int>(syscall(SYS_memfd_create, "vm-memory", MFD_CLOEXEC));
+        if (fd < 0)
+            return nullptr;
+        auto file = std::make_shared<MemorySnapshot>(fd);
+        if (ftruncate(fd, static_cast<off_t>(pages_size)) != 0)
+            return nullptr;
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const std::vector<bool> data = getDataPages(entries);
+        auto has_data = [&](size_t ofs) {
+            const uint64_t* p = reinterpret_cast<const uint64_t*>(pages + ofs);
+            return data[ofs / page] && std::any_of(p, p + page / sizeof(uint64_t), [](uint64_t v) { return v != 0; });
+        };
+        for(size_t ofs = 0; ofs < pages_size;) {
+            if (!has_data(ofs)) {
+                ofs += page;
+                continue;
+            }
+            size_t end = ofs + page;
+            while(end < pages_size && has_data(end))
+                end += page;
+            for(size_t done = ofs; done < end;) {
+                const ssize_t n = pwrite(fd, pages + done, end - done, static_cast<off_t>(done));
+                if (n <= 0)
+                    return nullptr;
+                done += static_cast<size_t>(n);
+            }
+            ofs = end;
+        }
+        return file;
+    }
+
+    // maps the pages from an up to date snapshot, false if that fails
+    bool shareSnapshot() const
+    {
+        const std::vector<uint64_t> entries = readPageMap();
+        if (snapshot && !entries.empty() && std::none_of(entries.begin(), entries.end(), isOwnPage))
+            return true;
+        auto file = writeSnapshot(entries);
+        if (!file || !mapSnapshot(pages, pages_size, file->fd))
+            return false;
+        snapshot = file;
+        return true;
+    }
+#endif
+
+    void release()
+    {
+#if VM_MAPPED_MEMORY
+        if (mapping)
+            munmap(mapping, mapping_size);
+#endif
+        mapping = nullptr;
+        mapping_size = 0;
+        pages = nullptr;
+        pages_size = 0;
+        mapped_backend = MemoryBackend::Vector;
+        mapped_huge_pages = HugePages::Off;
+        hugetlb_ = false;
+#if VM_MAPPED_MEMORY
+        snapshot.reset();
+#endif
+        std::vector<int32_t>().swap(vec);
+        words = nullptr;
+        count_ = 0;
+    }
+};
+
+#if VM_GUARDED_MEMORY
+
+// per thread: the guard range being watched and where to go on a fault
+struct GuardTrap
+{
+    sigjmp_buf env;
+    const char* begin;
+    const char* end;
+    bool armed;
+};
+
+inline GuardTrap& getGuardTrap()
+{
+    static thread_local GuardTrap trap;
+    return trap;
+}
+
+inline struct sigaction& getPrevSegvAction()
+{
+    static struct sigaction prev;
+    return prev;
+}
+
+inline void onGuardFault(int sig, siginfo_t* info, void* context)
+{
+    GuardTrap& trap = getGuardTrap();
+    const char* addr = static_cast<const char*>(info->si_addr);
+    if (trap.armed && addr >= trap.begin && addr < trap.end) {
+        trap.armed = false;
+        siglongjmp(trap.env, 1);
+    }
+    // not a guard fault: hand it to the previous handler, or fault again
+    // with the default action when returning
+    const struct sigaction& prev = getPrevSegvAction();
+    if ((prev.sa_flags & SA_SIGINFO) && prev.sa_sigaction)
+        prev.sa_sigaction(sig, info, context);
+    else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN)
+        prev.sa_handler(sig);
+    else
+        signal(sig, SIG_DFL);
+}
+
+// once per process, from any thread
+inline void installGuardHandler()
+{
+    static const bool installed = []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = &onGuardFault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        return sigaction(SIGSEGV, &sa, &getPrevSegvAction()) == 0;
+    }();
+    static_cast<void>(installed);
+}
+
+// runs fn() returning its result, or fault_result if it touched the guard
+// region of mem; machine state written before the faulting access is kept
+// as long as fn() publishes it with a signal fence
+template<typename R, typename Fn>
+R runGuarded(const MachineMemory& mem, R fault_result, Fn fn)
+{
+    installGuardHandler();
+    GuardTrap& trap = getGuardTrap();
+    if (sigsetjmp(trap.env, 1))
+        return fault_result;
+    trap.begin = mem.guardBegin();
+    trap.end = mem.guardEnd();
+    trap.armed = true;
+    const R res = fn();
+    trap.armed = false;
+    return res;
+}
+
+#endif
@@ -0,0 +1,166 @@
+// VM hardware performance counters
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#if defined(__linux__)
+#define VM_HW_COUNTERS 1
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+* Hardware counters
+*
+* HwCounterGroup opens the counters below for the calling thread, user
+* space only, as one perf_event_open group, so they count over the same
+* instructions and are multiplexed together (values are scaled by the
+* time the group was scheduled). Counters the processor, kernel or
+* virtual machine don't have are left out of the group and reported as
+* unavailable; when none can be opened start() returns false.
+*/
+
+enum class HwCounter
+{
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1dMisses,
+    LlcMisses,
+    DtlbMisses,
+    Count
+};
+
+constexpr uint32_t HwCounterCount = static_cast<uint32_t>(HwCounter::Count);
+
+inline const char* getHwCounterName(HwCounter counter)
+{
+    static const char* names[HwCounterCount] = {
+        "cycles", "instructions", "branch-misses", "l1d-misses", "llc-misses", "dtlb-misses"
+    };
+    return names[static_cast<uint32_t>(counter)];
+}
+
+struct HwCounts
+{
+    std::array<uint64_t, HwCounterCount> value{};
+    std::array<bool, HwCounterCount> available{};
+};
+
+class HwCounterGroup
+{
+public:
+    HwCounterGroup() { fd.fill(-1); }
+    HwCounterGroup(const HwCounterGroup&) = delete;
+    HwCounterGroup& operator=(const HwCounterGroup&) = delete;
+    ~HwCounterGroup() { close(); }
+
+    // opens the group and starts counting on the calling thread,
+    // false if no counter is available
+    bool start()
+    {
+        close();
+#if VM_HW_COUNTERS
+        for(uint32_t i = 0; i < HwCounterCount; ++i) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            getConfig(static_cast<HwCounter>(i), attr.type, attr.config);
+            attr.disabled = leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fd[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fd[i] >= 0 && leader < 0)
+                leader = fd[i];
+            if (fd[i] >= 0)
+                order[count++] = i;
+        }
+        if (leader < 0)
+            return false;
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // stops counting and adds the counts since start() to counts
+    void stop(HwCounts& counts)
+    {
+#if VM_HW_COUNTERS
+        if (leader < 0)
+            return;
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        uint64_t data[3 + HwCounterCount];
+        const ssize_t size = read(leader, data, sizeof(data));
+        if (size >= static_cast<ssize_t>(3 * sizeof(uint64_t)) && data[0] == count) {
+            const uint64_t enabled = data[1], running = data[2];
+            // a group never scheduled counted nothing
+            for(uint32_t k = 0; k < count && running; ++k) {
+                uint64_t value = data[3 + k];
+                if (running < enabled)
+                    value = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+                counts.value[order[k]] += value;
+                counts.available[order[k]] = true;
+            }
+        }
+        close();
+#else
+        static_cast<void>(counts);
+#endif
+    }
+
+private:
+    std::array<int, HwCounterCount> fd;
+    std::array<uint32_t, HwCounterCount> order{}; // counters in group read order
+    uint32_t count = 0;
+    int leader = -1;
+
+#if VM_HW_COUNTERS
+    static void getConfig(HwCounter counter, __u32& type, __u64& config)
+    {
+        const __u64 read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        type = PERF_TYPE_HARDWARE;
+        switch(counter) {
+        case HwCounter::Cycles: config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case HwCounter::Instructions: config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case HwCounter::BranchMisses: config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case HwCounter::L1dMisses: type = PERF_TYPE_HW_CACHE; config = PERF_COUNT_HW_CACHE_L1D | read_miss; break;
+        case HwCounter::LlcMisses: type = PERF_TYPE_HW_CACHE; config = PERF_COUNT_HW_CACHE_LL | read_miss; break;
+        default: type = PERF_TYPE_HW_CACHE; config = PERF_COUNT_HW_CACHE_DTLB | read_miss; break;
+        }
+    }
+#endif
+
+    void close()
+    {
+#if VM_HW_COUNTERS
+        // members first, the leader last
+        for(uint32_t k = count; k-- > 0;)
+            ::close(fd[order[k]]);
+#endif
+        fd.fill(-1);
+        count = 0;
+        leader = -1;
+    }
+};
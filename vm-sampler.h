@@ -0,0 +1,198 @@
+// VM sampling profiler support
+// Copyright (C) 2019 Tomasz Dobrowolski
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#if defined(__linux__)
+#define VM_SAMPLING_TIMER 1
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+/*
+* Sampling
+*
+* A SampleTimer sends SIGPROF to the thread which started it every
+* interval of that thread's CPU time, and the handler only counts the
+* tick. Engines keep the instruction address in registers and store it
+* into the machine when a budget ends, so the thread running the machine
+* takes the sample itself, between short slices of the engine, when it
+* sees a tick. Samples go through a SampleRing, a lock-free queue with
+* one producer and one consumer, which another thread may drain while
+* the machine runs.
+*/
+
+constexpr uint32_t MaxSampleDepth = 8;
+
+struct Sample
+{
+    uint32_t weight; // timer ticks the sample stands for
+    uint32_t depth; // levels in index
+    uint32_t program_levels; // bit per level running a copy of the program
+    std::array<int32_t, MaxSampleDepth + 1> index; // instruction at every level, outermost first
+};
+
+class SampleRing
+{
+public:
+    static constexpr uint64_t Size = 1024;
+
+    // false (and counted as dropped) when the consumer is behind by Size samples
+    bool push(const Sample& sample)
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= Size) {
+            dropped_.fetch_add(sample.weight, std::memory_order_relaxed);
+            return false;
+        }
+        slots[head % Size] = sample;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(Sample& sample)
+    {
+        const uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return false;
+        sample = slots[tail % Size];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t size() const
+    {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    std::array<Sample, Size> slots;
+    std::atomic<uint64_t> head_{0};
+    std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+#if VM_SAMPLING_TIMER
+
+// per thread: tick counter of the running timer
+inline std::atomic<uint32_t>*& getSampleTicks()
+{
+    static thread_local std::atomic<uint32_t>* ticks = nullptr;
+    return ticks;
+}
+
+inline void onSampleTick(int)
+{
+    std::atomic<uint32_t>* ticks = getSampleTicks();
+    if (ticks)
+        ticks->fetch_add(1, std::memory_order_relaxed);
+}
+
+// once per process, from any thread
+inline bool installSampleHandler()
+{
+    static const bool installed = []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &onSampleTick;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        return sigaction(SIGPROF, &sa, nullptr) == 0;
+    }();
+    return installed;
+}
+
+#endif
+
+class SampleTimer
+{
+public:
+    SampleTimer() = default;
+    SampleTimer(const SampleTimer&) = delete;
+    SampleTimer& operator=(const SampleTimer&) = delete;
+    ~SampleTimer() { stop(); }
+
+    // ticks every interval_us of CPU time of the calling thread until stop(),
+    // which must be called on the same thread; false where not available
+    bool start(uint32_t interval_us)
+    {
+        stop();
+#if VM_SAMPLING_TIMER
+        if (!interval_us || !installSampleHandler())
+            return false;
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0)
+            return false;
+        prev_ticks = getSampleTicks();
+        getSampleTicks() = &ticks;
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = static_cast<time_t>(interval_us / 1000000);
+        spec.it_interval.tv_nsec = static_cast<long>(interval_us % 1000000) * 1000;
+        spec.it_value = spec.it_interval;
+        if (timer_settime(timer, 0, &spec, nullptr) != 0) {
+            timer_delete(timer);
+            getSampleTicks() = prev_ticks;
+            return false;
+        }
+        running = true;
+        return true;
+#else
+        static_cast<void>(interval_us);
+        return false;
+#endif
+    }
+
+    void stop()
+    {
+#if VM_SAMPLING_TIMER
+        if (!running)
+            return;
+        timer_delete(timer);
+        getSampleTicks() = prev_ticks;
+        running = false;
+#endif
+    }
+
+    // ticks since the previous call
+    uint32_t takeTicks()
+    {
+        return ticks.load(std::memory_order_relaxed) ? ticks.exchange(0, std::memory_order_relaxed) : 0;
+    }
+
+private:
+    std::atomic<uint32_t> ticks{0};
+    bool running = false;
+#if VM_SAMPLING_TIMER
+    timer_t timer;
+    std::atomic<uint32_t>* prev_ticks = nullptr;
+#endif
+};
@@ -113,3 +113,12 @@ const static std::vector<std::pair<std::string, OpCode>> opcode_def{
     { "dbg", OpCode::Dbg },
     { "dbgext", OpCode::Dbgext },
 };
+
+constexpr int32_t InstSize = 3; // every instruction is 3x int32
+
+struct Op
+{
+    OpCode code;
+    int32_t arg1;
+    int32_t arg2;
+};